@@ -211,6 +211,7 @@ mov [PHYS(pmm_frames)], edx
 xor eax, eax
 not eax ; this will set EAX to 0xFFFFFFFF (which means all frames will be initially marked as unavailable)
 mov ecx, edx
+add ecx, 31 ; round up so that the last partial word is wiped too
 shr ecx, 5 ; equivalent to ECX / 32
 rep stosd
 jmp _vmm
@@ -15,6 +15,7 @@
 #include <fs/vfs.h>
 #include <fs/tarfs.h>
 #include <fs/memfs.h>
+#include <mm/kheap.h>
 
 #define INITRD_PATH                             "/initrd.tar"
 
@@ -62,6 +63,8 @@ int ktgt_preinit() {
                 /* we've found the initrd file - let's load it as VFS root */
                 vfs_root = tar_init((void*) modules[i].mod_start, modules[i].mod_end - modules[i].mod_start, NULL);
                 memfs_mount(vfs_traverse_path(NULL, "/boot/initrd.tar"), (void*) modules[i].mod_start, modules[i].mod_end - modules[i].mod_start, false);
+                kheap_core_stats_t heap_stats; kheap_get_core_stats(&heap_stats);
+                kdebug("kernel heap after loading initrd: %u bytes, %u expansion(s), %u frame(s) mapped (%u on first touch)", kheap_get_size(), heap_stats.grows, heap_stats.frames, heap_stats.faults);
             }
         }
     } else kwarn("kernel has been loaded without any modules");
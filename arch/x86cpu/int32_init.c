@@ -2,5 +2,5 @@
 #include <mm/vmm.h>
 
 void int32_init() {
-    vmm_pgmap(vmm_kernel, 0x7000, 0x7000, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW);
+    vmm_map(vmm_kernel, 0x7000, 0x7000, 4096, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW); // this also keeps the page from being handed out for task stacks
 }
\ No newline at end of file
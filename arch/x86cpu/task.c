@@ -4,15 +4,17 @@
 #include <hal/intr.h>
 #include <mm/vmm.h>
 #include <mm/kheap.h>
+#include <mm/slab.h>
 #include <stdlib.h>
 #include <string.h>
 
 static size_t task_size = sizeof(task_t); // size of each task structure (including extended registers)
+static kmem_cache_t* task_cache = NULL; // cache for task structures (set up by task_init())
 
 extern uint16_t x86ext_on;
 
 void* task_create_stub(bool user) {
-    task_t* task = kmemalign(16, task_size);
+    task_t* task = kmem_cache_alloc(task_cache);
     if(!task) {
         kerror("cannot allocate memory for new task");
         return NULL;
@@ -31,7 +33,7 @@ void* task_create_stub(bool user) {
 }
 
 void task_delete_stub(void* task) {
-    kfree(task);
+    kmem_cache_free(task_cache, task);
 }
 
 uintptr_t task_get_iptr(void* task) {
@@ -82,6 +84,8 @@ void task_init() {
         }
     }
     kdebug("task structure size with regs_ext: %u", task_size);
+    task_cache = kmem_cache_create("task", task_size, 16, NULL); // FXSAVE needs 16-byte alignment
+    kassert(task_cache);
     intr_handle(0x9F, (void*) &task_do_yield_noirq);
     task_init_stub();
 }
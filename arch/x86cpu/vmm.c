@@ -6,8 +6,6 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <arch/x86cpu/task.h>
-#include <exec/process.h>
 
 /* MMU data types */
 typedef union {
@@ -63,6 +61,8 @@ vmm_pde_t vmm_default_pd[1024] __attribute__((aligned(4096))); // for bootstrap
 
 extern uintptr_t __rmap_start; // recursive mapping region start address (in link.ld)
 extern uintptr_t __rmap_end;
+extern uintptr_t __dmap_start; // direct map region (in link.ld)
+extern uintptr_t __dmap_end;
 
 size_t vmm_pgsz_num() {
 	return 2;
@@ -81,24 +81,93 @@ size_t vmm_pgsz(size_t idx) {
 #define vmm_pd(base)							((vmm_pde_t*) vmm_pt(base, VMM_PD_PTE)) // retrieve page directory virtual address given the base ptr
 
 #define VMM_AVAIL_TRAPPED						(1 << 0)
+#define VMM_AVAIL_SHARED						(1 << 1) // PD entry: the page table is shared copy-on-write with other VMM configs (the entry is read-only)
+
+/* gives vmm its own copy of the page table behind a shared PD entry, returning false if there was nothing to do (or on failure) */
+static bool vmm_pt_unshare(void* vmm, vmm_pde_t* pd_entry) {
+	if(!pd_entry->dword || pd_entry->entry.pgsz || !(pd_entry->entry.avail & VMM_AVAIL_SHARED)) return false;
+
+	size_t pt_frame = pd_entry->entry.pt;
+	pmm_page_t* page = pmm_page(pt_frame); // page tables are only shared with frame descriptors available
+	if(atomic_load_explicit(&page->refcount, memory_order_relaxed) > 1) {
+		/* copy the page table - its pages are shared copy-on-write from now on */
+		size_t frame = pmm_alloc_free(1);
+		if(frame == (size_t)-1) {
+			kerror("cannot allocate page table for unsharing");
+			return false;
+		}
+		vmm_pte_t* pt_src = (vmm_pte_t*) vmm_kmap(pt_frame << 12);
+		vmm_pte_t* pt_dst = (vmm_pte_t*) vmm_kmap(frame << 12);
+		if(!pt_src || !pt_dst) {
+			kerror("cannot map page tables for unsharing");
+			vmm_kunmap(pt_src); vmm_kunmap(pt_dst);
+			pmm_free(frame);
+			return false;
+		}
+		for(size_t i = 0; i < 1024; i++) {
+			if(pt_src[i].entry.present) {
+				pmm_page_ref(pt_src[i].entry.pa); // our copy references the frame too
+				if(pt_src[i].entry.rw) {
+					/* the other VMM configs sharing the table cannot write through it anyway */
+					pt_src[i].entry.rw = 0;
+					pt_src[i].entry.avail |= VMM_AVAIL_TRAPPED;
+				}
+			}
+			pt_dst[i].dword = pt_src[i].dword;
+		}
+		vmm_kunmap(pt_src); vmm_kunmap(pt_dst);
+		pmm_page_mark(frame, 1, PMM_PAGE_KERNEL | PMM_PAGE_PT, vmm);
+		pd_entry->entry.pt = frame;
+		pmm_page_unref(pt_frame);
+	} // otherwise, everyone else has let go of the table and it's ours
+
+	pd_entry->entry.avail &= ~VMM_AVAIL_SHARED;
+	pd_entry->entry.rw = 1;
+	if(vmm == vmm_current) __asm__ __volatile__("mov %0, %%cr3" : : "r"(vmm_current) : "memory"); // flush the old table's translations (and its recursive mapping)
+	return true;
+}
+
+/* drops vmm's reference to the page table behind a PD entry */
+static void vmm_pt_free(vmm_pde_t* pd_entry) {
+	if(pd_entry->entry.avail & VMM_AVAIL_SHARED) pmm_page_unref(pd_entry->entry.pt);
+	else pmm_free(pd_entry->entry.pt);
+}
+
+/* set once vmm_clone() has copied the kernel space PDEs into another VMM config - from then on, they must stay as they are */
+static bool vmm_kernel_shared = false;
+
+/* checks that the kernel space PDE covering va can still be changed - every VMM config has its own copy of it once vmm_clone() has been called */
+static bool vmm_kernel_pde_check(uintptr_t va) {
+	if(va < kernel_start || !vmm_kernel_shared) return true;
+	kerror("cannot change kernel page directory entry for 0x%x after it has been shared", va);
+	return false;
+}
+
+/* checks if va is in kernel space and covered by a page table (all kernel space outside the direct map is, see vmm_init()) */
+static bool vmm_kernel_pt(uintptr_t va) {
+	if(va < kernel_start) return false;
+	vmm_pde_t* pd_entry = &vmm_pd(&__rmap_start)[va >> 22]; // kernel space PDEs are the same in every VMM config
+	return (pd_entry->dword && !pd_entry->entry.pgsz);
+}
 
 void vmm_pgmap_small(void* vmm, uintptr_t pa, uintptr_t va, size_t flags) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	vmm_pte_t* pt = NULL; // page table
 	if(!pd) {
 		kerror("cannot map page directory");
 		return;
 	} else if(pd[pde].dword && !pd[pde].entry.pgsz) {
 		/* there's a PT to access too */
+		vmm_pt_unshare(vmm, &pd[pde]);
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
@@ -112,10 +181,16 @@ void vmm_pgmap_small(void* vmm, uintptr_t pa, uintptr_t va, size_t flags) {
 	if(pse) invalidate_tlb = invalidate_tlb || (pde_orig.entry_pse.global); // invalidate TLB if this was a global hugepage
 
 	if(!pt) {
+		if(!vmm_kernel_pde_check(va)) {
+			if(pd_map) vmm_kunmap(pd);
+			return;
+		}
+
 		/* allocate page table */
-		size_t frame = pmm_alloc_free(1); // ask for a single contiguous free frame
+		size_t frame = pmm_alloc_free_flags(1, PMM_ZEROED); // ask for a single zero-filled frame
 		if(frame == (size_t)-1) kerror("no more free frames, brace for impact");
 		else {
+			pmm_page_mark(frame, 1, PMM_PAGE_KERNEL | PMM_PAGE_PT, vmm);
 			// pmm_alloc(frame);			
 			pd_entry->dword = (frame << 12) | (1 << 0) | (1 << 1); // all the other flags will be filled in for us, but we must have present and rw
 			if(pse) { // transfer the flags over
@@ -126,10 +201,10 @@ void vmm_pgmap_small(void* vmm, uintptr_t pa, uintptr_t va, size_t flags) {
 
 			if(pd_map) {
 				/* map PT */
-				pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW); // speed up lookup by basing it off pd
+				pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 				if(!pt) {
 					kerror("cannot map page table");
-					vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+					vmm_kunmap(pd);
 					return;
 				}
 			} else {
@@ -137,26 +212,6 @@ void vmm_pgmap_small(void* vmm, uintptr_t pa, uintptr_t va, size_t flags) {
 				pt = vmm_pt(&__rmap_start, pde);
 				__asm__ __volatile__("invlpg (%0)" : : "r"(pt) : "memory"); // invalidate TLB entry for our PT so we don't end up with wrong page faults
 			}
-			memset(pt, 0, 4096); // clear out the newly allocated page table
-			
-			if(task_kernel && va >= kernel_start) {
-				/* propagate kernel pages to all tasks' VMM configs */
-				vmm_pde_t* task_vmm_pd = (vmm_pde_t*) vmm_alloc_map(vmm_current, 0, 4096, (pd_map) ? ((uintptr_t) pt + 4096) : 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW);
-				if(!task_vmm_pd) kerror("cannot map task VMM configurations for page table propagation");
-				else {
-					task_t* task = task_kernel;
-					struct proc* proc = proc_get(task_common(task)->pid);
-					do {
-						if(proc->vmm != vmm) {
-							/* map page directory and copy PD entry over */
-							vmm_set_paddr(vmm_current, (uintptr_t) task_vmm_pd, (uintptr_t) proc->vmm);
-							task_vmm_pd[pde].dword = pd_entry->dword;
-						}
-						task = task->common.next;
-					} while(task != task_kernel);
-					vmm_pgunmap(vmm_current, (uintptr_t) task_vmm_pd, 0);
-				}
-			}
 		}
 
 		/* remap any PSE pages */
@@ -203,8 +258,8 @@ void vmm_pgmap_small(void* vmm, uintptr_t pa, uintptr_t va, size_t flags) {
 
 	if(pd_map) {
 		/* unmap PD and PT */
-		vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
-		vmm_pgunmap(vmm_current, (uintptr_t) pt, 0); // PT is supposed to be non-NULL
+		vmm_kunmap(pd);
+		vmm_kunmap(pt); // PT is supposed to be non-NULL
 	}
 }
 
@@ -212,18 +267,22 @@ void vmm_pgmap_huge(void* vmm, uintptr_t pa, uintptr_t va, size_t flags) {
 	size_t pde = va >> 22; // page directory entry number for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return;
 	}
+	if(!vmm_kernel_pde_check(va)) {
+		if(pd_map) vmm_kunmap(pd);
+		return;
+	}
 	vmm_pde_t* pd_entry = &pd[pde]; // PD entry
 
 	bool invalidate_tlb = (vmm == vmm_current); // set if the TLB is to be invalidated
 
 	if(pd_entry->dword && !pd_entry->entry.pgsz) {
 		/* there's a page table for this PDE - deallocate it to avoid confusion */
-		pmm_free(((vmm_pde_t*)pd_entry)->entry.pt);
+		vmm_pt_free(pd_entry);
 		pd_entry->dword = 0; // quick way to unmap page
 		if(!pd_map) __asm__ __volatile__("invlpg (%0)" : : "r"(vmm_pt(&__rmap_start, pde)) : "memory"); // invalidate TLB entry for the PT as a safety measure
 	}
@@ -240,25 +299,6 @@ void vmm_pgmap_huge(void* vmm, uintptr_t pa, uintptr_t va, size_t flags) {
 	pd_entry->entry_pse.accessed = 0; pd_entry->entry_pse.dirty = 0;
 	pd_entry->entry_pse.avail = (flags & VMM_FLAGS_TRAPPED) ? VMM_AVAIL_TRAPPED : 0;
 
-	if(task_kernel && va >= kernel_start) {
-		/* propagate kernel pages to all tasks' VMM configs */
-		vmm_pde_t* task_vmm_pd = (vmm_pde_t*) vmm_alloc_map(vmm_current, 0, 4096, (pd_map) ? ((uintptr_t) pd + 4096) : 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW);
-		if(!task_vmm_pd) kerror("cannot map task VMM configurations for page table propagation");
-		else {
-			task_t* task = task_kernel;
-			struct proc* proc = proc_get(task_common(task)->pid);
-			do {
-				if(proc->vmm != vmm) {
-					/* map page directory and copy PD entry over */
-					vmm_set_paddr(vmm_current, (uintptr_t) task_vmm_pd, (uintptr_t) proc->vmm);
-					task_vmm_pd[pde].dword = pd_entry->dword;
-				}
-				task = task->common.next;
-			} while(task != task_kernel);
-			vmm_pgunmap(vmm_current, (uintptr_t) task_vmm_pd, 0);
-		}
-	}
-
 	if(invalidate_tlb) {
 		/* invalidate TLB if needed */
 		for(size_t i = 0; i < 1024; i++, va += 1024) {
@@ -267,7 +307,7 @@ void vmm_pgmap_huge(void* vmm, uintptr_t pa, uintptr_t va, size_t flags) {
 	}
 
 	if(pd_map) {
-		vmm_pgunmap(vmm_current, (uintptr_t) pd, 0); // unmap PD
+		vmm_kunmap(pd); // unmap PD
 	}
 }
 
@@ -279,49 +319,48 @@ void vmm_pgmap(void* vmm, uintptr_t pa, uintptr_t va, size_t pgsz_idx, size_t fl
 
 	switch(pgsz_idx) {
 		case 0: vmm_pgmap_small(vmm, pa, va, flags); break;
-		case 1: vmm_pgmap_huge(vmm, pa, va, flags); break;
+		case 1:
+			if(vmm_kernel_pt(va)) {
+				/* the PDE has to keep pointing to the PT that all VMM configs share, so the hugepage goes in there as small pages */
+				for(size_t i = 0; i < 1024; i++) vmm_pgmap_small(vmm, (pa & 0xFFC00000) + (i << 12), (va & 0xFFC00000) + (i << 12), flags);
+			} else vmm_pgmap_huge(vmm, pa, va, flags);
+			break;
 		default:
 			kerror("invalid page size index %u", pgsz_idx);
 			break;
 	}
 }
 
-static void vmm_unmap_resolve_cow(void* vmm, uintptr_t va, size_t pgsz) {
-	/* resolve any remaining CoW traps */
-	vmm_trap_t* cow = vmm_is_cow(vmm, va, true);
-	while(cow) {
-		vmm_trap_t* src = (vmm_trap_t*) cow->info;
-		// kdebug("resolving CoW: 0x%x:0x%x <-- 0x%x:0x%x", src->vmm, src->vaddr, cow->vmm, cow->vaddr);
-		vmm_cow_duplicate(src->vmm, src->vaddr, pgsz);
-		cow = vmm_is_cow(vmm, va, true);
-	}
+static void vmm_unmap_resolve_cow(void* vmm, uintptr_t va) {
+	/* drop any remaining CoW traps - whoever is left sharing the frame will copy it (or take it over) on its next write */
+	vmm_cow_release(vmm, va);
 }
 
 void vmm_pgunmap_huge(void* vmm, uintptr_t va) {
 	size_t pde = va >> 22; // page directory entry number for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return;
 	}
 	vmm_pde_t* pd_entry = &pd[pde]; // PD entry
-	if(!pd_entry->dword) goto done; // nothing to do
+	if(!pd_entry->dword || !vmm_kernel_pde_check(va)) goto done; // nothing to do (or nothing we can do)
 
 	size_t invalidate_tlb = (vmm == vmm_current);
 
 	if(!pd_entry->entry.pgsz) {
 		/* there's a PT behind this - deallocate it. but first we'll need to invalidate the TLB of global pages if there's any (and if it's needed) */
-		vmm_pte_t* pt = ((pd_map) ? (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT) : vmm_pt(&__rmap_start, pde));
+		vmm_pte_t* pt = ((pd_map) ? (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12) : vmm_pt(&__rmap_start, pde));
 		for(size_t i = 0; i < 1024; i++) {
 			if(!invalidate_tlb && pt[i].entry.global) __asm__ __volatile__("invlpg (%0)" : : "r"(va | (i << 12)) : "memory");
-			if(pt[i].entry.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(vmm, va | (i << 12), 0);
+			if(pt[i].entry.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(vmm, va | (i << 12));
 		}
-		pmm_free(pd_entry->entry.pt);
+		vmm_pt_free(pd_entry); // if the PT is shared, its pages stay with whoever else is sharing it
 		if(!pd_map) __asm__ __volatile__("invlpg (%0)" : : "r"(pt) : "memory");
-		else vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
-	} else if(pd_entry->entry_pse.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(vmm, va, 1); // resolve CoW if needed
+		else vmm_kunmap(pt);
+	} else if(pd_entry->entry_pse.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(vmm, va); // resolve CoW if needed
 
 	pd_entry->dword = 0;
 
@@ -333,7 +372,7 @@ void vmm_pgunmap_huge(void* vmm, uintptr_t va) {
 
 done:
 	if(pd_map) {
-		vmm_pgunmap(vmm_current, (uintptr_t) pd, 0); // unmap PD
+		vmm_kunmap(pd); // unmap PD
 	}
 }
 
@@ -341,19 +380,20 @@ void vmm_pgunmap_small(void* vmm, uintptr_t va) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	vmm_pte_t* pt = NULL; // page table
 	if(!pd) {
 		kerror("cannot map page directory");
 		return;
 	} else if(pd[pde].dword && !pd[pde].entry.pgsz) {
 		/* there's a PT to access too */
+		vmm_pt_unshare(vmm, &pd[pde]);
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
@@ -366,10 +406,11 @@ void vmm_pgunmap_small(void* vmm, uintptr_t va) {
 	if(!pd_entry->entry.pgsz) {
 		/* unmapping small page */
 		invalidate_tlb = invalidate_tlb || (pt[pte].entry.global);
-		if(pt[pte].entry.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(vmm, va, 0);
+		if(pt[pte].entry.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(vmm, va);
 		pt[pte].dword = 0;
 	} else {
 		/* unmapping one small page in a huge page */
+		if(!vmm_kernel_pde_check(va)) goto done;
 		uintptr_t pa = pd_entry->entry_pse.pa << 22;
 		size_t flags = 0;
 		if(pd_entry->entry_pse.present) flags |= VMM_FLAGS_PRESENT;
@@ -377,7 +418,7 @@ void vmm_pgunmap_small(void* vmm, uintptr_t va) {
 		if(pd_entry->entry_pse.user) flags |= VMM_FLAGS_USER;
 		if(pd_entry->entry_pse.global) flags |= VMM_FLAGS_GLOBAL;
 		if(!pd_entry->entry_pse.ncache) flags |= VMM_FLAGS_CACHE | ((pd_entry->entry_pse.wthru) ? VMM_FLAGS_CACHE_WTHRU : 0);
-		if(pd_entry->entry_pse.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(vmm, pde << 22, 1); // resolve CoW here (and discard the trap flag)
+		if(pd_entry->entry_pse.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(vmm, pde << 22); // resolve CoW here (and discard the trap flag)
 		invalidate_tlb = invalidate_tlb || (flags & VMM_FLAGS_GLOBAL);
 		pd_entry->dword = 0;
 		uintptr_t va_map = va & 0xFFC00000;
@@ -391,8 +432,8 @@ void vmm_pgunmap_small(void* vmm, uintptr_t va) {
 done:
 	if(pd_map) {
 		/* unmap PD and PT */
-		vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
-		if(pt) vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
+		vmm_kunmap(pd);
+		if(pt) vmm_kunmap(pt);
 	}
 }
 
@@ -404,7 +445,12 @@ void vmm_pgunmap(void* vmm, uintptr_t va, size_t pgsz_idx) {
 
 	switch(pgsz_idx) {
 		case 0: vmm_pgunmap_small(vmm, va); break;
-		case 1: vmm_pgunmap_huge(vmm, va); break;
+		case 1:
+			if(vmm_kernel_pt(va)) {
+				/* keep the shared PT and only clear its entries */
+				for(size_t i = 0; i < 1024; i++) vmm_pgunmap_small(vmm, (va & 0xFFC00000) + (i << 12));
+			} else vmm_pgunmap_huge(vmm, va);
+			break;
 		default:
 			kerror("invalid page size index %u", pgsz_idx);
 			break;
@@ -415,32 +461,32 @@ size_t vmm_get_pgsz(void* vmm, uintptr_t va) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return (size_t)-1;
 	}
 	
 	if(!pd[pde].dword) {
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+		if(pd_map) vmm_kunmap(pd);
 		return (size_t)-1; // 4M not mapped
 	} else if(pd[pde].entry.pgsz) {
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+		if(pd_map) vmm_kunmap(pd);
 		return 1; // 4M page
 	} else {
 		/* there's a PT to access too */
 		vmm_pte_t* pt = NULL; // page table
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return (size_t)-1;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
 		bool mapped = (pt[pte].dword);
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
+		if(pd_map) vmm_kunmap(pt);
 		return (mapped) ? 0 : (size_t)-1;
 	}
 }
@@ -449,7 +495,7 @@ uintptr_t vmm_get_paddr(void* vmm, uintptr_t va) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return 0;
@@ -464,19 +510,19 @@ uintptr_t vmm_get_paddr(void* vmm, uintptr_t va) {
 		vmm_pte_t* pt = NULL; // page table
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return 0;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
 		if(pt[pte].dword) paddr = (pt[pte].entry.pa << 12) | (va & 0xFFF);
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
+		if(pd_map) vmm_kunmap(pt);
 	}
 
 done:
-	if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+	if(pd_map) vmm_kunmap(pd);
 	return paddr;
 }
 
@@ -484,7 +530,7 @@ void vmm_set_paddr(void* vmm, uintptr_t va, uintptr_t pa) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return;
@@ -502,13 +548,14 @@ void vmm_set_paddr(void* vmm, uintptr_t va, uintptr_t pa) {
 		}
 	} else {
 		/* small page */
+		vmm_pt_unshare(vmm, &pd[pde]);
 		vmm_pte_t* pt = NULL; // page table
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
@@ -516,11 +563,23 @@ void vmm_set_paddr(void* vmm, uintptr_t va, uintptr_t pa) {
 			pt[pte].entry.pa = pa >> 12;
 			if(vmm == vmm_current || pt[pte].entry.global) __asm__ __volatile__("invlpg (%0)" : : "r"(va & ~0xFFF) : "memory"); // invalidate TLB
 		}
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
+		if(pd_map) vmm_kunmap(pt);
 	}
 
 done:
-	if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+	if(pd_map) vmm_kunmap(pd);
+}
+
+bool vmm_unshare(void* vmm, uintptr_t va) {
+	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory to our VMM config
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
+	if(!pd) {
+		kerror("cannot map page directory");
+		return false;
+	}
+	bool ret = vmm_pt_unshare(vmm, &pd[va >> 22]);
+	if(pd_map) vmm_kunmap(pd);
+	return ret;
 }
 
 void vmm_switch(void* vmm) {
@@ -530,13 +589,37 @@ void vmm_switch(void* vmm) {
 }
 
 void vmm_init() {
-	// do nothing - VMM initialization is done during bootstrapping
+	/*
+	 * most of the VMM is set up during bootstrapping - what's left is giving every kernel space PDE a page table,
+	 * so that kernel PDEs never change after vmm_clone() has copied them. the direct map is left alone, as
+	 * vmm_dmap_init() fills it with hugepages before any other VMM config exists.
+	 */
+	vmm_pde_t* pd = vmm_pd(&__rmap_start); // vmm_kernel is the current VMM config at this point
+	size_t tables = 0;
+	for(size_t pde = kernel_start >> 22; pde < 1024; pde++) {
+		uintptr_t va = pde << 22;
+		if(pd[pde].dword || (va >= (uintptr_t) &__dmap_start && va < (uintptr_t) &__dmap_end)) continue;
+		size_t frame = pmm_alloc_free(1); // frame descriptors are not available yet, so there's no need to mark it
+		if(frame == (size_t)-1) {
+			kerror("cannot allocate kernel page table for 0x%x", va);
+			break;
+		}
+		pd[pde].dword = (frame << 12) | (1 << 0) | (1 << 1); // present and rw
+		vmm_pte_t* pt = vmm_pt(&__rmap_start, pde);
+		__asm__ __volatile__("invlpg (%0)" : : "r"(pt) : "memory");
+		memset(pt, 0, 4096);
+		tables++;
+	}
+	kdebug("preallocated %u kernel page table(s)", tables);
 }
 
+static void vmm_txn_invalidate(vmm_txn_t* txn, uintptr_t va, size_t sz, bool global);
+
 void* vmm_clone(void* src, bool cow) {
+	vmm_kernel_shared = true; // the kernel space PDEs we're about to copy are now fixed
 	/* get source's PD */
 	bool pd_map = (src != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd_src = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) src, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd_src = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) src) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd_src) {
 		kerror("cannot map source page directory");
 		return NULL;
@@ -546,11 +629,14 @@ void* vmm_clone(void* src, bool cow) {
 	size_t dst_frame = pmm_alloc_free(1);
 	if(dst_frame == (size_t)-1) {
 		kerror("cannot allocate destination page directory");
+		if(pd_map) vmm_kunmap(pd_src);
 		return NULL;
 	}
-	vmm_pde_t* pd_dst = (vmm_pde_t*) vmm_alloc_map(vmm_current, dst_frame << 12, 4096, (pd_map) ? ((uintptr_t) pd_src + 4096) : 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW);
+	pmm_page_mark(dst_frame, 1, PMM_PAGE_KERNEL | PMM_PAGE_PT, (void*) (dst_frame << 12));
+	vmm_pde_t* pd_dst = (vmm_pde_t*) vmm_kmap(dst_frame << 12);
 	if(!pd_dst) {
 		kerror("cannot map destination page directory");
+		if(pd_map) vmm_kunmap(pd_src);
 		pmm_free(dst_frame);
 		return NULL;
 	}
@@ -563,62 +649,93 @@ void* vmm_clone(void* src, bool cow) {
 	} else memcpy(pd_dst, pd_src, 4096); // copy the entire page directory
 	pd_dst[VMM_PD_PTE].dword = (dst_frame << 12) | (1 << 0) | (1 << 1); // set up recursive mapping
 
-	/* unmap source PD since we have a copy of it in pd_dst now */
-	if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd_src, 0);
+	/* COW pages are set up in transactions so that the source's TLB is only flushed once */
+	vmm_txn_t txn_src, txn_dst;
+	if(cow) {
+		bool txn_ok = vmm_txn_begin(&txn_src, src);
+		if(txn_ok && !vmm_txn_begin(&txn_dst, (void*) (dst_frame << 12))) {
+			vmm_txn_commit(&txn_src);
+			txn_ok = false;
+		}
+		if(!txn_ok) {
+			if(pd_map) vmm_kunmap(pd_src);
+			vmm_kunmap(pd_dst); pmm_free(dst_frame);
+			return NULL;
+		}
+	}
 
 	/* clone non-kernel page tables */
-	vmm_pte_t* pt_src = (vmm_pte_t*) vmm_alloc_map(vmm_current, 0, (cow) ? 4096 : 8192, (pd_map) ? (uintptr_t)pd_src : 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW); // source PT (placeholder for now)
-	if(!pt_src) {
-		kerror("cannot map source and destination page tables");
-		vmm_pgunmap(vmm_current, (uintptr_t) pd_dst, 0); pmm_free(dst_frame); // deallocate destination PD
-		return NULL;
-	}
-	vmm_pte_t* pt_dst = (vmm_pte_t*) ((uintptr_t) pt_src + 4096); // destination PT, also placeholder (this will not be used in CoW mode)
 	for(size_t i = 0; i < tables; i++) { // do not clone the kernel's top 1G space
-		if(pd_src[i].dword) {
-			/* ignore empty page directory entries */
-			if(cow) {
-				/* set up copy on write */
-				if(pd_dst[i].entry.pgsz) vmm_cow_setup(src, (i << 22), (void*)(dst_frame << 12), (i << 22), 4194304); // hugepage
-				else {
-					vmm_set_paddr(vmm_current, (uintptr_t) pt_src, pd_dst[i].entry.pt << 12);
-					for(size_t j = 0; j < 1024; j++) {
-						if(pt_src[j].dword) vmm_cow_setup(src, (i << 22) | (j << 12), (void*)(dst_frame << 12), (i << 22) | (j << 12), 4096); // small page - we ignore any empty entries here
-					}
+		if(!pd_src[i].dword) continue; // ignore empty page directory entries
+		if(cow) {
+			/* set up copy on write */
+			if(pd_src[i].entry.pgsz) vmm_cow_setup_txn(&txn_src, &txn_dst, (i << 22), (i << 22), 4194304); // hugepage
+			else if(pmm_page(pd_src[i].entry.pt)) {
+				/* share the whole PT read-only - it is copied when either side first modifies it (see vmm_pt_unshare) */
+				if(!(pd_src[i].entry.avail & VMM_AVAIL_SHARED)) {
+					pd_src[i].entry.avail |= VMM_AVAIL_SHARED;
+					pd_src[i].entry.rw = 0;
+					vmm_txn_invalidate(&txn_src, i << 22, 4194304, false);
 				}
+				pmm_page_ref(pd_src[i].entry.pt);
+				pd_dst[i].dword = pd_src[i].dword;
 			} else {
-				/* clone references */
-				if(!pd_dst[i].entry.pgsz) { // ignore hugepages
-					/* map source PT */
-					vmm_set_paddr(vmm_current, (uintptr_t) pt_src, pd_dst[i].entry.pt << 12);
-					
-					/* allocate and map destination PT */
-					size_t pt_dst_frame = pmm_alloc_free(1);
-					if(pt_dst_frame == (size_t)-1) {
-						kerror("cannot allocate destination page table %u", i);
-						
-						/* do cleanup */
-						vmm_unmap(vmm_current, (uintptr_t) pt_src, 4096 * 2); // unmap PTs
-						for(size_t j = 0; j < i; j++) {
-							/* free existing PTs */
-							if(pd_dst[j].dword && !pd_dst[j].entry.pgsz) pmm_free(pd_dst[j].entry.pt);
-						}
-						vmm_pgunmap(vmm_current, (uintptr_t) pd_dst, 0); pmm_free(dst_frame); // deallocate destination PD
-						return NULL;
-					}
-					vmm_set_paddr(vmm_current, (uintptr_t) pt_dst, pt_dst_frame << 12);
-
-					/* replace the PT */
-					memcpy(pt_dst, pt_src, 4096);
-					pd_dst[i].entry.pt = pt_dst_frame;
+				vmm_pte_t* pt_src = (vmm_pte_t*) vmm_kmap(pd_src[i].entry.pt << 12);
+				if(!pt_src) {
+					kerror("cannot map source page table %u", i);
+					continue;
+				}
+				for(size_t j = 0; j < 1024; j++) {
+					if(pt_src[j].dword) vmm_cow_setup_txn(&txn_src, &txn_dst, (i << 22) | (j << 12), (i << 22) | (j << 12), 4096); // small page - we ignore any empty entries here
 				}
+				vmm_kunmap(pt_src);
 			}
+		} else if(!pd_src[i].entry.pgsz) { // ignore hugepages
+			/* clone references - allocate destination PT */
+			size_t pt_dst_frame = pmm_alloc_free(1);
+			vmm_pte_t* pt_src = (vmm_pte_t*) vmm_kmap(pd_src[i].entry.pt << 12);
+			vmm_pte_t* pt_dst = (pt_dst_frame == (size_t)-1) ? NULL : (vmm_pte_t*) vmm_kmap(pt_dst_frame << 12);
+			if(!pt_src || !pt_dst) {
+				kerror("cannot allocate destination page table %u", i);
+				
+				/* do cleanup */
+				if(pt_src) vmm_kunmap(pt_src);
+				if(pt_dst_frame != (size_t)-1) pmm_free(pt_dst_frame);
+				for(size_t j = 0; j < i; j++) {
+					/* free existing PTs */
+					if(pd_dst[j].dword && !pd_dst[j].entry.pgsz) pmm_free(pd_dst[j].entry.pt);
+				}
+				if(pd_map) vmm_kunmap(pd_src);
+				vmm_kunmap(pd_dst); pmm_free(dst_frame); // deallocate destination PD
+				return NULL;
+			}
+			pmm_page_mark(pt_dst_frame, 1, PMM_PAGE_KERNEL | PMM_PAGE_PT, (void*) (dst_frame << 12));
+
+			/* replace the PT */
+			memcpy(pt_dst, pt_src, 4096);
+			pd_dst[i].entry.pt = pt_dst_frame;
+			if(pd_dst[i].entry.avail & VMM_AVAIL_SHARED) {
+				/* our copy is not shared with anyone */
+				pd_dst[i].entry.avail &= ~VMM_AVAIL_SHARED;
+				pd_dst[i].entry.rw = 1;
+			}
+			vmm_kunmap(pt_src); vmm_kunmap(pt_dst);
 		}
 	}
-	vmm_unmap(vmm_current, (uintptr_t) pt_src, (cow) ? 4096 : 8192); // unmap PTs
-	vmm_pgunmap(vmm_current, (uintptr_t) pd_dst, 0); // unmap our new PD
+	if(cow) {
+		vmm_txn_commit(&txn_dst);
+		vmm_txn_commit(&txn_src);
+	}
+	if(pd_map) vmm_kunmap(pd_src);
+	vmm_kunmap(pd_dst); // unmap our new PD
 
-	return (void*) (dst_frame << 12); // return phys address of destination PD as VMM config address
+	void* dst = (void*) (dst_frame << 12); // phys address of destination PD is the VMM config address
+	if(!vmm_region_clone(src, dst)) {
+		kerror("cannot clone address space regions");
+		vmm_free(dst);
+		return NULL;
+	}
+	return dst;
 }
 
 void vmm_free(void* vmm) {
@@ -633,8 +750,9 @@ void vmm_free(void* vmm) {
 		kerror("cannot remove traps from VMM 0x%x", (uintptr_t)vmm);
 		return;
 	}
+	vmm_region_destroy(vmm);
 
-	vmm_pde_t* pd = (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT); // map PD
+	vmm_pde_t* pd = (vmm_pde_t*) vmm_kmap((uintptr_t) vmm); // map PD
 	if(!pd) {
 		kerror("cannot map page directory");
 		return;
@@ -643,18 +761,18 @@ void vmm_free(void* vmm) {
 	/* free PT frames */
 	size_t tables = kernel_start >> 22; // only free tables up to the kernel space
 	for(size_t i = 0; i < tables; i++) {
-		if(pd[i].dword && !pd[i].entry.pgsz) pmm_free(pd[i].entry.pt);
+		if(pd[i].dword && !pd[i].entry.pgsz) vmm_pt_free(&pd[i]);
 	}
 	
 	pmm_free((uintptr_t) vmm >> 12); // free the page directory's frame
-	vmm_pgunmap(vmm_current, (uintptr_t) pd, 0); // unmap the PD we just mapped
+	vmm_kunmap(pd); // unmap the PD we just mapped
 }
 
 size_t vmm_get_flags(void* vmm, uintptr_t va) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return 0;
@@ -676,10 +794,10 @@ size_t vmm_get_flags(void* vmm, uintptr_t va) {
 		vmm_pte_t* pt = NULL; // page table
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return 0;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
@@ -690,12 +808,13 @@ size_t vmm_get_flags(void* vmm, uintptr_t va) {
 			if(pt[pte].entry.global) flags |= VMM_FLAGS_GLOBAL;
 			if(!pt[pte].entry.ncache) flags |= VMM_FLAGS_CACHE | ((pt[pte].entry.wthru) ? VMM_FLAGS_CACHE_WTHRU : 0);
 			if(pt[pte].entry.avail & VMM_AVAIL_TRAPPED) flags |= VMM_FLAGS_TRAPPED;
+			if(pd[pde].entry.avail & VMM_AVAIL_SHARED) flags = (flags & ~VMM_FLAGS_RW) | VMM_FLAGS_TRAPPED; // writes fault until the PT is unshared
 		}
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
+		if(pd_map) vmm_kunmap(pt);
 	}
 
 done:
-	if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+	if(pd_map) vmm_kunmap(pd);
 	return flags;
 }
 
@@ -703,7 +822,7 @@ void vmm_set_flags(void* vmm, uintptr_t va, size_t flags) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return;
@@ -729,13 +848,14 @@ void vmm_set_flags(void* vmm, uintptr_t va, size_t flags) {
 		}
 	} else {
 		/* small page - there's a PT to access too */
+		vmm_pt_unshare(vmm, &pd[pde]);
 		vmm_pte_t* pt = NULL; // page table
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
@@ -747,21 +867,21 @@ void vmm_set_flags(void* vmm, uintptr_t va, size_t flags) {
 			pt[pte].entry.global = (flags & VMM_FLAGS_GLOBAL) ? 1 : 0;
 			pt[pte].entry.ncache = (flags & VMM_FLAGS_CACHE) ? 0 : 1;
 			pt[pte].entry.wthru = (flags & VMM_FLAGS_CACHE_WTHRU) ? 1 : 0;
-			pt[pde].entry.avail = (flags & VMM_FLAGS_TRAPPED) ? VMM_AVAIL_TRAPPED : 0;
+			pt[pte].entry.avail = (flags & VMM_FLAGS_TRAPPED) ? VMM_AVAIL_TRAPPED : 0;
 			if(invalidate_tlb) __asm__ __volatile__("invlpg (%0)" : : "r"(va) : "memory");
 		}
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
+		if(pd_map) vmm_kunmap(pt);
 	}
 
 done:
-	if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+	if(pd_map) vmm_kunmap(pd);
 }
 
 bool vmm_get_dirty(void* vmm, uintptr_t va) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return true; // assume page is dirty (TODO?)
@@ -776,19 +896,19 @@ bool vmm_get_dirty(void* vmm, uintptr_t va) {
 		vmm_pte_t* pt = NULL; // page table
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return true;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
 		dirty = (pt[pte].entry.dirty);
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
+		if(pd_map) vmm_kunmap(pt);
 	}
 
 done:
-	if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+	if(pd_map) vmm_kunmap(pd);
 	return dirty;
 }
 
@@ -796,7 +916,7 @@ void vmm_set_dirty(void* vmm, uintptr_t va, bool dirty) {
 	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
 
 	bool pd_map = (vmm != vmm_current); // set if we need to map the page directory and page table to our VMM config
-	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_alloc_map(vmm_current, (uintptr_t) vmm, 4096, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT) : vmm_pd(&__rmap_start)); // page directory
+	vmm_pde_t* pd = ((pd_map) ? (vmm_pde_t*) vmm_kmap((uintptr_t) vmm) : vmm_pd(&__rmap_start)); // page directory
 	if(!pd) {
 		kerror("cannot map page directory");
 		return;
@@ -807,20 +927,232 @@ void vmm_set_dirty(void* vmm, uintptr_t va, bool dirty) {
 	if(pd[pde].entry.pgsz) pd[pde].entry_pse.dirty = (dirty) ? 1 : 0;
 	else {
 		/* small page - there's a PT to access too */
+		vmm_pt_unshare(vmm, &pd[pde]);
 		vmm_pte_t* pt = NULL; // page table
 		if(pd_map) {
 			/* map page table if needed */
-			pt = (vmm_pte_t*) vmm_alloc_map(vmm_current, pd[pde].entry.pt << 12, 4096, (uintptr_t) pd + 4096, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT); // speed up lookup by basing it off pd
+			pt = (vmm_pte_t*) vmm_kmap(pd[pde].entry.pt << 12);
 			if(!pt) {
 				kerror("cannot map page table");
-				vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+				vmm_kunmap(pd);
 				return;
 			}
 		} else pt = vmm_pt(&__rmap_start, pde);
 		if(pt[pte].dword) pt[pte].entry.dirty = (dirty) ? 1 : 0;
-		if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pt, 0);
+		if(pd_map) vmm_kunmap(pt);
 	}
 
 done:
-	if(pd_map) vmm_pgunmap(vmm_current, (uintptr_t) pd, 0);
+	if(pd_map) vmm_kunmap(pd);
+}
+
+/* VMM transactions - the PD and PTs are always accessed through vmm_kmap() here, so that a task switch in the middle of a transaction cannot pull the recursive mapping from under us */
+
+#ifndef VMM_TXN_INVLPG_MAX
+#define VMM_TXN_INVLPG_MAX						32 // maximum number of pages to be invalidated one by one before the whole TLB is flushed instead
+#endif
+
+bool vmm_txn_begin(vmm_txn_t* txn, void* vmm) {
+	txn->vmm = vmm;
+	txn->pt = NULL;
+	txn->flush_pages = 0;
+	txn->flush_global = false;
+	txn->pd = vmm_kmap((uintptr_t) vmm);
+	if(!txn->pd) {
+		kerror("cannot map page directory");
+		return false;
+	}
+	return true;
+}
+
+/* queues up TLB invalidation of sz bytes starting from va */
+static void vmm_txn_invalidate(vmm_txn_t* txn, uintptr_t va, size_t sz, bool global) {
+	uintptr_t va_last = va + (sz - 4096); // last page to be invalidated (va + sz may overflow)
+	if(!txn->flush_pages) {
+		txn->flush_start = va;
+		txn->flush_end = va_last;
+	} else {
+		if(va < txn->flush_start) txn->flush_start = va;
+		if(va_last > txn->flush_end) txn->flush_end = va_last;
+	}
+	txn->flush_pages += sz >> 12;
+	txn->flush_global = txn->flush_global || global;
+}
+
+/* returns the page table behind the specified PD entry (allocating it if alloc is set), or NULL if there is none */
+static vmm_pte_t* vmm_txn_pt(vmm_txn_t* txn, size_t pde, bool alloc) {
+	vmm_pde_t* pd_entry = &((vmm_pde_t*) txn->pd)[pde];
+	if(pd_entry->dword && pd_entry->entry.pgsz) return NULL; // hugepage
+	vmm_pt_unshare(txn->vmm, pd_entry); // everything here modifies the PT
+	if(txn->pt && txn->pt_idx == pde && pd_entry->dword && ((uintptr_t) pd_entry->entry.pt << 12) == txn->pt_paddr) return txn->pt; // still the PT we have mapped
+
+	if(txn->pt) {
+		vmm_kunmap(txn->pt);
+		txn->pt = NULL;
+	}
+
+	if(!pd_entry->dword) {
+		if(!alloc || !vmm_kernel_pde_check(pde << 22)) return NULL;
+
+		/* allocate page table */
+		size_t frame = pmm_alloc_free_flags(1, PMM_ZEROED);
+		if(frame == (size_t)-1) {
+			kerror("no more free frames for page table");
+			return NULL;
+		}
+		pmm_page_mark(frame, 1, PMM_PAGE_KERNEL | PMM_PAGE_PT, txn->vmm);
+		pd_entry->dword = (frame << 12) | (1 << 0) | (1 << 1); // present and rw
+		if(txn->vmm == vmm_current) __asm__ __volatile__("invlpg (%0)" : : "r"(vmm_pt(&__rmap_start, pde)) : "memory"); // the rest of the code may access the PT through the recursive mapping
+	}
+
+	txn->pt = vmm_kmap(pd_entry->entry.pt << 12);
+	if(!txn->pt) {
+		kerror("cannot map page table");
+		return NULL;
+	}
+	txn->pt_idx = pde;
+	txn->pt_paddr = (uintptr_t) pd_entry->entry.pt << 12;
+	return txn->pt;
+}
+
+void vmm_txn_pgmap(vmm_txn_t* txn, uintptr_t pa, uintptr_t va, size_t pgsz_idx, size_t flags) {
+	if(va >= (uintptr_t)&__rmap_start && va < (uintptr_t)&__rmap_end) {
+		kerror("cannot map into recursive mapping region");
+		return;
+	}
+
+	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
+	vmm_pde_t* pd_entry = &((vmm_pde_t*) txn->pd)[pde];
+	if(pd_entry->dword && (pgsz_idx == 1) != (pd_entry->entry.pgsz == 1)) {
+		/* PT to be replaced by a hugepage or vice versa - this is rare enough to be left to vmm_pgmap */
+		vmm_pgmap(txn->vmm, pa, va, pgsz_idx, flags);
+		return;
+	}
+
+	switch(pgsz_idx) {
+		case 0: break;
+		case 1:
+			if(!vmm_kernel_pde_check(va)) return;
+			if(pd_entry->entry_pse.present) vmm_txn_invalidate(txn, va & 0xFFC00000, 4194304, pd_entry->entry_pse.global || (flags & VMM_FLAGS_GLOBAL));
+			pd_entry->dword = (1 << 7); // quickly clear PDE and set its PSE bit
+			pd_entry->entry_pse.present = (flags & VMM_FLAGS_PRESENT) ? 1 : 0;
+			pd_entry->entry_pse.user = (flags & VMM_FLAGS_USER) ? 1 : 0;
+			pd_entry->entry_pse.rw = (flags & VMM_FLAGS_RW) ? 1 : 0;
+			pd_entry->entry_pse.global = (flags & VMM_FLAGS_GLOBAL) ? 1 : 0;
+			pd_entry->entry_pse.ncache = (flags & VMM_FLAGS_CACHE) ? 0 : 1;
+			pd_entry->entry_pse.wthru = (flags & VMM_FLAGS_CACHE_WTHRU) ? 1 : 0;
+			pd_entry->entry_pse.pa = pa >> 22;
+			pd_entry->entry_pse.avail = (flags & VMM_FLAGS_TRAPPED) ? VMM_AVAIL_TRAPPED : 0;
+			return;
+		default:
+			kerror("invalid page size index %u", pgsz_idx);
+			return;
+	}
+
+	vmm_pte_t* pt = vmm_txn_pt(txn, pde, true);
+	if(!pt) return;
+
+	/* set settings in page directory entry */
+	pd_entry->entry.present |= (flags & VMM_FLAGS_PRESENT) ? 1 : 0;
+	pd_entry->entry.rw |= (flags & VMM_FLAGS_RW) ? 1 : 0;
+	pd_entry->entry.user |= (flags & VMM_FLAGS_USER) ? 1 : 0;
+
+	/* populate page table entry - non-present entries are never cached, so only replaced mappings need invalidating */
+	vmm_pte_t* pt_entry = &pt[pte];
+	if(pt_entry->entry.present) vmm_txn_invalidate(txn, va & ~0xFFF, 4096, pt_entry->entry.global || (flags & VMM_FLAGS_GLOBAL));
+	pt_entry->dword = 0;
+	pt_entry->entry.present = (flags & VMM_FLAGS_PRESENT) ? 1 : 0;
+	pt_entry->entry.user = (flags & VMM_FLAGS_USER) ? 1 : 0;
+	pt_entry->entry.rw = (flags & VMM_FLAGS_RW) ? 1 : 0;
+	pt_entry->entry.global = (flags & VMM_FLAGS_GLOBAL) ? 1 : 0;
+	pt_entry->entry.ncache = (flags & VMM_FLAGS_CACHE) ? 0 : 1;
+	pt_entry->entry.wthru = (flags & VMM_FLAGS_CACHE_WTHRU) ? 1 : 0;
+	pt_entry->entry.pa = pa >> 12;
+	pt_entry->entry.avail = (flags & VMM_FLAGS_TRAPPED) ? VMM_AVAIL_TRAPPED : 0;
+}
+
+void vmm_txn_pgunmap(vmm_txn_t* txn, uintptr_t va, size_t pgsz_idx) {
+	if(va >= (uintptr_t)&__rmap_start && va < (uintptr_t)&__rmap_end) {
+		kerror("cannot unmap recursive mapping region");
+		return;
+	}
+
+	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
+	vmm_pde_t* pd_entry = &((vmm_pde_t*) txn->pd)[pde];
+	if(!pd_entry->dword) return; // nothing to do
+	if((pgsz_idx == 1) != (pd_entry->entry.pgsz == 1)) {
+		/* unmapping a whole PT or part of a hugepage - leave this to vmm_pgunmap */
+		vmm_pgunmap(txn->vmm, va, pgsz_idx);
+		return;
+	}
+
+	switch(pgsz_idx) {
+		case 0: break;
+		case 1:
+			if(!vmm_kernel_pde_check(va)) return;
+			if(pd_entry->entry_pse.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(txn->vmm, va & 0xFFC00000);
+			if(pd_entry->entry_pse.present) vmm_txn_invalidate(txn, va & 0xFFC00000, 4194304, pd_entry->entry_pse.global);
+			pd_entry->dword = 0;
+			return;
+		default:
+			kerror("invalid page size index %u", pgsz_idx);
+			return;
+	}
+
+	vmm_pte_t* pt = vmm_txn_pt(txn, pde, false);
+	if(!pt || !pt[pte].dword) return;
+	if(pt[pte].entry.avail & VMM_AVAIL_TRAPPED) vmm_unmap_resolve_cow(txn->vmm, va);
+	if(pt[pte].entry.present) vmm_txn_invalidate(txn, va & ~0xFFF, 4096, pt[pte].entry.global);
+	pt[pte].dword = 0;
+}
+
+void vmm_txn_set_flags(vmm_txn_t* txn, uintptr_t va, size_t flags) {
+	size_t pde = va >> 22, pte = (va >> 12) & 0x3ff; // page directory and page table entries for our virtual address
+	vmm_pde_t* pd_entry = &((vmm_pde_t*) txn->pd)[pde];
+	if(!pd_entry->dword) return; // nothing to be done here
+	if(pd_entry->entry.pgsz) {
+		vmm_set_flags(txn->vmm, va, flags); // hugepage
+		return;
+	}
+
+	vmm_pte_t* pt = vmm_txn_pt(txn, pde, false);
+	if(!pt || !pt[pte].dword) return;
+	vmm_pte_t* pt_entry = &pt[pte];
+	if(pt_entry->entry.present) vmm_txn_invalidate(txn, va & ~0xFFF, 4096, pt_entry->entry.global || (flags & VMM_FLAGS_GLOBAL));
+	pt_entry->entry.present = (flags & VMM_FLAGS_PRESENT) ? 1 : 0;
+	pt_entry->entry.user = (flags & VMM_FLAGS_USER) ? 1 : 0;
+	pt_entry->entry.rw = (flags & VMM_FLAGS_RW) ? 1 : 0;
+	pt_entry->entry.global = (flags & VMM_FLAGS_GLOBAL) ? 1 : 0;
+	pt_entry->entry.ncache = (flags & VMM_FLAGS_CACHE) ? 0 : 1;
+	pt_entry->entry.wthru = (flags & VMM_FLAGS_CACHE_WTHRU) ? 1 : 0;
+	pt_entry->entry.avail = (flags & VMM_FLAGS_TRAPPED) ? VMM_AVAIL_TRAPPED : 0;
+}
+
+void vmm_txn_flush(vmm_txn_t* txn) {
+	if(!txn->flush_pages) return; // nothing to invalidate
+
+	if(txn->vmm == vmm_current || txn->flush_global) { // non-global pages of other VMM configs are not in the TLB
+		size_t span = ((txn->flush_end - txn->flush_start) >> 12) + 1; // number of pages in the invalidation range
+		if(span <= VMM_TXN_INVLPG_MAX) {
+			uintptr_t va = txn->flush_start;
+			for(size_t i = 0; i < span; i++, va += 4096) __asm__ __volatile__("invlpg (%0)" : : "r"(va) : "memory");
+		} else if(txn->flush_global) {
+			/* toggle CR4.PGE to flush global pages too */
+			uintptr_t cr4;
+			__asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+			__asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4 & ~(1 << 7)) : "memory");
+			__asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4) : "memory");
+		} else __asm__ __volatile__("mov %0, %%cr3" : : "r"(vmm_current) : "memory"); // reload CR3 to flush all non-global pages
+	}
+
+	txn->flush_pages = 0;
+	txn->flush_global = false;
+}
+
+void vmm_txn_commit(vmm_txn_t* txn) {
+	vmm_txn_flush(txn);
+	if(txn->pt) vmm_kunmap(txn->pt);
+	vmm_kunmap(txn->pd);
+	txn->pt = NULL;
+	txn->pd = NULL;
 }
@@ -7,6 +7,7 @@
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/addr.h>
+#include <mm/arena.h>
 
 /* most architectures can only load either ELF32 or ELF64 files */
 #if defined(__i386__)
@@ -118,11 +119,15 @@ enum elf_check_result elf_check_header(void* buf) {
 #define ELF_LOAD_ADDR_END                       UINTPTR_MAX
 #endif
 
+#ifndef ELF_ARENA_CHUNK_SIZE
+#define ELF_ARENA_CHUNK_SIZE                    16384 // size of each chunk of the arena holding headers and tables while a file is being loaded
+#endif
+
 /* decomposed ELF loading stages */
 
-enum elf_load_result elf_read_header(vfs_node_t* file, void** bufptr, bool* is_elf64) {
+enum elf_load_result elf_read_header(vfs_node_t* file, void** bufptr, bool* is_elf64, arena_t* arena) {
     /* read ELF header */
-    *bufptr = kmalloc(sizeof(Elf64_Ehdr)); // ELF64 header
+    *bufptr = arena_alloc(arena, sizeof(Elf64_Ehdr), 0); // ELF64 header
     if(!*bufptr) {
         kerror("cannot allocate memory for header");
         return ERR_ALLOC;
@@ -136,13 +141,13 @@ enum elf_load_result elf_read_header(vfs_node_t* file, void** bufptr, bool* is_e
         case OK_ELF64: *is_elf64 = true; break;
         default:
             kerror("elf_check_header() failed with error code %d", chk_result);
-            kfree(*bufptr); return ERR_CHECK;
+            return ERR_CHECK;
     }
 
     return LOAD_OK;
 }
 
-enum elf_load_result elf_read_shdr(vfs_node_t* file, void* hdr, bool is_elf64, void** shdr_bufptr, char** shstrtab_bufptr, size_t* e_shentsize, size_t* e_shnum) {
+enum elf_load_result elf_read_shdr(vfs_node_t* file, void* hdr, bool is_elf64, void** shdr_bufptr, char** shstrtab_bufptr, size_t* e_shentsize, size_t* e_shnum, arena_t* arena) {
 #ifdef ELF_FORCE_CLASS
     (void) is_elf64;
 #else
@@ -162,7 +167,7 @@ enum elf_load_result elf_read_shdr(vfs_node_t* file, void* hdr, bool is_elf64, v
 #ifndef ELF_FORCE_CLASS
     }
 #endif
-    *shdr_bufptr = kmalloc(*e_shentsize * *e_shnum);
+    *shdr_bufptr = arena_alloc(arena, *e_shentsize * *e_shnum, 0);
     if(!*shdr_bufptr) {
         kerror("cannot allocate memory for section headers");
         return ERR_ALLOC;
@@ -196,9 +201,9 @@ enum elf_load_result elf_read_shdr(vfs_node_t* file, void* hdr, bool is_elf64, v
     if((is_elf64 && ((Elf64_Shdr*)shstrtab)->sh_type != SHT_STRTAB) || (!is_elf64 && ((Elf32_Shdr*)shstrtab)->sh_type != SHT_STRTAB)) {
 #endif
         kerror("section header string table indicated in e_shstrndx is not of type SHT_STRTAB");
-        kfree(*shdr_bufptr); return ERR_INVALID_DATA;
+        return ERR_INVALID_DATA;
     }
-    *shstrtab_bufptr = kmalloc(
+    *shstrtab_bufptr = arena_alloc(arena,
 #if ELF_FORCE_CLASS == ELFCLASS64
         ((Elf64_Shdr*)shstrtab)->sh_size
 #elif ELF_FORCE_CLASS == ELFCLASS32
@@ -206,10 +211,10 @@ enum elf_load_result elf_read_shdr(vfs_node_t* file, void* hdr, bool is_elf64, v
 #else
         (is_elf64) ? ((Elf64_Shdr*)shstrtab)->sh_size : ((Elf32_Shdr*)shstrtab)->sh_size
 #endif
-    );
+        , 0);
     if(!*shstrtab_bufptr) {
         kerror("cannot allocate memory for section header string table");
-        kfree(*shdr_bufptr); return ERR_ALLOC;
+        return ERR_ALLOC;
     }
     vfs_read(   file,
 #if ELF_FORCE_CLASS == ELFCLASS64
@@ -227,7 +232,7 @@ enum elf_load_result elf_read_shdr(vfs_node_t* file, void* hdr, bool is_elf64, v
     return LOAD_OK;
 }
 
-enum elf_load_result elf_load_rel(vfs_node_t* file, void* shdr, bool is_elf64, size_t e_shentsize, size_t e_shnum, void* alloc_vmm, elf_prgload_t** prgload_result, size_t* prgload_result_len) {
+enum elf_load_result elf_load_rel(vfs_node_t* file, void* shdr, bool is_elf64, size_t e_shentsize, size_t e_shnum, void* alloc_vmm, elf_prgload_t** prgload_result, size_t* prgload_result_len, arena_t* arena) {
 #ifdef ELF_FORCE_CLASS
     (void) is_elf64;
 #endif
@@ -261,33 +266,31 @@ enum elf_load_result elf_load_rel(vfs_node_t* file, void* shdr, bool is_elf64, s
         
         if((sh_flags & SHF_ALLOC) && sh_size && (sh_type == SHT_PROGBITS || sh_type == SHT_NOBITS)) {
             /* memory needs to be allocated for this section */
-            uintptr_t vaddr = vmm_first_free(alloc_vmm, ELF_LOAD_ADDR_START, ELF_LOAD_ADDR_END, sh_size, 0, false);
+            uintptr_t vaddr = vmm_region_alloc(alloc_vmm, ELF_LOAD_ADDR_START, ELF_LOAD_ADDR_END, sh_size, 0, false);
             if(!vaddr) {
                 kerror("cannot find virtual memory space for loading section");
                 return ERR_ALLOC;
             }
             size_t framesz = pmm_framesz();
             size_t rq_frames = (sh_size + framesz - 1) / framesz;
+            size_t* frames = arena_alloc(arena, rq_frames * sizeof(size_t), 0); // no need for contiguous memory
+            if(!frames || pmm_alloc_many_flags(rq_frames, frames, (sh_type == SHT_NOBITS) ? PMM_ZEROED : 0)) {
+                kerror("cannot allocate memory for loading section");
+                vmm_region_release(alloc_vmm, vaddr, sh_size);
+                return ERR_ALLOC;
+            }
             for(size_t j = 0; j < rq_frames; j++) {
-                size_t frame = pmm_alloc_free(1); // no need for contiguous memory
-                if(frame == (size_t)-1) {
-                    kerror("cannot allocate memory for loading section");
-                    for(size_t k = 0; k < j; k++) pmm_free(vmm_get_paddr(alloc_vmm, vaddr) / framesz);
-                    vmm_unmap(vmm_current, vaddr, j * framesz);
-                    return ERR_ALLOC;
-                }
-                // pmm_alloc(frame);
-                vmm_pgmap(vmm_current, frame * framesz, vaddr + j * framesz, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_CACHE | VMM_FLAGS_GLOBAL);
+                vmm_pgmap(vmm_current, frames[j] * framesz, vaddr + j * framesz, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_CACHE | VMM_FLAGS_GLOBAL);
+                pmm_page_mark(frames[j], 1, PMM_PAGE_KERNEL, alloc_vmm);
             }
-            if(sh_type != SHT_NOBITS) vfs_read(file, sh_off, sh_size, (uint8_t*) vaddr); // copy data from file
-            else memset((void*) vaddr, 0, sh_size);
+            if(sh_type != SHT_NOBITS) vfs_read(file, sh_off, sh_size, (uint8_t*) vaddr); // copy data from file (NOBITS sections are already zero-filled)
             (*prgload_result_len)++;
             elf_prgload_t* prgload_result_old = *prgload_result;
             *prgload_result = krealloc(*prgload_result, *prgload_result_len * sizeof(elf_prgload_t));
             if(!*prgload_result) {
                 kerror("cannot allocate memory for program loading result");
-                for(size_t j = 0; j < (sh_size + pmm_framesz() - 1) / pmm_framesz(); j++) pmm_free(vmm_get_paddr(alloc_vmm, vaddr + j * pmm_framesz()) / pmm_framesz());
-                vmm_unmap(vmm_current, vaddr, ((sh_size + pmm_framesz() - 1) / pmm_framesz()) * pmm_framesz());
+                vmm_unmap(vmm_current, vaddr, rq_frames * framesz);
+                pmm_free_many(rq_frames, frames);
                 kfree(prgload_result_old); return ERR_ALLOC;
             }
             (*prgload_result)[*prgload_result_len - 1].idx = i;
@@ -300,7 +303,7 @@ enum elf_load_result elf_load_rel(vfs_node_t* file, void* shdr, bool is_elf64, s
     return LOAD_OK;
 }
 
-enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool is_elf64, size_t e_shentsize, size_t e_shnum, elf_prgload_t* prgload_result, size_t prgload_result_len) {
+enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool is_elf64, size_t e_shentsize, size_t e_shnum, elf_prgload_t* prgload_result, size_t prgload_result_len, arena_t* arena) {
     void* shdr_ent = shdr;
     void* symtab_shdr = NULL; void* symtab = NULL; size_t symtab_idx = 0, symtab_sh_entsize;
     char* strtab_data = NULL; size_t strtab_idx = 0;
@@ -349,7 +352,6 @@ enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool
             /* discover refereneced symbol table */
             if(sh_link != symtab_idx) {
                 /* (re)load symbol table (part 1) */
-                kfree(symtab);
                 symtab_shdr = (void*) ((uintptr_t) shdr + e_shentsize * sh_link); // get symbol table referenced by the section
 #if ELF_FORCE_CLASS == ELFCLASS64
                 if(((Elf64_Shdr*)symtab_shdr)->sh_type != SHT_SYMTAB) {
@@ -374,7 +376,7 @@ enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool
 #endif
             if(sh_link != symtab_idx) {
                 /* (re)load symbol table (part 2) */
-                symtab = kmalloc(symtab_sh_size);
+                symtab = arena_alloc(arena, symtab_sh_size, 0);
                 if(!symtab) {
                     kerror("cannot allocate memory for symbol table");
                     return ERR_ALLOC;
@@ -394,7 +396,6 @@ enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool
             size_t symtab_sh_link = (is_elf64) ? ((Elf64_Shdr*)symtab_shdr)->sh_link : ((Elf32_Shdr*)symtab_shdr)->sh_link;
             if(symtab_sh_link != strtab_idx) {
                 /* load string table */
-                kfree(strtab_data);
                 void* strtab_shdr = (void*) ((uintptr_t) shdr + e_shentsize * symtab_sh_link); // get string table section header
 #if ELF_FORCE_CLASS == ELFCLASS64
                 if(((Elf64_Shdr*)strtab_shdr)->sh_type != SHT_STRTAB) {
@@ -404,7 +405,7 @@ enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool
                 if((is_elf64 && ((Elf64_Shdr*)strtab_shdr)->sh_type != SHT_STRTAB) || (!is_elf64 && ((Elf32_Shdr*)strtab_shdr)->sh_type != SHT_STRTAB)) {
 #endif
                     kerror("symbol table at entry %u points to an invalid table at entry %u as its string table", sh_link, symtab_sh_link);
-                    kfree(symtab); return ERR_INVALID_DATA;
+                    return ERR_INVALID_DATA;
                 }
 #if ELF_FORCE_CLASS == ELFCLASS64
                 size_t strtab_sh_size = ((Elf64_Shdr*)strtab_shdr)->sh_size;
@@ -413,7 +414,7 @@ enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool
 #else
                 size_t strtab_sh_size = (is_elf64) ? ((Elf64_Shdr*)strtab_shdr)->sh_size : ((Elf32_Shdr*)strtab_shdr)->sh_size;
 #endif
-                strtab_data = kmalloc(strtab_sh_size);
+                strtab_data = arena_alloc(arena, strtab_sh_size, 0);
                 if(!strtab_data) {
                     kerror("cannot allocate memory for string table");
                     return ERR_INVALID_DATA;
@@ -432,7 +433,7 @@ enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool
             }
 
             /* load relocation section */
-            void* rel = kmalloc(sh_size);
+            void* rel = arena_alloc(arena, sh_size, 0);
             if(!rel) {
                 kerror("cannot allocate memory for relocation section");
                 return ERR_ALLOC;
@@ -578,16 +579,13 @@ enum elf_load_result elf_do_reloc(vfs_node_t* file, void* hdr, void* shdr, bool
                 }
             }
 
-            kfree(rel);
         }
     }
-    kfree(symtab); // free up symbol table
-    kfree(strtab_data);
 
     return LOAD_OK;
 }
 
-enum elf_load_result elf_load_syms(vfs_node_t* file, void* shdr, bool is_elf64, bool is_rel, size_t e_shentsize, size_t e_shnum, elf_prgload_t* prgload_result, size_t prgload_result_len, sym_table_t* syms, char* entry_name, uintptr_t* entry_ptr) {
+enum elf_load_result elf_load_syms(vfs_node_t* file, void* shdr, bool is_elf64, bool is_rel, size_t e_shentsize, size_t e_shnum, elf_prgload_t* prgload_result, size_t prgload_result_len, sym_table_t* syms, char* entry_name, uintptr_t* entry_ptr, arena_t* arena) {
 #ifdef ELF_FORCE_CLASS
     (void) is_elf64;
 #endif
@@ -627,7 +625,7 @@ enum elf_load_result elf_load_syms(vfs_node_t* file, void* shdr, bool is_elf64,
                 kerror("symbol table at entry %u points to an invalid table at entry %u as its string table (type 0x%x)", i, sh_link, strtab_type);
                 return ERR_INVALID_DATA;
             }
-            char* strtab_data = kmalloc(sh_size);
+            char* strtab_data = arena_alloc(arena, sh_size, 0);
             if(!strtab_data) {
                 kerror("cannot allocate memory for string table");
                 return ERR_ALLOC;
@@ -652,10 +650,10 @@ enum elf_load_result elf_load_syms(vfs_node_t* file, void* shdr, bool is_elf64,
             sh_size = (is_elf64) ? ((Elf64_Shdr*)shdr_ent)->sh_size : ((Elf32_Shdr*)shdr_ent)->sh_size;
             size_t sh_entsize = (is_elf64) ? ((Elf64_Shdr*)shdr_ent)->sh_entsize : ((Elf32_Shdr*)shdr_ent)->sh_entsize;
 #endif
-            void* symtab = kmalloc(sh_size);
+            void* symtab = arena_alloc(arena, sh_size, 0);
             if(!symtab) {
                 kerror("cannot allocate memory for symbol table");
-                kfree(strtab_data); return ERR_ALLOC;
+                return ERR_ALLOC;
             }
             vfs_read(   file,
 #if ELF_FORCE_CLASS == ELFCLASS64
@@ -716,15 +714,42 @@ enum elf_load_result elf_load_syms(vfs_node_t* file, void* shdr, bool is_elf64,
                     }
                 }
             }
-            kfree(symtab);
-            kfree(strtab_data);
         }
     }
 
     return LOAD_OK;
 }
 
-enum elf_load_result elf_load_phdr(vfs_node_t* file, void* hdr, bool is_elf64, void* alloc_vmm, bool user, elf_prgload_t** prgload_result, size_t* prgload_result_len) {
+/* gives back the large blocks set aside for a segment's huge pages */
+static void elf_free_huge(const size_t* blocks, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        if(blocks[i] == (size_t)-1) continue;
+        for(size_t j = 0; j < pmm_large_frames(); j++) pmm_free(blocks[i] + j);
+    }
+}
+
+/* zero-fills bytes [start, end) of a large block; returns false if one of its frames cannot be mapped */
+static bool elf_clear_huge(size_t block, size_t start, size_t end) {
+    size_t framesz = pmm_framesz();
+    while(start < end) {
+        size_t sz = framesz - start % framesz;
+        if(sz > end - start) sz = end - start;
+        uint8_t* ptr = vmm_kmap((block + start / framesz) * framesz);
+        if(!ptr) return false;
+        memset(&ptr[start % framesz], 0, sz);
+        vmm_kunmap(ptr);
+        start += sz;
+    }
+    return true;
+}
+
+/* releases a segment that has not made it into the program loading results */
+static void elf_unload_seg(void* alloc_vmm, uintptr_t seg_start, size_t seg_sz) {
+    vmm_anon_unmap(alloc_vmm, seg_start, seg_sz); // this also drops the frames that have been mapped so far
+    vmm_region_release(alloc_vmm, seg_start, seg_sz);
+}
+
+enum elf_load_result elf_load_phdr(vfs_node_t* file, void* hdr, bool is_elf64, void* alloc_vmm, bool user, elf_prgload_t** prgload_result, size_t* prgload_result_len, arena_t* arena) {
     *prgload_result = NULL; *prgload_result_len = 0;
 
     /* load program header offset and sizes */
@@ -752,7 +777,7 @@ enum elf_load_result elf_load_phdr(vfs_node_t* file, void* hdr, bool is_elf64, v
 #endif
 
     /* allocate and load program headers */
-    void* phdr = kmalloc(e_phentsize * e_phnum);
+    void* phdr = arena_alloc(arena, e_phentsize * e_phnum, 0);
     if(!phdr) {
         kerror("cannot allocate memory for program header table");
         return ERR_ALLOC;
@@ -760,7 +785,6 @@ enum elf_load_result elf_load_phdr(vfs_node_t* file, void* hdr, bool is_elf64, v
     vfs_read(file, e_phoff, e_phentsize * e_phnum, (uint8_t*) phdr);
 
     void* phdr_ent = phdr;
-    uint8_t* copy_dst = NULL;
     for(size_t i = 0; i < e_phnum; i++) {
 #if ELF_FORCE_CLASS == ELFCLASS64
         size_t p_type = ((Elf64_Phdr*)phdr_ent)->p_type;
@@ -788,42 +812,114 @@ enum elf_load_result elf_load_phdr(vfs_node_t* file, void* hdr, bool is_elf64, v
 
         if(p_type != PT_LOAD) continue; // skip non-loading headers
 
-        size_t pgsz = pmm_framesz(); // TODO: implement hugepage support here?
+        size_t pgsz = pmm_framesz();
+        size_t hpgsz = (user && vmm_pgsz_num() > 1 && vmm_pgsz(1) == pmm_large_frames() * pgsz) ? vmm_pgsz(1) : 0; // huge page size, or 0 if large blocks cannot back huge pages
+
+        /* allocate memory for the segment */
+        size_t seg_pages = (p_memsz + p_vaddr % pgsz + pgsz - 1) / pgsz, new_pages = 0;
+        uintptr_t seg_start = p_vaddr - p_vaddr % pgsz; // virtual address of the segment's first page
+        uintptr_t lazy_start = seg_start + seg_pages * pgsz; // virtual address of the first page to be mapped on first access
+        if(user && p_filesz < p_memsz) lazy_start = (p_vaddr + p_filesz + pgsz - 1) / pgsz * pgsz; // pages with nothing to read from the file are left to the page fault handler
+        for(size_t j = 0; j < seg_pages; j++) {
+            if(seg_start + j * pgsz < lazy_start && !vmm_get_paddr(alloc_vmm, seg_start + j * pgsz)) new_pages++;
+        }
+        if(!vmm_region_reserve(alloc_vmm, seg_start, seg_pages * pgsz)) {
+            kerror("cannot reserve address space for segment");
+            elf_unload_prg(alloc_vmm, *prgload_result, *prgload_result_len);
+            return ERR_ALLOC;
+        }
+        if(!vmm_anon_map(alloc_vmm, lazy_start, seg_start + seg_pages * pgsz - lazy_start, VMM_FLAGS_USER | VMM_FLAGS_CACHE | ((p_flags & PF_W) ? VMM_FLAGS_RW : 0))) {
+            kerror("cannot set up zero-filled area of segment");
+            vmm_region_release(alloc_vmm, seg_start, seg_pages * pgsz);
+            elf_unload_prg(alloc_vmm, *prgload_result, *prgload_result_len);
+            return ERR_ALLOC;
+        }
+
+        /* back the huge pages that the loaded part of the segment fully covers with large blocks, as long as they can be allocated */
+        uintptr_t huge_start = (hpgsz) ? ((seg_start + hpgsz - 1) / hpgsz * hpgsz) : lazy_start; // virtual address of the first huge page
+        size_t huge_pages = (lazy_start > huge_start) ? (lazy_start - huge_start) / hpgsz : 0;
+        size_t* huge_blocks = (huge_pages) ? arena_alloc(arena, huge_pages * sizeof(size_t), 0) : NULL; // first frame of each huge page's block, or -1 if it's left to small pages
+        if(!huge_blocks) huge_pages = 0;
+        bool huge_avail = true; // cleared once we run out of large blocks
+        for(size_t j = 0; j < huge_pages; j++) {
+            uintptr_t vaddr = huge_start + j * hpgsz;
+            huge_blocks[j] = (size_t)-1;
+            if(!huge_avail) continue;
+            bool mapped = false;
+            for(size_t off = 0; off < hpgsz && !mapped; off += pgsz) mapped = vmm_get_paddr(alloc_vmm, vaddr + off);
+            if(mapped) continue; // shared with another segment
+            huge_blocks[j] = pmm_alloc_large();
+            if(huge_blocks[j] != (size_t)-1) new_pages -= hpgsz / pgsz;
+            else huge_avail = false;
+        }
 
-        /* find a place in our address space to map segments to for copying */
-        if(!copy_dst) {
-            copy_dst = (void*) vmm_alloc_map(vmm_current, 0, pgsz, kernel_end, UINTPTR_MAX, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW); // TODO: will mapping and unmapping the entire segment be more efficient than mapping individual pages?
-            if(!copy_dst) {
-                kerror("cannot find space to map segment for copying data");
+        size_t* frames = NULL;
+        size_t frame_flags = (p_memsz > p_filesz) ? PMM_ZEROED : 0; // get zero-filled frames if there's anything to clear
+        if(new_pages) {
+            frames = arena_alloc(arena, new_pages * sizeof(size_t), 0);
+            if(!frames || pmm_alloc_many_flags(new_pages, frames, frame_flags)) {
+                kerror("cannot allocate memory for segment frames");
+                elf_free_huge(huge_blocks, huge_pages);
+                elf_unload_seg(alloc_vmm, seg_start, seg_pages * pgsz);
                 elf_unload_prg(alloc_vmm, *prgload_result, *prgload_result_len);
                 return ERR_ALLOC;
             }
         }
-
-        /* allocate memory for the segment */
-        for(size_t j = 0; j < (p_memsz + p_vaddr % pgsz + pgsz - 1) / pgsz; j++) {
-            uintptr_t vaddr = p_vaddr - p_vaddr % pgsz + j * pgsz; // page's virtual address
-            if(!vmm_get_paddr(alloc_vmm, vaddr)) {
-                /* new page - allocate memory for it */
-                size_t frame = pmm_alloc_free(1);
-                if(frame == (size_t)-1) {
-                    kerror("cannot allocate memory for segment frame");
-                    elf_unload_prg(alloc_vmm, *prgload_result, *prgload_result_len);
-                    return ERR_ALLOC;
-                }
-                vmm_pgmap(alloc_vmm, frame * pgsz, vaddr, 0, VMM_FLAGS_PRESENT | ((user) ? VMM_FLAGS_USER : 0) | VMM_FLAGS_CACHE | ((p_flags & PF_W) ? VMM_FLAGS_RW : 0));
+        vmm_txn_t txn; // map the whole segment with a single TLB flush
+        if(!vmm_txn_begin(&txn, alloc_vmm)) {
+            kerror("cannot start mapping segment");
+            if(new_pages) pmm_free_many(new_pages, frames);
+            elf_free_huge(huge_blocks, huge_pages);
+            elf_unload_seg(alloc_vmm, seg_start, seg_pages * pgsz);
+            elf_unload_prg(alloc_vmm, *prgload_result, *prgload_result_len);
+            return ERR_ALLOC;
+        }
+        for(size_t j = 0, k = 0; j < seg_pages; j++) {
+            uintptr_t vaddr = seg_start + j * pgsz; // page's virtual address
+            size_t huge_idx = (huge_pages && vaddr >= huge_start && vaddr % hpgsz == 0) ? (vaddr - huge_start) / hpgsz : huge_pages;
+            if(huge_idx < huge_pages && huge_blocks[huge_idx] != (size_t)-1) {
+                /* huge page backed by a large block - the block's data is filled in below, one frame at a time */
+                vmm_txn_pgmap(&txn, huge_blocks[huge_idx] * pgsz, vaddr, 1, VMM_FLAGS_PRESENT | VMM_FLAGS_USER | VMM_FLAGS_CACHE | ((p_flags & PF_W) ? VMM_FLAGS_RW : 0));
+                pmm_page_mark(huge_blocks[huge_idx], hpgsz / pgsz, PMM_PAGE_USER, alloc_vmm); // not movable, since migration only remaps single pages
+                j += hpgsz / pgsz - 1;
+            } else if(!vmm_get_paddr(alloc_vmm, vaddr)) {
+                if(vaddr >= lazy_start) continue; // zero-filled page that will be mapped on first access
+                /* new page - map one of the allocated frames to it */
+                vmm_txn_pgmap(&txn, frames[k] * pgsz, vaddr, 0, VMM_FLAGS_PRESENT | ((user) ? VMM_FLAGS_USER : 0) | VMM_FLAGS_CACHE | ((p_flags & PF_W) ? VMM_FLAGS_RW : 0));
+                if(user) pmm_page_map(frames[k++], PMM_PAGE_USER, alloc_vmm, vaddr);
+                else pmm_page_mark(frames[k++], 1, PMM_PAGE_KERNEL, alloc_vmm);
             } else if(p_flags & PF_W) {
                 /* page is currently mapped, so we only need to set the RW flag if we need it */
                 size_t pg_flags = vmm_get_flags(alloc_vmm, vaddr);
-                if(!(pg_flags & VMM_FLAGS_RW)) vmm_set_flags(alloc_vmm, vaddr, pg_flags | VMM_FLAGS_RW);
+                if(!(pg_flags & VMM_FLAGS_RW)) vmm_txn_set_flags(&txn, vaddr, pg_flags | VMM_FLAGS_RW);
+            }
+        }
+        vmm_txn_commit(&txn);
+
+        /* large blocks are not zero-filled, so clear whatever the segment does not cover in the first and last pages of each */
+        for(size_t j = 0; j < huge_pages; j++) {
+            if(huge_blocks[j] == (size_t)-1) continue;
+            uintptr_t vaddr = huge_start + j * hpgsz;
+            uintptr_t head = (p_vaddr > vaddr) ? p_vaddr : vaddr; // first byte covered by the segment
+            uintptr_t tail = (p_vaddr + p_memsz < vaddr + hpgsz) ? (p_vaddr + p_memsz) : (vaddr + hpgsz); // first byte past the covered part
+            if(!elf_clear_huge(huge_blocks[j], 0, head - vaddr) || !elf_clear_huge(huge_blocks[j], tail - vaddr, hpgsz)) {
+                kerror("cannot map segment page for clearing");
+                elf_unload_seg(alloc_vmm, seg_start, seg_pages * pgsz);
+                elf_unload_prg(alloc_vmm, *prgload_result, *prgload_result_len);
+                return ERR_ALLOC;
             }
         }
 
         /* copy data to the segment, one page at a time */
         size_t offset = 0;
-        while(offset < p_memsz) {
+        for(size_t k = 0; offset < p_memsz; ) {
             uintptr_t paddr = vmm_get_paddr(alloc_vmm, p_vaddr + offset);
-            vmm_set_paddr(vmm_current, (uintptr_t) copy_dst, paddr);
+            if(!paddr) {
+                offset += pgsz - (p_vaddr + offset) % pgsz; // page has not been mapped yet, and will be zero-filled when it is
+                continue;
+            }
+            bool fresh = (k < new_pages && frames[k] == paddr / pgsz); // set if this page is backed by a small frame we've just allocated (large blocks are not zero-filled)
+            if(fresh) k++;
 
             size_t sz = pgsz - paddr % pgsz; // number of bytes to write to in this page
             if(offset + sz > p_memsz) sz = p_memsz - offset;
@@ -836,8 +932,20 @@ enum elf_load_result elf_load_phdr(vfs_node_t* file, void* hdr, bool is_elf64, v
                 sz_set = sz - sz_read;
             }
 
-            if(sz_read) vfs_read(file, p_offset + offset, sz_read, &copy_dst[paddr % pgsz]);
-            if(sz_set) memset(&copy_dst[paddr % pgsz + sz_read], 0, sz_set);
+            if(fresh && (frame_flags & PMM_ZEROED)) sz_set = 0; // frame is already zero-filled
+
+            if(sz_read || sz_set) {
+                uint8_t* copy_dst = vmm_kmap(paddr - paddr % pgsz);
+                if(!copy_dst) {
+                    kerror("cannot map segment page for copying data");
+                    elf_unload_seg(alloc_vmm, seg_start, seg_pages * pgsz);
+                    elf_unload_prg(alloc_vmm, *prgload_result, *prgload_result_len);
+                    return ERR_ALLOC;
+                }
+                if(sz_read) vfs_read(file, p_offset + offset, sz_read, &copy_dst[paddr % pgsz]);
+                if(sz_set) memset(&copy_dst[paddr % pgsz + sz_read], 0, sz_set);
+                vmm_kunmap(copy_dst);
+            }
 
             offset += sz;
         }
@@ -847,6 +955,7 @@ enum elf_load_result elf_load_phdr(vfs_node_t* file, void* hdr, bool is_elf64, v
         *prgload_result = krealloc(*prgload_result, *prgload_result_len * sizeof(elf_prgload_t));
         if(!*prgload_result) {
             kerror("cannot allocate memory for program loading result");
+            elf_unload_seg(alloc_vmm, seg_start, seg_pages * pgsz);
             elf_unload_prg(alloc_vmm, prgload_result_old, (*prgload_result_len) - 1);
             return ERR_ALLOC;
         }
@@ -855,17 +964,20 @@ enum elf_load_result elf_load_phdr(vfs_node_t* file, void* hdr, bool is_elf64, v
         (*prgload_result)[*prgload_result_len - 1].vaddr = p_vaddr;
         (*prgload_result)[*prgload_result_len - 1].size = p_memsz;      
     }
-    if(copy_dst) vmm_pgunmap(vmm_current, (uintptr_t) copy_dst, 0);
-
-    kfree(phdr);
     return LOAD_OK;
 }
 
 enum elf_load_result elf_load_exec(vfs_node_t* file, bool user, void* alloc_vmm, elf_prgload_t** load_result, size_t* load_result_len, uintptr_t* entry_ptr) {
+    /* set up arena for temporary data (headers, tables etc.) */
+    arena_t* arena = arena_create(ELF_ARENA_CHUNK_SIZE);
+    if(!arena) return ERR_ALLOC;
+
     /* load and check file header */
     void* hdr; bool is_elf64;
-    enum elf_load_result result = elf_read_header(file, &hdr, &is_elf64);
-    if(result != LOAD_OK) return result; // failure
+    enum elf_load_result result = elf_read_header(file, &hdr, &is_elf64, arena);
+    if(result != LOAD_OK) {
+        arena_destroy(arena); return result; // failure
+    }
 
     /* check file type */
 #if ELF_FORCE_CLASS == ELFCLASS64
@@ -876,14 +988,14 @@ enum elf_load_result elf_load_exec(vfs_node_t* file, bool user, void* alloc_vmm,
     if((is_elf64 && ((Elf64_Ehdr*)hdr)->e_type != ET_EXEC) || (!is_elf64 && ((Elf32_Ehdr*)hdr)->e_type != ET_EXEC)) {
 #endif
         kerror("not an executable binary (not ET_EXEC)");
-        kfree(hdr); return ERR_UNSUPPORTED_TYPE;
+        arena_destroy(arena); return ERR_UNSUPPORTED_TYPE;
     }
 
     /* load program headers */
     elf_prgload_t* prgload_result; size_t prgload_result_len;
-    result = elf_load_phdr(file, hdr, is_elf64, alloc_vmm, user, &prgload_result, &prgload_result_len);
+    result = elf_load_phdr(file, hdr, is_elf64, alloc_vmm, user, &prgload_result, &prgload_result_len, arena);
     if(result != LOAD_OK) {
-        kfree(hdr); return result;
+        arena_destroy(arena); return result;
     }
 
     /* return values to caller */
@@ -900,15 +1012,21 @@ enum elf_load_result elf_load_exec(vfs_node_t* file, bool user, void* alloc_vmm,
 #endif
 
     kinfo("executable binary loading is complete");
-    kfree(hdr);
+    arena_destroy(arena);
     return LOAD_OK;
 }
 
 enum elf_load_result elf_load_ksym(vfs_node_t* file) {
+    /* set up arena for temporary data (headers, tables etc.) */
+    arena_t* arena = arena_create(ELF_ARENA_CHUNK_SIZE);
+    if(!arena) return ERR_ALLOC;
+
     /* load and check file header */
     void* hdr; bool is_elf64;
-    enum elf_load_result result = elf_read_header(file, &hdr, &is_elf64);
-    if(result != LOAD_OK) return result; // failure
+    enum elf_load_result result = elf_read_header(file, &hdr, &is_elf64, arena);
+    if(result != LOAD_OK) {
+        arena_destroy(arena); return result; // failure
+    }
 
     /* check file type */
 #if ELF_FORCE_CLASS == ELFCLASS64
@@ -919,31 +1037,37 @@ enum elf_load_result elf_load_ksym(vfs_node_t* file) {
     if((is_elf64 && ((Elf64_Ehdr*)hdr)->e_type != ET_REL) || (!is_elf64 && ((Elf32_Ehdr*)hdr)->e_type != ET_REL)) {
 #endif
         kerror("not a kernel symbols file (not ET_EXEC)");
-        kfree(hdr); return ERR_UNSUPPORTED_TYPE;
+        arena_destroy(arena); return ERR_UNSUPPORTED_TYPE;
     }
 
     /* load section headers and section header string table */
     size_t e_shentsize, e_shnum; // size of each section header entry and number of section headers
     void* shdr; char* shstrtab_data;
-    result = elf_read_shdr(file, hdr, is_elf64, &shdr, &shstrtab_data, &e_shentsize, &e_shnum);
+    result = elf_read_shdr(file, hdr, is_elf64, &shdr, &shstrtab_data, &e_shentsize, &e_shnum, arena);
     if(result != LOAD_OK) {
-        kfree(hdr);
+        arena_destroy(arena);
         return result;
     }
 
     /* save symbols */
-    result = elf_load_syms(file, shdr, is_elf64, true, e_shentsize, e_shnum, NULL, 0, kernel_syms, NULL, NULL);
+    result = elf_load_syms(file, shdr, is_elf64, true, e_shentsize, e_shnum, NULL, 0, kernel_syms, NULL, NULL, arena);
 
     kinfo("kernel symbols loading is complete");
-    kfree(shdr); kfree(hdr); kfree(shstrtab_data);
+    arena_destroy(arena);
     return result;
 }
 
 enum elf_load_result elf_load_kmod(vfs_node_t* file, elf_prgload_t** load_result, size_t* load_result_len, uintptr_t* entry_ptr) {
+    /* set up arena for temporary data (headers, tables etc.) */
+    arena_t* arena = arena_create(ELF_ARENA_CHUNK_SIZE);
+    if(!arena) return ERR_ALLOC;
+
     /* load and check file header */
     void* hdr; bool is_elf64;
-    enum elf_load_result result = elf_read_header(file, &hdr, &is_elf64);
-    if(result != LOAD_OK) return result; // failure
+    enum elf_load_result result = elf_read_header(file, &hdr, &is_elf64, arena);
+    if(result != LOAD_OK) {
+        arena_destroy(arena); return result; // failure
+    }
 
     /* check file type */
 #if ELF_FORCE_CLASS == ELFCLASS64
@@ -954,35 +1078,35 @@ enum elf_load_result elf_load_kmod(vfs_node_t* file, elf_prgload_t** load_result
     if((is_elf64 && ((Elf64_Ehdr*)hdr)->e_type != ET_REL) || (!is_elf64 && ((Elf32_Ehdr*)hdr)->e_type != ET_REL)) {
 #endif
         kerror("not a kernel module (not ET_REL)");
-        kfree(hdr); return ERR_UNSUPPORTED_TYPE;
+        arena_destroy(arena); return ERR_UNSUPPORTED_TYPE;
     }
 
     /* load section headers and section header string table */
     size_t e_shentsize, e_shnum; // size of each section header entry and number of section headers
     void* shdr; char* shstrtab_data;
-    result = elf_read_shdr(file, hdr, is_elf64, &shdr, &shstrtab_data, &e_shentsize, &e_shnum);
+    result = elf_read_shdr(file, hdr, is_elf64, &shdr, &shstrtab_data, &e_shentsize, &e_shnum, arena);
     if(result != LOAD_OK) {
-        kfree(hdr);
+        arena_destroy(arena);
         return result;
     }
 
     /* load file and relocate symbols */
     elf_prgload_t* prgload_result = NULL; size_t prgload_result_len = 0;
-    result = elf_load_rel(file, shdr, is_elf64, e_shentsize, e_shnum, vmm_kernel, &prgload_result, &prgload_result_len);
+    result = elf_load_rel(file, shdr, is_elf64, e_shentsize, e_shnum, vmm_kernel, &prgload_result, &prgload_result_len, arena);
     if(result != LOAD_OK) {
-        kfree(shdr); kfree(hdr); kfree(shstrtab_data);
+        arena_destroy(arena);
         return result;
     }
-    result = elf_do_reloc(file, hdr, shdr, is_elf64, e_shentsize, e_shnum, prgload_result, prgload_result_len);
+    result = elf_do_reloc(file, hdr, shdr, is_elf64, e_shentsize, e_shnum, prgload_result, prgload_result_len, arena);
     if(result != LOAD_OK) {
-        kfree(prgload_result); kfree(shdr); kfree(hdr); kfree(shstrtab_data);
+        kfree(prgload_result); arena_destroy(arena);
         return result;
     }
     
     /* save symbols */
-    result = elf_load_syms(file, shdr, is_elf64, true, e_shentsize, e_shnum, prgload_result, prgload_result_len, kernel_syms, ELF_KMOD_INIT_FUNC, entry_ptr);
+    result = elf_load_syms(file, shdr, is_elf64, true, e_shentsize, e_shnum, prgload_result, prgload_result_len, kernel_syms, ELF_KMOD_INIT_FUNC, entry_ptr, arena);
     if(result != LOAD_OK) {
-        kfree(prgload_result); kfree(shdr); kfree(hdr); kfree(shstrtab_data);
+        kfree(prgload_result); arena_destroy(arena);
         return result;
     }
     if(entry_ptr && !*entry_ptr) kwarn("cannot find entry point");
@@ -992,25 +1116,14 @@ enum elf_load_result elf_load_kmod(vfs_node_t* file, elf_prgload_t** load_result
     if(load_result_len) *load_result_len = prgload_result_len;
 
     kinfo("kernel module loading is complete");
-    kfree(shstrtab_data);
-    kfree(shdr);
-    kfree(hdr);
+    arena_destroy(arena);
     return LOAD_OK;
 }
 
 void elf_unload_prg(void* alloc_vmm, elf_prgload_t* load_result, size_t load_result_len) {
-    size_t framesz = pmm_framesz();
     for(size_t i = 0; i < load_result_len; i++) {
-        size_t vaddr = load_result[i].vaddr;
-        size_t pgsz;
-        for(size_t off = 0; off < load_result[i].size; off += pgsz, vaddr += pgsz) {
-            size_t paddr = vmm_get_paddr(alloc_vmm, vaddr);
-            size_t pgsz_idx = vmm_get_pgsz(alloc_vmm, vaddr); pgsz = vmm_pgsz(pgsz_idx); // resolve for adding to variables
-            vmm_pgunmap(alloc_vmm, vaddr, pgsz_idx);
-            if(paddr) {
-                for(size_t j = 0; j < pgsz / framesz; j++) pmm_free(paddr / framesz + j);
-            }
-        }
+        vmm_anon_unmap(alloc_vmm, load_result[i].vaddr, load_result[i].size); // this also skips the zero-filled pages that have never been touched
+        vmm_region_release(alloc_vmm, load_result[i].vaddr, load_result[i].size);
     }
     kfree(load_result);
 }
@@ -4,6 +4,7 @@
 #include <kernel/log.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
+#include <mm/slab.h>
 #include <fs/devfs.h>
 #include <string.h>
 
@@ -13,6 +14,8 @@ static mutex_t proc_mutex = {0}; // mutex for PID table-related operations
 
 struct proc* proc_kernel = NULL; // kernel process
 
+static kmem_cache_t* proc_fd_cache = NULL; // cache for file descriptor entries
+
 #ifndef PROC_PIDTAB_ALLOCSZ
 #define PROC_PIDTAB_ALLOCSZ         4 // number of process entries to be allocated at once
 #endif
@@ -125,6 +128,8 @@ void proc_delete(struct proc* proc) {
 }
 
 void proc_do_delete(struct proc* proc) {
+    for(size_t i = 0; i < proc->num_fds; i++) kmem_cache_free(proc_fd_cache, proc->fds[i]);
+    kfree(proc->fds);
     vmm_free(proc->vmm); // delete VMM config (or stage it for deletion)
     proc_pid_free(proc->pid);
     kfree(proc);
@@ -181,6 +186,8 @@ void proc_delete_task(struct proc* proc, void* task) {
 }
 
 void proc_init() {
+    proc_fd_cache = kmem_cache_create("fd", sizeof(fd_t), 0, NULL);
+    kassert(proc_fd_cache);
     proc_kernel = proc_create(NULL, NULL, false); // we'll set the VMM later
     kassert(proc_kernel);
     proc_kernel->vmm = vmm_kernel;
@@ -199,10 +206,10 @@ size_t proc_fd_open(struct proc* proc, vfs_node_t* node, bool duplicate, bool re
     mutex_acquire(&proc->mu_fds);
     size_t i = 0;
     for(; i < proc->num_fds; i++) {
-        if(!proc->fds[i].ftab || (!duplicate && proc->fds[i].ftab == ftab)) break;
+        if(!proc->fds[i] || !proc->fds[i]->ftab || (!duplicate && proc->fds[i]->ftab == ftab)) break;
     }
     if(i == proc->num_fds) {
-        fd_t* new_fds = krealloc(proc->fds, (proc->num_fds + PROC_FDS_ALLOCSZ) * sizeof(fd_t));
+        fd_t** new_fds = krealloc(proc->fds, (proc->num_fds + PROC_FDS_ALLOCSZ) * sizeof(fd_t*));
         if(!new_fds) {
             kerror("insufficient memory to add fd entry to process 0x%x", proc);
             mutex_release(&proc->mu_fds);
@@ -210,29 +217,39 @@ size_t proc_fd_open(struct proc* proc, vfs_node_t* node, bool duplicate, bool re
         }
         proc->fds = new_fds;
         proc->num_fds += PROC_FDS_ALLOCSZ;
-        memset(&proc->fds[i], 0, PROC_TASK_ALLOCSZ * sizeof(fd_t));
+        memset(&proc->fds[i], 0, PROC_FDS_ALLOCSZ * sizeof(fd_t*));
     }
+    if(!proc->fds[i]) {
+        proc->fds[i] = kmem_cache_alloc(proc_fd_cache);
+        if(!proc->fds[i]) {
+            kerror("insufficient memory to allocate fd entry for process 0x%x", proc);
+            mutex_release(&proc->mu_fds);
+            return (size_t)-1;
+        }
+        memset(proc->fds[i], 0, sizeof(fd_t));
+    }
+    fd_t* ent = proc->fds[i];
     mutex_release(&proc->mu_fds);
 
-    mutex_acquire(&proc->fds[i].mutex);
-    proc->fds[i].ftab = ftab;
-    proc->fds[i].read = (read) ? 1 : 0;
-    proc->fds[i].write = (write) ? 1 : 0;
-    proc->fds[i].append = (append) ? 1 : 0;
-    proc->fds[i].offset = 0; // reset offset
-    mutex_release(&proc->fds[i].mutex);
+    mutex_acquire(&ent->mutex);
+    ent->ftab = ftab;
+    ent->read = (read) ? 1 : 0;
+    ent->write = (write) ? 1 : 0;
+    ent->append = (append) ? 1 : 0;
+    ent->offset = 0; // reset offset
+    mutex_release(&ent->mutex);
 
     return i;
 }
 
 bool proc_fd_check(struct proc* proc, size_t fd) {
     mutex_acquire(&proc->mu_fds);
-    bool ret = (fd < proc->num_fds);
+    bool ret = (fd < proc->num_fds && proc->fds[fd]);
     mutex_release(&proc->mu_fds);
     if(ret) {
-        mutex_acquire(&proc->fds[fd].mutex);
-        ret = (proc->fds[fd].ftab);
-        mutex_release(&proc->fds[fd].mutex);
+        mutex_acquire(&proc->fds[fd]->mutex);
+        ret = (proc->fds[fd]->ftab);
+        mutex_release(&proc->fds[fd]->mutex);
     }
     return ret;
 }
@@ -240,40 +257,41 @@ bool proc_fd_check(struct proc* proc, size_t fd) {
 void proc_fd_close(struct proc* proc, size_t fd) {
     if(!proc_fd_check(proc, fd)) return;
 
-    mutex_acquire(&proc->fds[fd].mutex);
-    ftab_close(proc->fds[fd].ftab, proc);
-    memset(&proc->fds[fd], 0, sizeof(fd_t));
-    mutex_release(&proc->fds[fd].mutex); // this might not be necessary
+    fd_t* ent = proc->fds[fd];
+    mutex_acquire(&ent->mutex);
+    ftab_close(ent->ftab, proc);
+    memset(ent, 0, sizeof(fd_t)); // the entry stays in the table for reuse
+    mutex_release(&ent->mutex); // this might not be necessary
 }
 
 uint64_t proc_fd_read(struct proc* proc, size_t fd, uint64_t size, uint8_t* buf) {
     if(!proc_fd_check(proc, fd)) return 0; // invalid fd
 
-    mutex_acquire(&proc->fds[fd].mutex);
+    mutex_acquire(&proc->fds[fd]->mutex);
 
     uint64_t ret = 0;
-    if(proc->fds[fd].read) {
-        ret = ftab_read(proc->fds[fd].ftab, proc, proc->fds[fd].offset, size, buf);
-        proc->fds[fd].offset += ret;
+    if(proc->fds[fd]->read) {
+        ret = ftab_read(proc->fds[fd]->ftab, proc, proc->fds[fd]->offset, size, buf);
+        proc->fds[fd]->offset += ret;
     }
 
-    mutex_release(&proc->fds[fd].mutex);
+    mutex_release(&proc->fds[fd]->mutex);
     return ret;
 }
 
 uint64_t proc_fd_write(struct proc* proc, size_t fd, uint64_t size, const uint8_t* buf) {
     if(!proc_fd_check(proc, fd)) return 0; // invalid fd
 
-    mutex_acquire(&proc->fds[fd].mutex);
+    mutex_acquire(&proc->fds[fd]->mutex);
 
     uint64_t ret = 0;
-    if(proc->fds[fd].write) {
-        if(proc->fds[fd].append) proc->fds[fd].offset = proc->fds[fd].ftab->node->length; // seek to end before writing
-        ret = ftab_write(proc->fds[fd].ftab, proc, proc->fds[fd].offset, size, buf);
-        proc->fds[fd].offset += ret;
+    if(proc->fds[fd]->write) {
+        if(proc->fds[fd]->append) proc->fds[fd]->offset = proc->fds[fd]->ftab->node->length; // seek to end before writing
+        ret = ftab_write(proc->fds[fd]->ftab, proc, proc->fds[fd]->offset, size, buf);
+        proc->fds[fd]->offset += ret;
     }
 
-    mutex_release(&proc->fds[fd].mutex);
+    mutex_release(&proc->fds[fd]->mutex);
     return ret;
 }
 
@@ -287,24 +305,42 @@ struct proc* proc_fork() {
     /* TODO: deal with ELF segments */
 
     /* copy file descriptors */
-    fd_t* new_fds = krealloc(dst->fds, src->num_fds * sizeof(fd_t));
-    if(!new_fds) {
-        kerror("cannot extend file descriptor table");
-        proc_delete(dst);
-        return NULL;
+    if(src->num_fds > dst->num_fds) {
+        fd_t** new_fds = krealloc(dst->fds, src->num_fds * sizeof(fd_t*));
+        if(!new_fds) {
+            kerror("cannot extend file descriptor table");
+            proc_delete(dst);
+            return NULL;
+        }
+        memset(&new_fds[dst->num_fds], 0, (src->num_fds - dst->num_fds) * sizeof(fd_t*));
+        dst->num_fds = src->num_fds; dst->fds = new_fds;
+    }
+    for(size_t i = 0; i < src->num_fds; i++) {
+        if(!src->fds[i] || !src->fds[i]->ftab) {
+            if(dst->fds[i]) memset(dst->fds[i], 0, sizeof(fd_t));
+            continue;
+        }
+        if(!dst->fds[i]) {
+            dst->fds[i] = kmem_cache_alloc(proc_fd_cache);
+            if(!dst->fds[i]) {
+                kerror("cannot allocate file descriptor %u", i);
+                proc_delete(dst);
+                return NULL;
+            }
+        }
+        memcpy(dst->fds[i], src->fds[i], sizeof(fd_t));
+        memset(&dst->fds[i]->mutex, 0, sizeof(mutex_t)); // the source entry's mutex might be held
     }
-    dst->num_fds = src->num_fds; dst->fds = new_fds;
-    memcpy(dst->fds, src->fds, src->num_fds * sizeof(fd_t));
     for(size_t i = 3; i < dst->num_fds; i++) {
         /* reopen files */
-        if(dst->fds[i].ftab) {
-            if(dst->fds[i].ftab->excl) {
+        if(dst->fds[i] && dst->fds[i]->ftab) {
+            if(dst->fds[i]->ftab->excl) {
                 kerror("file descriptor %u is being exclusively accessed, so the forked task will not be able to access it");
-                memset(&dst->fds[i], 0, sizeof(fd_t));
+                memset(dst->fds[i], 0, sizeof(fd_t));
             } else {
-                mutex_acquire(&dst->fds[i].ftab->mutex);
-                dst->fds[i].ftab->refs++; // 1 more process is holding it
-                mutex_release(&dst->fds[i].ftab->mutex);
+                mutex_acquire(&dst->fds[i]->ftab->mutex);
+                dst->fds[i]->ftab->refs++; // 1 more process is holding it
+                mutex_release(&dst->fds[i]->ftab->mutex);
             }
         }
     }
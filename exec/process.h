@@ -39,7 +39,7 @@ struct proc {
 
     mutex_t mu_fds; // mutex for adding/deleting file descriptors
     size_t num_fds; // number of entries (used + free) for file descriptors
-    fd_t* fds; // file descriptor table (maps to file table)
+    fd_t** fds; // file descriptor table (maps to file table) - entries are allocated from a slab cache
 };
 typedef struct proc proc_t;
 
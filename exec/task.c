@@ -4,6 +4,7 @@
 #include <mm/addr.h>
 #include <kernel/kernel.h>
 #include <kernel/log.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdatomic.h>
 
@@ -18,6 +19,10 @@ bool task_get_ready(void* task) {
     return (task_common(task)->ready);
 }
 
+void task_set_idle(void* task, bool idle) {
+    task_common(task)->idle = (idle) ? 1 : 0;
+}
+
 void task_insert(void* task, void* target) {
     task_yield_block();
     task_common_t* common = task_common(task);
@@ -29,6 +34,18 @@ void task_insert(void* task, void* target) {
     task_yield_unblock();
 }
 
+/* size of the stack frames that are allocated up front - user tasks only need the ones holding their kernel stack */
+static size_t task_stack_eager(bool user, size_t stack_sz) {
+    size_t framesz = pmm_framesz();
+    return (user) ? ((TASK_KERNEL_STACK_SIZE + framesz - 1) / framesz * framesz) : stack_sz;
+}
+
+/* size of the address space set aside for a stack - user stacks can grow down to TASK_USER_STACK_MAX, with a guard page below */
+static size_t task_stack_span(bool user, size_t stack_sz) {
+    if(!user) return stack_sz;
+    return ((stack_sz > TASK_USER_STACK_MAX) ? stack_sz : TASK_USER_STACK_MAX) + pmm_framesz();
+}
+
 void* task_create(bool user, struct proc* proc, size_t stack_sz, uintptr_t entry, uintptr_t stack_bottom) {
     /* allocate memory for new task */
     void* task = task_create_stub(user);
@@ -46,28 +63,50 @@ void* task_create(bool user, struct proc* proc, size_t stack_sz, uintptr_t entry
     task_common_t* common = task_common(task);
     
     /* allocate memory for stack */
-    size_t stack_frames = 0; // number of allocated stack frames
     size_t framesz = pmm_framesz();
     if(stack_sz % framesz) stack_sz += framesz - stack_sz % framesz; // frame-align stack size
-    common->stack_bottom = (stack_bottom) ? stack_bottom : (vmm_first_free(proc->vmm, 0, kernel_start, stack_sz, 0, true) + stack_sz);
+    size_t stack_eager = task_stack_eager(user, stack_sz), stack_span = task_stack_span(user, stack_sz);
+    size_t stack_frames = stack_eager / framesz; // number of stack frames to allocate now
+    if(stack_bottom) common->stack_bottom = (vmm_region_reserve(proc->vmm, stack_bottom - stack_span, stack_span)) ? stack_bottom : 0;
+    else {
+        uintptr_t stack_top = vmm_region_alloc(proc->vmm, 0, kernel_start, stack_span, 0, true);
+        common->stack_bottom = (stack_top) ? (stack_top + stack_span) : 0;
+    }
     if(!common->stack_bottom) {
         kerror("cannot allocate virtual address space for task");
         task_delete_stub(task);
         return NULL;
     }
-    for(size_t i = 0; i < (stack_sz + framesz - 1) / framesz; i++) {
-        size_t frame = pmm_alloc_free(1);
-        if(frame == (size_t)-1) break; // cannot allocate more
-        stack_frames++;
-        // pmm_alloc(frame);
-        vmm_pgmap(proc->vmm, frame * framesz, common->stack_bottom - stack_frames * framesz, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_CACHE | ((user) ? VMM_FLAGS_USER : 0));
-    }
-    if(stack_frames * framesz <= ((user) ? TASK_KERNEL_STACK_SIZE : 0)) {
+    size_t* frames = (stack_sz > ((user) ? TASK_KERNEL_STACK_SIZE : 0)) ? kmalloc(stack_frames * sizeof(size_t)) : NULL;
+    if(!frames || pmm_alloc_many(stack_frames, frames)) {
         kerror("cannot allocate memory for task stack");
+        kfree(frames);
+        vmm_region_release(proc->vmm, common->stack_bottom - stack_span, stack_span);
         task_delete_stub(task);
         return NULL;
     }
-    common->stack_size = stack_frames * framesz;
+    if(user && !vmm_anon_stack(proc->vmm, common->stack_bottom - stack_eager, stack_sz - stack_eager, stack_span - framesz - stack_eager, VMM_FLAGS_RW | VMM_FLAGS_CACHE | VMM_FLAGS_USER)) {
+        kerror("cannot set up user stack region for task");
+        pmm_free_many(stack_frames, frames);
+        kfree(frames);
+        vmm_region_release(proc->vmm, common->stack_bottom - stack_span, stack_span);
+        task_delete_stub(task);
+        return NULL;
+    }
+    for(size_t i = 0; i < stack_frames; i++) {
+        uintptr_t vaddr = common->stack_bottom - (i + 1) * framesz;
+        if(stack_bottom && vmm_get_paddr(proc->vmm, vaddr)) {
+            /* drop the page that vmm_clone() has given us from the task we're forking from, along with its frame reference */
+            vmm_unshare(proc->vmm, vaddr);
+            size_t old_frame = vmm_get_paddr(proc->vmm, vaddr) / framesz;
+            vmm_pgunmap(proc->vmm, vaddr, 0);
+            pmm_page_unref(old_frame);
+        }
+        vmm_pgmap(proc->vmm, frames[i] * framesz, vaddr, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_CACHE | ((user) ? VMM_FLAGS_USER : 0));
+        pmm_page_mark(frames[i], 1, (user) ? PMM_PAGE_USER : PMM_PAGE_KERNEL, proc->vmm); // frames holding the task's kernel stack cannot be migrated
+    }
+    kfree(frames);
+    common->stack_size = stack_sz;
 
     /* set instruction and stack pointers */
     task_set_iptr(task, entry);
@@ -92,11 +131,19 @@ static void task_do_delete(void* task) {
 
     struct proc* proc = proc_get(common->pid);
     if(proc) {
-        /* de-allocate stack */
+        /* de-allocate stack (user stacks are told apart by their top frame, since the task type may have been changed to TASK_TYPE_DELETE_PENDING) */
         size_t framesz = pmm_framesz();
-        for(size_t i = 0; i < common->stack_size; i += framesz) {
+        bool user = (vmm_get_flags(proc->vmm, common->stack_bottom - framesz) & VMM_FLAGS_USER);
+        size_t stack_eager = task_stack_eager(user, common->stack_size), stack_span = task_stack_span(user, common->stack_size);
+        for(size_t i = 0; i < stack_eager; i += framesz) {
             uintptr_t vaddr = common->stack_bottom - framesz - i;
-            pmm_free(vmm_get_paddr(proc->vmm, vaddr) / framesz);
+            vmm_unshare(proc->vmm, vaddr); // the reference we drop must be our page table's, not one shared with a forked process's
+            pmm_page_unref(vmm_get_paddr(proc->vmm, vaddr) / framesz); // the frame may still be shared with a forked task
+        }
+        if(stack_span > stack_eager) {
+            /* the rest of a user stack is only mapped where it has been touched, and we are not running on it */
+            vmm_anon_unmap(proc->vmm, common->stack_bottom - stack_span, stack_span - stack_eager);
+            vmm_region_release(proc->vmm, common->stack_bottom - stack_span, stack_span - stack_eager);
         }
 
         /* delete task from process list and count remaining tasks */
@@ -158,6 +205,8 @@ void task_yield(void* context) {
     } else {
         void* task_selected = (void*) task_current; // the task we'll switch to next
         timer_tick_t tdelta_max = 0; // maximum duration between now and the selected task's switch-out - we'll select a ready task that has been waiting for longest
+        void* idle_selected = NULL; // idle-priority task to fall back to
+        timer_tick_t idle_tdelta_max = 0;
         void* task = (void*) task_current;
         while(1) {
             task = task_common(task)->next;
@@ -166,11 +215,21 @@ void task_yield(void* context) {
             task_common_t* common = task_common(task);
             if(!common->ready) continue; // task is not ready - discard this one
             timer_tick_t tdelta = timer_tick - common->t_switch; // figure out how long this task has been suspended for
+            if(common->idle && tdelta <= TASK_IDLE_MAX_WAIT) {
+                /* idle-priority task that hasn't been starved for too long */
+                if(!idle_selected || tdelta > idle_tdelta_max) {
+                    idle_tdelta_max = tdelta;
+                    idle_selected = task;
+                }
+                continue;
+            }
             if(tdelta > tdelta_max) {
                 tdelta_max = tdelta;
                 task_selected = task;
             }
         }
+        task_common_t* common_current = task_common((void*) task_current);
+        if(task_selected == task_current && idle_selected && (common_current->idle || !common_current->ready)) task_selected = idle_selected; // nothing else to run
         if(task_selected == task_current) return; // no tasks to switch to
         else {
             if(task_common((void*) task_current)->type == TASK_TYPE_DELETE_PENDING) {
@@ -212,24 +271,26 @@ void* task_fork_stub(struct proc* proc) {
     // stack has been allocated by task_create()
     common->ready = 0; // do not switch into this task as it's still being set up
 
-    /* copy stack */
-    uintptr_t stack_top = common->stack_bottom - common->stack_size;
-    if(proc->vmm != vmm_current) {
-        uintptr_t stack_top_src = stack_top;
-        stack_top = vmm_alloc_map(vmm_current, 0, common->stack_size, 0, kernel_start, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW);
-        if(!stack_top) {
+    /* copy stack one page at a time from the top, skipping the pages that the current task has not touched */
+    size_t framesz = pmm_framesz();
+    size_t stack_eager = task_stack_eager(user, common->stack_size), stack_span = task_stack_span(user, common->stack_size);
+    for(size_t off = framesz; off <= stack_span; off += framesz) {
+        uintptr_t src = common_current->stack_bottom - off, dst = common->stack_bottom - off;
+        uintptr_t src_paddr = vmm_get_paddr(vmm_current, src);
+        if(!src_paddr) continue;
+        if(!same_proc && off <= stack_eager) vmm_cow_duplicate(vmm_current, src, 0); // the new task no longer shares this page with us, so take it back
+        if(off > stack_eager) vmm_anon_fault(proc->vmm, dst); // populate the new stack down to here (or grow it over pages it already shares with us)
+        uintptr_t dst_paddr = vmm_get_paddr(proc->vmm, dst);
+        if(dst_paddr == src_paddr) continue; // frame is shared copy-on-write by vmm_clone()
+        void* dst_map = (dst_paddr) ? vmm_kmap(dst_paddr) : NULL;
+        if(!dst_map) {
             kerror("cannot map new task's stack for copying");
             task_delete(task);
             return NULL;
         }
-        size_t framesz = pmm_framesz();
-        for(size_t off = 0; off < common->stack_size; off += framesz, stack_top_src += framesz) {
-            vmm_set_paddr(vmm_current, stack_top + off, vmm_get_paddr(proc->vmm, stack_top_src));
-        }
+        memcpy(dst_map, (void*) src, framesz);
+        vmm_kunmap(dst_map);
     }
-    // kdebug("copying %u bytes (current = %u) of stack from 0x%x to 0x%x", common->stack_size, common_current->stack_size, common_current->stack_bottom - common_current->stack_size, stack_top);
-    memcpy((void*) stack_top, (void*) (common_current->stack_bottom - common_current->stack_size), common->stack_size);
-    if(proc->vmm != vmm_current) vmm_unmap(vmm_current, stack_top, common->stack_size); // unmap stack that we just had to map to copy data over
 
     return task;
 }
@@ -18,14 +18,15 @@ extern volatile timer_tick_t task_yield_tick;
 
 /* COMMON TASK DESCRIPTION FIELDS */
 #if UINTPTR_MAX == UINT64_MAX
-#define TASK_PID_BITS               60 // number of bits reserved for PID field in task_common_t
+#define TASK_PID_BITS               59 // number of bits reserved for PID field in task_common_t
 #else
-#define TASK_PID_BITS               28
+#define TASK_PID_BITS               27
 #endif
 
 typedef struct {
     size_t type : 3; // task type
     size_t ready : 1; // set when the task is ready to be switched to
+    size_t idle : 1; // set if the task should only run when no other tasks are ready
     size_t pid : TASK_PID_BITS; // task's process ID
     uintptr_t stack_bottom;
     size_t stack_size;
@@ -50,11 +51,21 @@ typedef struct {
 #define TASK_INITIAL_STACK_SIZE             4096
 #endif
 
+/* maximum size user task stacks can grow to (only the pages that are touched are allocated) */
+#ifndef TASK_USER_STACK_MAX
+#define TASK_USER_STACK_MAX                 (1024 * 1024)
+#endif
+
 /* task quantum (minimum number of ticks between yield calls) */
 #ifndef TASK_QUANTUM
 #define TASK_QUANTUM                        1000
 #endif
 
+/* maximum number of ticks an idle-priority task can be kept waiting while other tasks are ready */
+#ifndef TASK_IDLE_MAX_WAIT
+#define TASK_IDLE_MAX_WAIT                  (100 * TASK_QUANTUM)
+#endif
+
 /*
  * void task_switch(void* task, void* context)
  *  Performs a context switch to the specified task, given the current
@@ -125,6 +136,9 @@ void* task_create_stub(bool user);
  *  If stack_bottom is 0, new task's stack will be located at the end of
  *  the user address space (start of kernel address space); otherwise, 
  *  stack_bottom specifies the new task's stack bottom address.
+ *  User tasks only get the frame(s) holding their kernel stack up front;
+ *  the rest of their stack is mapped on first access, and can grow down
+ *  to TASK_USER_STACK_MAX.
  *  This is a common-defined function to be called in ring 0.
  */
 void* task_create(bool user, struct proc* proc, size_t stack_sz, uintptr_t entry, uintptr_t stack_bottom);
@@ -191,6 +205,14 @@ void task_set_ready(void* task, bool ready);
  */
 bool task_get_ready(void* task);
 
+/*
+ * void task_set_idle(void* task, bool idle)
+ *  Sets whether the specified task runs at idle priority, i.e. is only
+ *  switched to when no other tasks are ready, or when it has been
+ *  waiting for more than TASK_IDLE_MAX_WAIT ticks.
+ */
+void task_set_idle(void* task, bool idle);
+
 /*
  * void task_yield_noirq()
  *  Yields to the next task on demand (i.e. without IRQs).
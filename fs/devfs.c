@@ -39,7 +39,7 @@ const vfs_hook_t devfs_hook_root = {
 vfs_node_t* devfs_mount(vfs_node_t* root) {
     if(!root) {
         /* create new node */
-        root = kcalloc(1, sizeof(vfs_node_t));
+        root = vfs_alloc_node();
         if(!root) return NULL;
         ksprintf(root->name, "devfs_%x", (uintptr_t) root);
     }
@@ -91,7 +91,7 @@ vfs_node_t* devfs_create(
         }
     }
 
-    vfs_node_t* node = kcalloc(1, sizeof(vfs_node_t));
+    vfs_node_t* node = vfs_alloc_node();
     if(!node) {
         kdebug("cannot create node");
         return NULL;
@@ -102,7 +102,7 @@ vfs_node_t* devfs_create(
         hook = kcalloc(1, sizeof(vfs_hook_t));
         if(!hook) {
             kdebug("cannot create hook struct");
-            kfree(node);
+            vfs_free_node(node);
             return NULL;
         }
 
@@ -141,7 +141,7 @@ void devfs_remove(vfs_node_t* root, vfs_node_t* node) {
 
     if(root->link.ptr != node) {
         root->link.ptr = node->link.ptr;
-        kfree(node->hook); kfree(node);
+        kfree(node->hook); vfs_free_node(node);
     } else kdebug("cannot find node");
 }
 
@@ -2,10 +2,12 @@
 #include <kernel/log.h>
 #include <stdlib.h>
 #include <string.h>
+#include <mm/slab.h>
 
-static struct ftab* ftab = NULL; // file table
+static struct ftab** ftab = NULL; // file table (entries are allocated from ftab_cache and never move)
 static size_t ftab_ents = 0; // number of allocated file table entries
 static mutex_t ftab_mutex = {0}; // mutex for file table allocation
+static kmem_cache_t* ftab_cache = NULL; // cache for file table entries
 
 #ifndef FTAB_ALLOCSZ
 #define FTAB_ALLOCSZ                4
@@ -14,71 +16,91 @@ static mutex_t ftab_mutex = {0}; // mutex for file table allocation
 struct ftab* ftab_open(vfs_node_t* node, struct proc* proc, bool read, bool write, bool excl) {
     size_t idx = 0;
     mutex_acquire(&ftab_mutex);
+    if(!ftab_cache) {
+        ftab_cache = kmem_cache_create("ftab", sizeof(struct ftab), 0, NULL);
+        if(!ftab_cache) {
+            kerror("cannot create file table entry cache");
+            mutex_release(&ftab_mutex);
+            return NULL;
+        }
+    }
     for(; idx < ftab_ents; idx++) {
-        if(!ftab[idx].node || ftab[idx].node == node) {
+        if(!ftab[idx] || !ftab[idx]->node || ftab[idx]->node == node) {
             break; // existing or empty entry
         }
     }
     if(idx == ftab_ents) {
         /* allocate more entries */
-        struct ftab* new_ftab = krealloc(ftab, (ftab_ents + FTAB_ALLOCSZ) * sizeof(struct ftab));
+        struct ftab** new_ftab = krealloc(ftab, (ftab_ents + FTAB_ALLOCSZ) * sizeof(struct ftab*));
         if(!new_ftab) {
             kerror("cannot allocate memory for file table");
             mutex_release(&ftab_mutex);
             return NULL;
         }
         ftab = new_ftab;
-        memset(&ftab[ftab_ents], 0, FTAB_ALLOCSZ * sizeof(struct ftab));
+        memset(&ftab[ftab_ents], 0, FTAB_ALLOCSZ * sizeof(struct ftab*));
         ftab_ents += FTAB_ALLOCSZ;
     }
+    if(!ftab[idx]) {
+        ftab[idx] = kmem_cache_alloc(ftab_cache);
+        if(!ftab[idx]) {
+            kerror("cannot allocate memory for file table entry");
+            mutex_release(&ftab_mutex);
+            return NULL;
+        }
+        memset(ftab[idx], 0, sizeof(struct ftab));
+    }
+    struct ftab* ent = ftab[idx];
     
-    mutex_acquire(&ftab[idx].mutex);
-    if(!ftab[idx].node) {
+    mutex_acquire(&ent->mutex);
+    if(!ent->node) {
         /* empty entry - file is opened for the first time */
         if(!vfs_open(node, read, write)) {
             kerror("opening VFS node 0x%x (%s) for r=%u,w=%u access failed", node, node->name, (read)?1:0, (write)?1:0);
+            mutex_release(&ent->mutex);
+            mutex_release(&ftab_mutex);
             return NULL;
         }
-        ftab[idx].node = node;
-        ftab[idx].read = (read) ? 1 : 0;
-        ftab[idx].write = (write) ? 1 : 0;
-        ftab[idx].refs = 1;
-        ftab[idx].excl = (excl) ? proc : NULL; // exclusive access
+        ent->node = node;
+        ent->read = (read) ? 1 : 0;
+        ent->write = (write) ? 1 : 0;
+        ent->refs = 1;
+        ent->excl = (excl) ? proc : NULL; // exclusive access
     } else {
         /* non-empty entry - file is already opened */
          // make sure that no one's working on it
 
-        if(ftab[idx].excl && ftab[idx].excl != proc) {
+        if(ent->excl && ent->excl != proc) {
             kerror("attempting to access VFS node 0x%x (%s) exclusively held by another process", node, node->name);
-            mutex_release(&ftab[idx].mutex);
+            mutex_release(&ent->mutex);
             mutex_release(&ftab_mutex);
             return NULL;
         }
-        if(excl && ftab[idx].refs) {
+        if(excl && ent->refs) {
             kerror("attempting to exclusively hold VFS node 0x%x (%s) which is already in use", node, node->name);
-            mutex_release(&ftab[idx].mutex);
+            mutex_release(&ent->mutex);
             mutex_release(&ftab_mutex);
             return NULL;
         }
 
-        read |= ftab[idx].read; write |= ftab[idx].write;
-        if(read != ftab[idx].read || write != ftab[idx].write) {
+        read |= ent->read; write |= ent->write;
+        if(read != ent->read || write != ent->write) {
             /* reopen file for our desired access mode */
             if(!vfs_open(node, read, write)) {
                 kerror("reopening VFS node 0x%x (%s) for r=%u,w=%u access failed", node, node->name, (read)?1:0, (write)?1:0);
-                mutex_release(&ftab[idx].mutex);
+                mutex_release(&ent->mutex);
                 mutex_release(&ftab_mutex);
                 return NULL;
             }
-            ftab[idx].read = read; ftab[idx].write = write;
+            ent->read = read; ent->write = write;
         }
 
-        ftab[idx].refs++; // increment process counter
+        ent->refs++; // increment process counter
     }
-    mutex_release(&ftab[idx].mutex);
+    mutex_release(&ent->mutex);
 
     mutex_release(&ftab_mutex);
-    return &ftab[idx];
+    return ent;
 }
 
 void ftab_close(struct ftab* ent, struct proc* proc) {
@@ -100,7 +122,7 @@ uint64_t ftab_read(struct ftab* ent, struct proc* proc, uint64_t offset, uint64_
     mutex_acquire(&ent->mutex);
     
     uint64_t ret = 0;
-    if((!ent->excl || ent->excl == proc) && ent->read) ret = vfs_read(ftab->node, offset, size, buf);
+    if((!ent->excl || ent->excl == proc) && ent->read) ret = vfs_read(ent->node, offset, size, buf);
 
     mutex_release(&ent->mutex);
     return ret;
@@ -110,7 +132,7 @@ uint64_t ftab_write(struct ftab* ent, struct proc* proc, uint64_t offset, uint64
     mutex_acquire(&ent->mutex);
     
     uint64_t ret = 0;
-    if((!ent->excl || ent->excl == proc) && ent->write) ret = vfs_write(ftab->node, offset, size, buf);
+    if((!ent->excl || ent->excl == proc) && ent->write) ret = vfs_write(ent->node, offset, size, buf);
 
     mutex_release(&ent->mutex);
     return ret;
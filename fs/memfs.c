@@ -53,7 +53,7 @@ const vfs_hook_t memfs_hook_rw = {
 vfs_node_t* memfs_mount(vfs_node_t* node, void* ptr, size_t size, bool rw) {
     if(!node) {
         /* create new node */
-        node = kcalloc(1, sizeof(vfs_node_t));
+        node = vfs_alloc_node();
         node->flags = VFS_FILE;
         ksprintf(node->name, "memfs_%x", (uintptr_t) ptr);
     }
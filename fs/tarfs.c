@@ -3,6 +3,7 @@
 #include <string.h>
 #include <kernel/log.h>
 #include <helpers/path.h>
+#include <mm/arena.h>
 
 #define TAR_INFO_MAGIC                  0x52415453 // 'RATS' on big-endian, 'STAR' on little-endian
 
@@ -90,14 +91,14 @@ const vfs_hook_t tar_hooks = {
 };
 
 #ifndef TAR_HIERARCHY_ITEM_INCREMENT
-#define TAR_HIERARCHY_ITEM_INCREMENT        4 // number of items in TAR hierarchy struct to be allocated at once
+#define TAR_HIERARCHY_ITEM_INCREMENT        4 // initial number of items in TAR hierarchy struct, doubled each time it runs out (must be a power of two)
 #endif
 
 vfs_node_t* tar_init(void* buffer, size_t size, vfs_node_t* root) {
     tar_info_t* root_info = NULL;
 
     if(!root) { // caller wants us to allocate our own root node
-        root = kmalloc(sizeof(vfs_node_t));
+        root = vfs_alloc_node();
         if(!root) {
             kerror("cannot allocate space for root node");
             goto fail;
@@ -133,7 +134,13 @@ vfs_node_t* tar_init(void* buffer, size_t size, vfs_node_t* root) {
 
     /* traverse the file, adding new items as we go */
     tar_header_t* header = buffer;
-    char *name = kmalloc(256); // full path
+    arena_t* arena = arena_create(0); // scratch memory for parsing
+    char *name = (arena) ? arena_alloc(arena, 256, 0) : NULL; // full path
+    if(!name) {
+        kerror("cannot allocate space for path buffer");
+        arena_destroy(arena);
+        goto fail;
+    }
     while((uintptr_t) header < (uintptr_t) buffer + size) {
         if(!header->name[0] && !header->size[0]) {
             /* probably empty sector - skip this one */
@@ -149,21 +156,24 @@ vfs_node_t* tar_init(void* buffer, size_t size, vfs_node_t* root) {
         strcpy(&name[strlen(name)], header->name); // append it with the rest of the path
         // name[strlen(name) + 1] = 0; // this will be needed later
         
-        vfs_node_t* node = kmalloc(sizeof(vfs_node_t)); // new node
+        vfs_node_t* node = vfs_alloc_node(); // new node
         if(!node) {
             kerror("cannot allocate space for node #%u", root_info->node_count + 1);
+            arena_destroy(arena);
             return root; // stop parsing
         }
 
         node->inode = root_info->node_count;
-        if(!(root_info->node_count % TAR_HIERARCHY_ITEM_INCREMENT)) {
-            /* allocate more space for hierarchy */
-            root_info->hierarchy = krealloc(root_info->hierarchy, (root_info->node_count + TAR_HIERARCHY_ITEM_INCREMENT) * sizeof(tar_hierarchy_t));
-            if(!root_info->hierarchy) {
+        if(root_info->node_count >= TAR_HIERARCHY_ITEM_INCREMENT && !(root_info->node_count & (root_info->node_count - 1))) {
+            /* allocate more space for hierarchy (the capacity is the smallest power of two that fits node_count) */
+            tar_hierarchy_t* hierarchy = krealloc(root_info->hierarchy, (root_info->node_count << 1) * sizeof(tar_hierarchy_t));
+            if(!hierarchy) {
                 kerror("cannot allocate more space for TAR hierarchy structure, stopping parsing");
-                kfree(node);
+                vfs_free_node(node);
+                arena_destroy(arena);
                 return root; // stop parsing
             }
+            root_info->hierarchy = hierarchy;
         }
         root_info->node_count++;
         root_info->hierarchy[node->inode].node = node;
@@ -225,7 +235,7 @@ vfs_node_t* tar_init(void* buffer, size_t size, vfs_node_t* root) {
         header = (tar_header_t*) ((uintptr_t) header + 512 + (((size_t) node->length + 511) / 512) * 512); // next header
     }
 
-    kfree(name);
+    arena_destroy(arena);
 
     return root; // all done
 
@@ -233,10 +243,10 @@ fail: // cleanup on failure
     if(root_info) {
         if(root_info->hierarchy) {
             for(size_t i = 1; i < root_info->node_count; i++)
-                kfree(root_info->hierarchy[i].node);
+                vfs_free_node(root_info->hierarchy[i].node);
         }
         kfree(root_info);
     }
-    if(root) kfree(root);
+    if(root) vfs_free_node(root);
     return NULL;
 }
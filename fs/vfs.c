@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <helpers/path.h>
+#include <mm/slab.h>
 
 const vfs_node_t* vfs_root = NULL;
 
@@ -121,3 +122,19 @@ struct dirent* vfs_alloc_dirent() {
     memset(ret, 0, sizeof(struct dirent));
     return ret;
 }
+
+static kmem_cache_t* vfs_node_cache = NULL;
+
+vfs_node_t* vfs_alloc_node() {
+    if(!vfs_node_cache) {
+        vfs_node_cache = kmem_cache_create("vfs_node", sizeof(vfs_node_t), 0, NULL); // created on first use, since filesystems may be mounted before any of our init code runs
+        if(!vfs_node_cache) return NULL;
+    }
+    vfs_node_t* node = kmem_cache_alloc(vfs_node_cache);
+    if(node) memset(node, 0, sizeof(vfs_node_t));
+    return node;
+}
+
+void vfs_free_node(vfs_node_t* node) {
+    kmem_cache_free(vfs_node_cache, node);
+}
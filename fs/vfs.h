@@ -155,4 +155,17 @@ void vfs_ioctl(vfs_node_t* node, size_t request, void* buf);
  */
 struct dirent* vfs_alloc_dirent();
 
+/*
+ * vfs_node_t* vfs_alloc_node()
+ *  Allocates a new zero-filled VFS node from the node cache.
+ *  Returns NULL on failure.
+ */
+vfs_node_t* vfs_alloc_node();
+
+/*
+ * void vfs_free_node(vfs_node_t* node)
+ *  Returns a VFS node allocated by vfs_alloc_node() to the node cache.
+ */
+void vfs_free_node(vfs_node_t* node);
+
 #endif
\ No newline at end of file
@@ -15,6 +15,8 @@
 
 #include <stdlib.h>
 #include <mm/kheap.h>
+#include <mm/slab.h>
+#include <mm/kheap_prof.h>
 #include <string.h>
 
 #include <fs/vfs.h>
@@ -51,6 +53,8 @@ void kinit() {
 #ifdef KINIT_MM_FIRST // initialize MM first
     pmm_init();
     vmm_init();
+    vmm_dmap_init();
+    pmm_late_init();
 #endif
     
     fbuf_font = &font8x16;
@@ -65,8 +69,16 @@ void kinit() {
     pmm_init();
     kinfo("initializing virtual memory management");
     vmm_init();
+    kinfo("setting up physical memory direct map");
+    vmm_dmap_init();
+    kinfo("initializing buddy frame allocator");
+    pmm_late_init();
 #endif
 
+    kinfo("registering kernel heap shrinkers");
+    pmm_shrinker_register("kmem", &kmem_shrink); // empty slabs first so that the heap can trim them
+    pmm_shrinker_register("kheap", &kheap_shrink);
+
     kinfo("invoking target-specific system pre-initialization routine");
     if(ktgt_preinit()) {
         kerror("ktgt_preinit() failed");
@@ -88,6 +100,9 @@ void kinit() {
         devfs_std_init(devfs_root);
 #ifndef NO_SERIAL
         ser_devfs_init(devfs_root);
+#endif
+#ifdef KHEAP_PROFILE
+        kheap_prof_devfs_init(devfs_root);
 #endif
     }
 
@@ -111,6 +126,31 @@ void kinit() {
     kinfo("creating kernel process and task");
     proc_init();
 
+    kinfo("starting frame zeroing task");
+    void* zero_task = task_create(false, proc_kernel, TASK_INITIAL_STACK_SIZE, (uintptr_t) &pmm_zero_task, 0);
+    if(!zero_task) kerror("cannot create frame zeroing task");
+    else task_set_idle(zero_task, true);
+
+#ifdef KHEAP_BENCH
+    kinfo("running kernel heap benchmark");
+    kheap_bench();
+#endif
+
+#ifdef VMM_COW_BENCH
+    kinfo("running COW fault benchmark");
+    vmm_cow_bench();
+#endif
+
+#ifdef VMM_FORK_BENCH
+    kinfo("running fork benchmark");
+    vmm_fork_bench();
+#endif
+
+#ifdef VMM_HUGE_BENCH
+    kinfo("running huge page benchmark");
+    vmm_huge_bench();
+#endif
+
     kinfo("initializing syscall");
     syscall_init();
 
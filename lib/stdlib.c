@@ -4,14 +4,22 @@
 #include <string.h>
 #include <mm/kheap.h>
 #include <mm/pmm.h>
+#include <mm/kheap_prof.h>
 
 void* kvalloc(size_t size) {
-    return kmemalign(pmm_framesz(), size);
+    void* ptr = kmemalign(pmm_framesz(), size);
+#ifdef KHEAP_PROFILE
+    kheap_prof_retag(ptr, __builtin_return_address(0)); // attribute the block to our caller instead
+#endif
+    return ptr;
 }
 
 void* kcalloc(size_t nitems, size_t size) {
     void* ptr = kmalloc(nitems * size);
-    if(ptr) memset(ptr, 0, nitems * size);
+    if(ptr) memset(ptr, 0, nitems * size); // dlmalloc recycles freed chunks, so zero-filled heap frames would not make this unnecessary
+#ifdef KHEAP_PROFILE
+    kheap_prof_retag(ptr, __builtin_return_address(0));
+#endif
     return ptr;
 }
 
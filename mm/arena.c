@@ -0,0 +1,106 @@
+#include <mm/arena.h>
+#include <kernel/log.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifndef ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE                            4096 // default size of each chunk in bytes
+#endif
+
+#ifndef ARENA_ALIGN
+#define ARENA_ALIGN                                 8 // default allocation alignment
+#endif
+
+/* chunk header - the chunk's memory follows right after this */
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size; // number of bytes in the chunk
+    size_t used; // number of bytes handed out (including alignment padding)
+} arena_chunk_t;
+
+struct arena {
+    arena_chunk_t* chunks; // list of chunks - allocations are made from the first one
+    size_t chunk_size;
+};
+
+#define arena_chunk_data(chunk)                     ((uintptr_t)(chunk) + sizeof(arena_chunk_t))
+
+arena_t* arena_create(size_t chunk_size) {
+    arena_t* arena = kmalloc(sizeof(arena_t));
+    if(!arena) {
+        kerror("cannot allocate memory for arena");
+        return NULL;
+    }
+    arena->chunks = NULL; // the first chunk is only allocated when needed
+    arena->chunk_size = (chunk_size) ? chunk_size : ARENA_CHUNK_SIZE;
+    return arena;
+}
+
+/* tries to allocate from a chunk, returning NULL if there's not enough space left */
+static void* arena_chunk_alloc(arena_chunk_t* chunk, size_t size, size_t align) {
+    uintptr_t start = arena_chunk_data(chunk) + chunk->used;
+    uintptr_t ptr = (start + align - 1) & ~(align - 1);
+    if(ptr + size > arena_chunk_data(chunk) + chunk->size) return NULL;
+    chunk->used = ptr + size - arena_chunk_data(chunk);
+    return (void*) ptr;
+}
+
+void* arena_alloc(arena_t* arena, size_t size, size_t align) {
+    if(!align) align = ARENA_ALIGN;
+    if(align & (align - 1)) {
+        kerror("alignment %u is not a power of two", align);
+        return NULL;
+    }
+
+    if(arena->chunks) {
+        void* ret = arena_chunk_alloc(arena->chunks, size, align);
+        if(ret) return ret;
+    }
+
+    /* allocate new chunk */
+    size_t chunk_size = size + align - 1; // worst case padding
+    bool oversized = (chunk_size > arena->chunk_size); // set if the allocation needs a chunk of its own
+    if(!oversized) chunk_size = arena->chunk_size;
+    arena_chunk_t* chunk = kmalloc(sizeof(arena_chunk_t) + chunk_size);
+    if(!chunk) {
+        kerror("cannot allocate %u-byte chunk for arena", chunk_size);
+        return NULL;
+    }
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    if(oversized && arena->chunks) {
+        /* insert after the current chunk so we can keep allocating from what's left of it */
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    } else {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    return arena_chunk_alloc(chunk, size, align);
+}
+
+void arena_reset(arena_t* arena) {
+    arena_chunk_t* keep = NULL; // chunk to be kept
+    arena_chunk_t* chunk = arena->chunks;
+    while(chunk) {
+        arena_chunk_t* next = chunk->next;
+        if(!keep && chunk->size == arena->chunk_size) {
+            keep = chunk;
+            keep->used = 0;
+            keep->next = NULL;
+        } else kfree(chunk);
+        chunk = next;
+    }
+    arena->chunks = keep;
+}
+
+void arena_destroy(arena_t* arena) {
+    if(!arena) return;
+    arena_chunk_t* chunk = arena->chunks;
+    while(chunk) {
+        arena_chunk_t* next = chunk->next;
+        kfree(chunk);
+        chunk = next;
+    }
+    kfree(arena);
+}
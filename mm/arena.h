@@ -0,0 +1,40 @@
+#ifndef MM_ARENA_H
+#define MM_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct arena arena_t;
+
+/*
+ * arena_t* arena_create(size_t chunk_size)
+ *  Creates a bump-pointer arena which takes memory from the kernel heap
+ *  in chunks of chunk_size bytes (or a default size if chunk_size is 0).
+ *  Allocations from an arena cannot be freed individually; instead, they
+ *  are all released at once by arena_reset() or arena_destroy().
+ *  Returns NULL on failure.
+ */
+arena_t* arena_create(size_t chunk_size);
+
+/*
+ * void* arena_alloc(arena_t* arena, size_t size, size_t align)
+ *  Allocates size bytes aligned to align bytes (which must be a power of
+ *  two, or 0 for the default alignment) from the arena.
+ *  Returns NULL on failure.
+ */
+void* arena_alloc(arena_t* arena, size_t size, size_t align);
+
+/*
+ * void arena_reset(arena_t* arena)
+ *  Releases all allocations made from the arena, keeping one chunk
+ *  around for further allocations.
+ */
+void arena_reset(arena_t* arena);
+
+/*
+ * void arena_destroy(arena_t* arena)
+ *  Releases all allocations made from the arena, and the arena itself.
+ */
+void arena_destroy(arena_t* arena);
+
+#endif
@@ -6,6 +6,10 @@
 #include <kernel/log.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <helpers/mutex.h>
+#include <exec/task.h>
+#include <mm/kheap_prof.h>
 
 #ifndef KHEAP_BASE_ADDRESS
 extern uintptr_t __kheap_start;
@@ -21,35 +25,207 @@ extern uintptr_t __kheap_end;
 #define KHEAP_BLOCK_MIN_SIZE                        4 // minimum size of a memory block (to prevent fragmentation)
 #endif
 
-static size_t kheap_size = 0;
+#ifndef KHEAP_FRAME_BATCH
+#define KHEAP_FRAME_BATCH                           16 // number of frames to allocate/free at once when expanding/trimming the heap
+#endif
+
+/*
+ * heap growth and trimming - these defaults have not been tuned against a real boot yet; the line logged after
+ * tar_init() (expansions and frames mapped) is what to compare when changing them
+ */
+#ifndef KHEAP_GROW_CHUNK
+#define KHEAP_GROW_CHUNK                            65536 // granularity of heap expansion in bytes (must be a multiple of the frame size)
+#endif
+
+#ifndef KHEAP_TRIM_THRESHOLD
+#define KHEAP_TRIM_THRESHOLD                        262144 // amount of mapped memory above the break in bytes that triggers trimming
+#endif
+
+#ifndef KHEAP_FAULT_RESERVE
+#define KHEAP_FAULT_RESERVE                         8 // number of frames set aside for populating demand-paged heap memory (KHEAP_DEMAND_PAGING only)
+#endif
+
+#ifndef KHEAP_CACHE_CPUS
+#define KHEAP_CACHE_CPUS                            1 // number of CPUs with their own size class caches
+#endif
+
+#ifndef KHEAP_CLASS_MIN
+#define KHEAP_CLASS_MIN                             16 // smallest size class (must be a power of two)
+#endif
+
+#ifndef KHEAP_CLASSES
+#define KHEAP_CLASSES                               6 // number of size classes (each one is twice as large as the previous one)
+#endif
+
+#ifndef KHEAP_CACHE_SIZE
+#define KHEAP_CACHE_SIZE                            32 // number of blocks each size class cache can hold
+#endif
+
+#ifndef KHEAP_CACHE_BATCH
+#define KHEAP_CACHE_BATCH                           (KHEAP_CACHE_SIZE / 2) // number of blocks moved between a cache and the central heap at once
+#endif
+
+#define kheap_class_size(cls)                       ((size_t)KHEAP_CLASS_MIN << (cls)) // block size of a size class
+#define KHEAP_CLASS_MAX                             kheap_class_size(KHEAP_CLASSES - 1) // largest size class
+
+static size_t kheap_size = 0; // current break, relative to the heap base
+static size_t kheap_mapped = 0; // number of bytes mapped (or with KHEAP_DEMAND_PAGING, reserved for mapping on first touch) from the heap base (always at or above kheap_size)
+static bool kheap_trim_all = false; // set to release all memory above the break, bypassing hysteresis
+static kheap_core_stats_t kheap_core_stats = {0};
+
+#ifdef KHEAP_DEMAND_PAGING
+
+/*
+ * With demand paging, growing the heap only moves kheap_mapped up, and pages
+ * below the break are populated by kheap_handle_fault() on first touch. The
+ * fault may be taken with task switching blocked or with the heap's mutex
+ * held, so frames come from a small reserve (refilled by kmorecore()) which
+ * is only touched with task switching blocked, and the PMM is only used as
+ * a last resort.
+ */
+
+static size_t kheap_reserve[KHEAP_FAULT_RESERVE];
+static size_t kheap_reserve_cnt = 0;
+
+/* tops up the frame reserve; must be called with kheap_mutex held */
+static void kheap_reserve_fill() {
+    size_t frames[KHEAP_FAULT_RESERVE];
+    task_yield_block();
+    size_t n = KHEAP_FAULT_RESERVE - kheap_reserve_cnt;
+    task_yield_unblock();
+    if(!n || pmm_alloc_many(n, frames)) return; // reserve is full, or we're out of memory (faults will go to the PMM)
+
+    task_yield_block();
+    while(n && kheap_reserve_cnt < KHEAP_FAULT_RESERVE) kheap_reserve[kheap_reserve_cnt++] = frames[--n];
+    task_yield_unblock();
+    if(n) pmm_free_many(n, frames); // reserve has been refilled behind our back
+}
+
+/* reserves address space until size bytes are available; must be called with kheap_mutex held */
+static bool kheap_grow(size_t size) {
+    kheap_core_stats.grows++;
+    kheap_mapped = size;
+    kheap_reserve_fill();
+    return true;
+}
+
+bool kheap_handle_fault(uintptr_t vaddr) {
+    if(vaddr < KHEAP_BASE_ADDRESS || vaddr >= KHEAP_BASE_ADDRESS + KHEAP_MAX_SIZE) return false; // not ours
+
+    size_t framesz = pmm_framesz();
+    vaddr -= vaddr % framesz;
+
+    /* take a frame from the reserve */
+    size_t frame = (size_t)-1;
+    task_yield_block();
+    if(kheap_reserve_cnt) frame = kheap_reserve[--kheap_reserve_cnt];
+    task_yield_unblock();
+    if(frame == (size_t)-1 && pmm_alloc_many(1, &frame)) {
+        kerror("cannot allocate frame for heap page 0x%x", vaddr);
+        return false;
+    }
+
+    bool handled = false, used = false;
+    task_yield_block();
+    if(vaddr < KHEAP_BASE_ADDRESS + kheap_size) { // anything above the break has no business being touched
+        handled = true;
+        if(vmm_get_pgsz(vmm_current, vaddr) == (size_t)-1) { // the page may have been populated while we were getting the frame
+            vmm_pgmap(vmm_current, frame * framesz, vaddr, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_GLOBAL | VMM_FLAGS_CACHE);
+            pmm_page_map(frame, PMM_PAGE_KERNEL, vmm_kernel, vaddr);
+            kheap_core_stats.frames++;
+            kheap_core_stats.faults++;
+            used = true;
+        }
+    }
+    if(!used && kheap_reserve_cnt < KHEAP_FAULT_RESERVE) {
+        kheap_reserve[kheap_reserve_cnt++] = frame;
+        used = true;
+    }
+    task_yield_unblock();
+    if(!used) pmm_free_many(1, &frame);
+
+    return handled;
+}
+
+#else
+
+/* maps memory at the end of the mapped area until size bytes are mapped; must be called with kheap_mutex held */
+static bool kheap_grow(size_t size) {
+    size_t framesz = pmm_framesz();
+    size_t frames[KHEAP_FRAME_BATCH];
+    kheap_core_stats.grows++;
+    vmm_txn_t txn; // the whole chunk is mapped in one transaction
+    if(!vmm_txn_begin(&txn, vmm_current)) return false;
+    while(kheap_mapped < size) {
+        uintptr_t vaddr = KHEAP_BASE_ADDRESS + kheap_mapped; // virtual address of end of mapped area
+        size_t n = (size - kheap_mapped + framesz - 1) / framesz;
+        if(n > KHEAP_FRAME_BATCH) n = KHEAP_FRAME_BATCH;
+        if(pmm_alloc_many(n, frames)) {
+            vmm_txn_commit(&txn);
+            return false; // out of memory
+        }
+        for(size_t i = 0; i < n; i++, vaddr += framesz) {
+            vmm_txn_pgmap(&txn, frames[i] * framesz, vaddr, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_GLOBAL | VMM_FLAGS_CACHE); // map new frame to heap memory space
+            pmm_page_map(frames[i], PMM_PAGE_KERNEL, vmm_kernel, vaddr);
+        }
+        kheap_mapped += n * framesz;
+        kheap_core_stats.frames += n;
+    }
+    vmm_txn_commit(&txn);
+    return true;
+}
+
+#endif
+
+/* unmaps memory at the end of the mapped area until no more than size bytes are mapped; must be called with kheap_mutex held */
+static void kheap_trim(size_t size) {
+    size_t framesz = pmm_framesz();
+    size_t frames[KHEAP_FRAME_BATCH], n = 0;
+    kheap_core_stats.trims++;
+    vmm_txn_t txn; // unmapped frames are only given back after the TLB has been flushed
+    if(!vmm_txn_begin(&txn, vmm_current)) return;
+    while(kheap_mapped > size) {
+        uintptr_t vaddr = KHEAP_BASE_ADDRESS + kheap_mapped - framesz; // virtual address of last page of heap
+        kheap_mapped -= framesz;
+        if(vmm_get_pgsz(vmm_current, vaddr) == (size_t)-1) {
+#ifndef KHEAP_DEMAND_PAGING
+            kerror("virtual address 0x%x is not mapped", vaddr);
+#endif
+            continue; // with demand paging, the page has simply never been touched
+        }
+        size_t frame = vmm_get_paddr(vmm_current, vaddr) / framesz;
+        vmm_txn_pgunmap(&txn, vaddr, 0); // unmap from VMM
+        frames[n++] = frame;
+        kheap_core_stats.frames--;
+        if(n == KHEAP_FRAME_BATCH) {
+            vmm_txn_flush(&txn);
+            pmm_free_many(n, frames); // free unmapped frames
+            n = 0;
+        }
+    }
+    vmm_txn_commit(&txn);
+    if(n) pmm_free_many(n, frames);
+}
+
 void* kmorecore(intptr_t incr) {
     if((intptr_t)kheap_size + incr < 0 || kheap_size + incr > KHEAP_MAX_SIZE) return (void*)UINTPTR_MAX; // cannot expand/trim further
 
     void* prev_brk = (void*)(KHEAP_BASE_ADDRESS + kheap_size);
+    size_t new_size = kheap_size + incr;
 
-    if(incr) {
-        size_t old_size = kheap_size; kheap_size += incr;
-        size_t framesz = pmm_framesz(); 
-        size_t old_frames = (old_size + framesz - 1) / framesz, new_frames = (kheap_size + framesz - 1) / framesz; // to get difference between old and new frames
-        if(old_frames < new_frames) { // expand
-            uintptr_t vaddr = KHEAP_BASE_ADDRESS + old_frames * framesz; // virtual address of end of heap
-            for(size_t i = 0; i < new_frames - old_frames; i++, vaddr += framesz) {
-                size_t frame = pmm_alloc_free(1);
-                if(frame == (size_t)-1) return (void*)UINTPTR_MAX; // out of memory
-                vmm_pgmap(vmm_current, frame * framesz, vaddr, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_GLOBAL | VMM_FLAGS_CACHE); // map new frame to heap memory space
-            }
-        } else { // trim
-            uintptr_t vaddr = KHEAP_BASE_ADDRESS + (old_frames - 1) * framesz; // virtual address of last page of heap
-            for(size_t i = 0; i < old_frames - new_frames; i++, vaddr -= framesz) {
-                uintptr_t paddr = vmm_get_paddr(vmm_current, vaddr);
-                if(!paddr) {
-                    kerror("virtual address 0x%x is not mapped", vaddr);
-                    continue;
-                }
-                vmm_pgunmap(vmm_current, vaddr, 0); // unmap from VMM
-                pmm_free(paddr / framesz); // free this frame
-            }
-        }
+    if(new_size > kheap_mapped) {
+        /* expand in chunks so that we don't come back here for every few pages */
+        size_t target = (new_size + KHEAP_GROW_CHUNK - 1) / KHEAP_GROW_CHUNK * KHEAP_GROW_CHUNK;
+        if(target > KHEAP_MAX_SIZE) target = KHEAP_MAX_SIZE;
+        if(!kheap_grow(target) && kheap_mapped < new_size) return (void*)UINTPTR_MAX; // out of memory (whatever has been mapped is kept for later)
+    }
+    kheap_size = new_size;
+
+    if(incr < 0) {
+        size_t framesz = pmm_framesz();
+        size_t keep = (kheap_size + framesz - 1) / framesz * framesz;
+        if(kheap_trim_all) kheap_trim(keep);
+        else if(kheap_mapped - keep > KHEAP_TRIM_THRESHOLD) kheap_trim(keep + KHEAP_GROW_CHUNK); // keep a chunk around in case the heap grows again soon
     }
 
     return prev_brk;
@@ -59,19 +235,319 @@ size_t kheap_get_size() {
     return kheap_size;
 }
 
+/*
+ * The central heap (dlmalloc) is protected by kheap_mutex. Small blocks are
+ * served from per-CPU size class caches which are only touched with task
+ * switching blocked, so the fast path never takes the mutex. kfree() never
+ * waits for the mutex either: if it's held (possibly by the task we
+ * preempted, or by ourselves further up the stack), blocks are pushed onto
+ * a lock-free deferred list which is drained by the next mutex holder.
+ */
+
+typedef struct {
+    size_t count[KHEAP_CLASSES];
+    void* blocks[KHEAP_CLASSES][KHEAP_CACHE_SIZE];
+} kheap_cache_t;
+
+static kheap_cache_t kheap_caches[KHEAP_CACHE_CPUS];
+static kheap_cache_stats_t kheap_cache_stats[KHEAP_CACHE_CPUS];
+
+static mutex_t kheap_mutex = {0}; // mutex for the central heap
+static void* _Atomic kheap_deferred = NULL; // blocks waiting to be freed into the central heap (linked through their first word)
+
+/* returns the current CPU's cache; must be called with task switching blocked */
+static kheap_cache_t* kheap_cache_current(kheap_cache_stats_t** stats) {
+    size_t cpu = pmm_cpu_id() % KHEAP_CACHE_CPUS;
+    if(stats) *stats = &kheap_cache_stats[cpu];
+    return &kheap_caches[cpu];
+}
+
+/* returns the size class to allocate the specified size from */
+static size_t kheap_class(size_t size) {
+    size_t cls = 0;
+    while(kheap_class_size(cls) < size) cls++;
+    return cls;
+}
+
+/* returns the size class an allocated block can be cached in, or (size_t)-1 if it must go back to the central heap */
+static size_t kheap_block_class(void* ptr) {
+    size_t usable = dlmalloc_usable_size(ptr);
+    if(usable < KHEAP_CLASS_MIN || usable >= KHEAP_CLASS_MAX + KHEAP_CLASS_MIN) return (size_t)-1;
+    size_t cls = KHEAP_CLASSES - 1;
+    while(kheap_class_size(cls) > usable) cls--;
+    if(usable - kheap_class_size(cls) >= KHEAP_CLASS_MIN) return (size_t)-1; // too much slack to be handed out as this class
+    return cls;
+}
+
+static bool kheap_trylock() {
+    return !atomic_flag_test_and_set_explicit(&kheap_mutex.locked, memory_order_acquire);
+}
+
+/* frees all deferred blocks; must be called with kheap_mutex held */
+static void kheap_drain_deferred() {
+    void* ptr = atomic_exchange(&kheap_deferred, NULL);
+    while(ptr) {
+        void* next = *(void**)ptr;
+        dlfree(ptr);
+        ptr = next;
+    }
+}
+
+static void kheap_unlock() {
+    kheap_drain_deferred();
+    mutex_release(&kheap_mutex);
+}
+
+/* gives blocks back to the central heap, or defers them if it's busy */
+static void kheap_central_free(void** blocks, size_t n) {
+    if(kheap_trylock()) {
+        for(size_t i = 0; i < n; i++) dlfree(blocks[i]);
+        kheap_unlock();
+        return;
+    }
+
+    for(size_t i = 0; i < n; i++) {
+        void* head = atomic_load(&kheap_deferred);
+        do {
+            *(void**)blocks[i] = head;
+        } while(!atomic_compare_exchange_weak(&kheap_deferred, &head, blocks[i]));
+    }
+    kheap_cache_stats_t* stats;
+    task_yield_block();
+    kheap_cache_current(&stats);
+    stats->deferred += n;
+    task_yield_unblock();
+}
+
+size_t kheap_shrink(size_t target) {
+    (void) target; // we can only give back whatever is free at the top of the heap
+    if(!kheap_trylock()) return 0; // the heap is in use (possibly by our caller)
+
+    /* empty the current CPU's cache so that its blocks can be coalesced */
+    void* blocks[KHEAP_CLASSES * KHEAP_CACHE_SIZE];
+    size_t n = 0;
+    task_yield_block();
+    kheap_cache_t* cache = kheap_cache_current(NULL);
+    for(size_t cls = 0; cls < KHEAP_CLASSES; cls++) {
+        memcpy(&blocks[n], cache->blocks[cls], cache->count[cls] * sizeof(void*));
+        n += cache->count[cls];
+        cache->count[cls] = 0;
+    }
+    task_yield_unblock();
+    for(size_t i = 0; i < n; i++) dlfree(blocks[i]);
+    kheap_drain_deferred();
+
+    size_t framesz = pmm_framesz();
+    size_t old_mapped = kheap_mapped;
+    kheap_trim_all = true;
+    dlmalloc_trim(0);
+    kheap_trim((kheap_size + framesz - 1) / framesz * framesz); // in case dlmalloc had nothing to trim but we still have slack
+    kheap_trim_all = false;
+    kheap_unlock();
+    return (old_mapped - kheap_mapped) / framesz;
+}
+
+void kheap_get_core_stats(kheap_core_stats_t* stats) {
+    mutex_acquire(&kheap_mutex);
+    memcpy(stats, &kheap_core_stats, sizeof(kheap_core_stats_t));
+    kheap_unlock();
+}
+
+void kheap_get_stats(size_t cpu, kheap_cache_stats_t* stats) {
+    if(cpu >= KHEAP_CACHE_CPUS) {
+        memset(stats, 0, sizeof(kheap_cache_stats_t));
+        return;
+    }
+    task_yield_block();
+    memcpy(stats, &kheap_cache_stats[cpu], sizeof(kheap_cache_stats_t));
+    task_yield_unblock();
+}
+
+static void* kheap_alloc(size_t size) {
+    if(size > KHEAP_CLASS_MAX) {
+        mutex_acquire(&kheap_mutex);
+        void* ret = dlmalloc(size);
+        kheap_unlock();
+        return ret;
+    }
+
+    size_t cls = kheap_class(size);
+    kheap_cache_stats_t* stats;
+    task_yield_block();
+    kheap_cache_t* cache = kheap_cache_current(&stats);
+    if(cache->count[cls]) {
+        void* ret = cache->blocks[cls][--cache->count[cls]];
+        stats->hits++;
+        task_yield_unblock();
+        return ret;
+    }
+    stats->misses++;
+    task_yield_unblock();
+
+    /* refill from the central heap */
+    void* batch[KHEAP_CACHE_BATCH];
+    size_t n = 0;
+    mutex_acquire(&kheap_mutex);
+    for(; n < KHEAP_CACHE_BATCH; n++) {
+        batch[n] = dlmalloc(kheap_class_size(cls));
+        if(!batch[n]) break;
+    }
+    kheap_unlock();
+    if(!n) return NULL;
+
+    task_yield_block();
+    cache = kheap_cache_current(NULL);
+    void* ret = batch[--n]; // keep one for ourselves
+    while(n && cache->count[cls] < KHEAP_CACHE_SIZE) cache->blocks[cls][cache->count[cls]++] = batch[--n];
+    task_yield_unblock();
+    if(n) kheap_central_free(batch, n); // cache has been refilled behind our back
+    return ret;
+}
+
+static void kheap_free(void* ptr) {
+    if(!ptr) return;
+
+    size_t cls = kheap_block_class(ptr);
+    if(cls == (size_t)-1) {
+        kheap_central_free(&ptr, 1);
+        return;
+    }
+
+    kheap_cache_stats_t* stats;
+    task_yield_block();
+    kheap_cache_t* cache = kheap_cache_current(&stats);
+    if(cache->count[cls] < KHEAP_CACHE_SIZE) {
+        cache->blocks[cls][cache->count[cls]++] = ptr;
+        task_yield_unblock();
+        return;
+    }
+
+    /* cache is full - drain the oldest blocks to the central heap */
+    void* batch[KHEAP_CACHE_BATCH];
+    memcpy(batch, cache->blocks[cls], sizeof(batch));
+    memmove(cache->blocks[cls], &cache->blocks[cls][KHEAP_CACHE_BATCH], (KHEAP_CACHE_SIZE - KHEAP_CACHE_BATCH) * sizeof(void*));
+    cache->count[cls] -= KHEAP_CACHE_BATCH;
+    cache->blocks[cls][cache->count[cls]++] = ptr;
+    stats->drains++;
+    task_yield_unblock();
+    kheap_central_free(batch, KHEAP_CACHE_BATCH);
+}
+
 void* kmalloc(size_t size) {
-    return dlmalloc(size);
+    void* ret = kheap_alloc(size);
+#ifdef KHEAP_PROFILE
+    kheap_prof_alloc(ret, size, __builtin_return_address(0));
+#endif
+    return ret;
+}
+
+void kfree(void* ptr) {
+#ifdef KHEAP_PROFILE
+    kheap_prof_free(ptr);
+#endif
+    kheap_free(ptr);
 }
 
 void* krealloc(void* ptr, size_t size) {
-    return dlrealloc(ptr, size);
+    if(!ptr) {
+        void* ret = kheap_alloc(size);
+#ifdef KHEAP_PROFILE
+        kheap_prof_alloc(ret, size, __builtin_return_address(0));
+#endif
+        return ret;
+    }
+    if(!size) {
+        kfree(ptr);
+        return NULL;
+    }
+
+#ifdef KHEAP_PROFILE
+    kheap_prof_free(ptr); // the block is re-sampled below (we lose the sample if we fail, but that's no big deal)
+#endif
+    void* ret = NULL;
+    size_t usable = dlmalloc_usable_size(ptr);
+    if(usable > KHEAP_CLASS_MAX && size > KHEAP_CLASS_MAX) {
+        /* large block staying large - let dlmalloc resize it in place if it can */
+        mutex_acquire(&kheap_mutex);
+        ret = dlrealloc(ptr, size);
+        kheap_unlock();
+    } else if(size <= usable && usable <= KHEAP_CLASS_MAX + KHEAP_CLASS_MIN) ret = ptr; // small block that still fits
+    else {
+        ret = kheap_alloc(size);
+        if(ret) {
+            memcpy(ret, ptr, (size < usable) ? size : usable);
+            kheap_free(ptr);
+        }
+    }
+#ifdef KHEAP_PROFILE
+    kheap_prof_alloc(ret, size, __builtin_return_address(0));
+#endif
+    return ret;
 }
 
 void* kmemalign(size_t alignment, size_t size) {
-    return dlmemalign(alignment, size);
+    mutex_acquire(&kheap_mutex);
+    void* ret = dlmemalign(alignment, size);
+    kheap_unlock();
+#ifdef KHEAP_PROFILE
+    kheap_prof_alloc(ret, size, __builtin_return_address(0));
+#endif
+    return ret;
 }
 
-void kfree(void* ptr) {
-    dlfree(ptr);
+#ifdef KHEAP_BENCH
+
+#include <exec/process.h>
+#include <hal/timer.h>
+
+#ifndef KHEAP_BENCH_TASKS
+#define KHEAP_BENCH_TASKS                           4 // number of tasks hammering the heap at once
+#endif
+
+#ifndef KHEAP_BENCH_ITERS
+#define KHEAP_BENCH_ITERS                           65536 // number of allocate/free rounds done by each task
+#endif
+
+#ifndef KHEAP_BENCH_SLOTS
+#define KHEAP_BENCH_SLOTS                           16 // number of blocks each task keeps allocated at once
+#endif
+
+static atomic_size_t kheap_bench_done = 0;
+
+static void kheap_bench_task() {
+    void* slots[KHEAP_BENCH_SLOTS] = {NULL};
+    size_t seed = (uintptr_t) task_current;
+    for(size_t i = 0; i < KHEAP_BENCH_ITERS; i++) {
+        seed = seed * 1103515245 + 12345;
+        size_t slot = (seed >> 16) % KHEAP_BENCH_SLOTS;
+        kfree(slots[slot]);
+        slots[slot] = kmalloc(8 + (seed >> 8) % (KHEAP_CLASS_MAX * 2)); // mostly cached sizes, with some going to the central heap
+    }
+    for(size_t i = 0; i < KHEAP_BENCH_SLOTS; i++) kfree(slots[i]);
+    atomic_fetch_add(&kheap_bench_done, 1);
+    task_delete((void*) task_current);
+    while(1) task_yield_noirq();
+}
+
+void kheap_bench() {
+    kheap_cache_stats_t before, after;
+    kheap_get_stats(0, &before);
+    atomic_store(&kheap_bench_done, 0);
+
+    timer_tick_t t_start = timer_tick;
+    size_t tasks = 0;
+    for(; tasks < KHEAP_BENCH_TASKS; tasks++) {
+        if(!task_create(false, proc_kernel, TASK_INITIAL_STACK_SIZE, (uintptr_t) &kheap_bench_task, 0)) {
+            kerror("cannot create benchmark task %u", tasks);
+            break;
+        }
+    }
+    while(atomic_load(&kheap_bench_done) < tasks) task_yield_noirq();
+    timer_tick_t t_elapsed = timer_tick - t_start;
+
+    kheap_get_stats(0, &after);
+    kinfo("kheap: %u task(s) x %u kmalloc/kfree rounds took %llu us", tasks, KHEAP_BENCH_ITERS, (uint64_t) t_elapsed);
+    kinfo("kheap: cache hits %u, misses %u, drains %u, deferred frees %u", after.hits - before.hits, after.misses - before.misses, after.drains - before.drains, after.deferred - before.deferred);
 }
 
+#endif
@@ -3,10 +3,15 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 /*
  * void* kmorecore(intptr_t incr)
  *  Implementation of the sbrk function for dlmalloc.
+ *  Memory is mapped in chunks ahead of the break, and is only unmapped
+ *  once enough of it is unused.
+ *  With KHEAP_DEMAND_PAGING, only address space is reserved, and frames
+ *  are mapped on first touch instead (see kheap_handle_fault()).
  */
 void* kmorecore(intptr_t incr);
 
@@ -19,4 +24,59 @@ void* kmorecore(intptr_t incr);
  */
 size_t kheap_get_size();
 
+/*
+ * size_t kheap_shrink(size_t target)
+ *  Shrinker callback (see pmm_shrinker_register()) that trims free
+ *  memory off the top of the kernel heap. Returns the number of frames
+ *  released. The calling CPU's size class caches are emptied first.
+ *  Nothing is done while the central heap is in use.
+ */
+size_t kheap_shrink(size_t target);
+
+typedef struct {
+    size_t grows; // number of times the mapped area was expanded
+    size_t trims; // number of times the mapped area was trimmed
+    size_t frames; // number of frames currently mapped
+    size_t faults; // number of pages populated on first touch (KHEAP_DEMAND_PAGING only)
+} kheap_core_stats_t;
+
+/*
+ * void kheap_get_core_stats(kheap_core_stats_t* stats)
+ *  Retrieves counters on how the heap's memory has been mapped.
+ */
+void kheap_get_core_stats(kheap_core_stats_t* stats);
+
+typedef struct {
+    size_t hits; // small allocations served from the CPU's size class caches
+    size_t misses; // small allocations that had to refill a cache from the central heap
+    size_t drains; // frees that overflowed a cache and returned blocks to the central heap
+    size_t deferred; // blocks whose freeing was deferred because the central heap was busy
+} kheap_cache_stats_t;
+
+/*
+ * void kheap_get_stats(size_t cpu, kheap_cache_stats_t* stats)
+ *  Retrieves the size class cache counters of the specified CPU.
+ */
+void kheap_get_stats(size_t cpu, kheap_cache_stats_t* stats);
+
+#ifdef KHEAP_DEMAND_PAGING
+/*
+ * bool kheap_handle_fault(uintptr_t vaddr)
+ *  Populates the heap page containing vaddr if it is below the break
+ *  but has not been touched yet. Returns false if vaddr is not part of
+ *  the heap (or is above the break), or if no frame can be allocated.
+ */
+bool kheap_handle_fault(uintptr_t vaddr);
+#endif
+
+#ifdef KHEAP_BENCH
+/*
+ * void kheap_bench()
+ *  Runs several kernel tasks allocating and freeing memory at the same
+ *  time, and logs the time taken along with the cache counters.
+ *  Must be called after the kernel process has been created.
+ */
+void kheap_bench();
+#endif
+
 #endif
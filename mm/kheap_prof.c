@@ -0,0 +1,218 @@
+#include <mm/kheap_prof.h>
+
+#ifdef KHEAP_PROFILE
+
+#include <fs/devfs.h>
+#include <exec/task.h>
+#include <exec/syms.h>
+#include <kernel/log.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifndef KHEAP_PROF_RATE
+#define KHEAP_PROF_RATE                             16 // default sampling rate (one in every N allocations is recorded)
+#endif
+
+#ifndef KHEAP_PROF_LIVE_MAX
+#define KHEAP_PROF_LIVE_MAX                         4096 // maximum number of sampled blocks being tracked at once (must be a power of two)
+#endif
+
+#ifndef KHEAP_PROF_SITES_MAX
+#define KHEAP_PROF_SITES_MAX                        256 // maximum number of call sites (must be a power of two)
+#endif
+
+#define KHEAP_PROF_LINE_MAX                         (SYM_NAME_MAXLEN + 80) // maximum length of a report line
+
+/* sampled block - everything here is only touched with task switching blocked */
+typedef struct {
+    void* ptr; // the block, or NULL if the entry is not in use
+    size_t size; // requested size
+    size_t weight; // number of allocations this sample stands for (i.e. the sampling rate when it was taken)
+    uint16_t site; // index of the call site
+} kheap_prof_live_t;
+
+static kheap_prof_live_t kheap_prof_live[KHEAP_PROF_LIVE_MAX];
+static kheap_prof_site_t kheap_prof_sites[KHEAP_PROF_SITES_MAX]; // open-addressed by site address (site = 0 means unused)
+static size_t kheap_prof_live_cnt = 0;
+static size_t kheap_prof_dropped = 0; // samples that had nowhere to go
+static size_t kheap_prof_rate = KHEAP_PROF_RATE;
+static size_t kheap_prof_countdown = KHEAP_PROF_RATE; // allocations left until the next sample
+
+#define kheap_prof_hash(x, max)                     ((((uintptr_t)(x) >> 3) * 2654435761U) & ((max) - 1))
+
+/* finds or creates a call site's entry, returning its index or -1 if the table is full */
+static size_t kheap_prof_site(uintptr_t site) {
+    size_t i = kheap_prof_hash(site, KHEAP_PROF_SITES_MAX);
+    for(size_t n = 0; n < KHEAP_PROF_SITES_MAX; n++, i = (i + 1) & (KHEAP_PROF_SITES_MAX - 1)) {
+        if(kheap_prof_sites[i].site == site) return i;
+        if(!kheap_prof_sites[i].site) {
+            kheap_prof_sites[i].site = site;
+            return i;
+        }
+    }
+    return (size_t)-1;
+}
+
+/* finds a sampled block's entry, returning its index or -1 if it was not sampled */
+static size_t kheap_prof_find(void* ptr) {
+    size_t i = kheap_prof_hash(ptr, KHEAP_PROF_LIVE_MAX);
+    while(kheap_prof_live[i].ptr) {
+        if(kheap_prof_live[i].ptr == ptr) return i;
+        i = (i + 1) & (KHEAP_PROF_LIVE_MAX - 1);
+    }
+    return (size_t)-1;
+}
+
+/* removes a sampled block's entry, moving the entries after it back so that lookups don't stop early */
+static void kheap_prof_remove(size_t i) {
+    kheap_prof_live[i].ptr = NULL;
+    kheap_prof_live_cnt--;
+    size_t j = i;
+    while(1) {
+        j = (j + 1) & (KHEAP_PROF_LIVE_MAX - 1);
+        if(!kheap_prof_live[j].ptr) break;
+        size_t home = kheap_prof_hash(kheap_prof_live[j].ptr, KHEAP_PROF_LIVE_MAX);
+        if(((j - home) & (KHEAP_PROF_LIVE_MAX - 1)) >= ((j - i) & (KHEAP_PROF_LIVE_MAX - 1))) {
+            /* entry j can be moved into the hole at i */
+            kheap_prof_live[i] = kheap_prof_live[j];
+            kheap_prof_live[j].ptr = NULL;
+            i = j;
+        }
+    }
+}
+
+void kheap_prof_alloc(void* ptr, size_t size, void* site) {
+    if(!ptr) return;
+    task_yield_block();
+    if(!kheap_prof_rate || --kheap_prof_countdown) {
+        task_yield_unblock();
+        return; // not sampling this one
+    }
+    kheap_prof_countdown = kheap_prof_rate;
+
+    size_t s = kheap_prof_site((uintptr_t) site);
+    if(s == (size_t)-1 || kheap_prof_live_cnt >= KHEAP_PROF_LIVE_MAX / 2) { // keep the table half empty so that probing stays short
+        kheap_prof_dropped++;
+        task_yield_unblock();
+        return;
+    }
+    kheap_prof_site_t* ent = &kheap_prof_sites[s];
+    ent->allocs += kheap_prof_rate; ent->bytes += size * kheap_prof_rate;
+    ent->live_count += kheap_prof_rate; ent->live_bytes += size * kheap_prof_rate;
+
+    size_t i = kheap_prof_hash(ptr, KHEAP_PROF_LIVE_MAX);
+    while(kheap_prof_live[i].ptr) i = (i + 1) & (KHEAP_PROF_LIVE_MAX - 1);
+    kheap_prof_live[i].ptr = ptr;
+    kheap_prof_live[i].size = size;
+    kheap_prof_live[i].weight = kheap_prof_rate;
+    kheap_prof_live[i].site = s;
+    kheap_prof_live_cnt++;
+    task_yield_unblock();
+}
+
+void kheap_prof_free(void* ptr) {
+    if(!ptr || !kheap_prof_live_cnt) return; // quick exit for the common case
+    task_yield_block();
+    size_t i = kheap_prof_find(ptr);
+    if(i != (size_t)-1) {
+        kheap_prof_site_t* ent = &kheap_prof_sites[kheap_prof_live[i].site];
+        ent->live_count -= kheap_prof_live[i].weight;
+        ent->live_bytes -= kheap_prof_live[i].size * kheap_prof_live[i].weight;
+        kheap_prof_remove(i);
+    }
+    task_yield_unblock();
+}
+
+void kheap_prof_retag(void* ptr, void* site) {
+    if(!ptr || !kheap_prof_live_cnt) return;
+    task_yield_block();
+    size_t i = kheap_prof_find(ptr);
+    if(i != (size_t)-1) {
+        size_t s = kheap_prof_site((uintptr_t) site);
+        if(s != (size_t)-1) {
+            /* move the sample over to the new site */
+            size_t size = kheap_prof_live[i].size, weight = kheap_prof_live[i].weight;
+            kheap_prof_site_t* old = &kheap_prof_sites[kheap_prof_live[i].site];
+            kheap_prof_site_t* new = &kheap_prof_sites[s];
+            old->allocs -= weight; old->bytes -= size * weight;
+            old->live_count -= weight; old->live_bytes -= size * weight;
+            new->allocs += weight; new->bytes += size * weight;
+            new->live_count += weight; new->live_bytes += size * weight;
+            kheap_prof_live[i].site = s;
+        }
+    }
+    task_yield_unblock();
+}
+
+void kheap_prof_set_rate(size_t rate) {
+    task_yield_block();
+    kheap_prof_rate = rate;
+    kheap_prof_countdown = rate;
+    task_yield_unblock();
+}
+
+size_t kheap_prof_get_sites(kheap_prof_site_t* sites, size_t max) {
+    size_t n = 0;
+    task_yield_block();
+    for(size_t i = 0; i < KHEAP_PROF_SITES_MAX; i++) {
+        kheap_prof_site_t* ent = &kheap_prof_sites[i];
+        if(!ent->site || !ent->allocs) continue;
+
+        /* insertion sort by live bytes (there aren't many sites) */
+        size_t j = (n < max) ? n++ : max;
+        while(j > 0 && sites[j - 1].live_bytes < ent->live_bytes) {
+            if(j < max) sites[j] = sites[j - 1];
+            j--;
+        }
+        if(j < max) sites[j] = *ent;
+    }
+    task_yield_unblock();
+    return n;
+}
+
+static uint64_t kheap_prof_read(vfs_node_t* node, uint64_t offset, uint64_t size, uint8_t* buffer) {
+    (void) node;
+
+    kheap_prof_site_t* sites = kmalloc(KHEAP_PROF_SITES_MAX * sizeof(kheap_prof_site_t));
+    if(!sites) {
+        kerror("cannot allocate memory for call site list");
+        return 0;
+    }
+    size_t n = kheap_prof_get_sites(sites, KHEAP_PROF_SITES_MAX);
+
+    char* report = kmalloc((n + 2) * KHEAP_PROF_LINE_MAX);
+    if(!report) {
+        kerror("cannot allocate memory for report");
+        kfree(sites);
+        return 0;
+    }
+    size_t len = ksprintf(report, "sampling 1 in %u allocations, %u sample(s) live, %u dropped\n", kheap_prof_rate, kheap_prof_live_cnt, kheap_prof_dropped);
+    len += ksprintf(&report[len], "%10s %8s %10s %8s  site\n", "live_bytes", "live", "bytes", "allocs");
+    for(size_t i = 0; i < n; i++) {
+        len += ksprintf(&report[len], "%10u %8u %10u %8u  0x%08x", sites[i].live_bytes, sites[i].live_count, sites[i].bytes, sites[i].allocs, sites[i].site);
+        struct sym_addr* sym = (kernel_syms) ? sym_addr2sym(kernel_syms, sites[i].site) : NULL;
+        if(sym) {
+            len += ksprintf(&report[len], " %s+0x%x", sym->sym->name, sym->delta);
+            kfree(sym);
+        }
+        report[len++] = '\n';
+    }
+    kfree(sites);
+
+    uint64_t ret = 0;
+    if(offset < len) {
+        ret = len - offset;
+        if(ret > size) ret = size;
+        memcpy(buffer, &report[offset], ret);
+    }
+    kfree(report);
+    return ret;
+}
+
+void kheap_prof_devfs_init(vfs_node_t* root) {
+    if(!devfs_create(root, kheap_prof_read, NULL, NULL, NULL, NULL, false, 0, "kheapprof")) kerror("cannot create kheapprof device");
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef MM_KHEAP_PROF_H
+#define MM_KHEAP_PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <fs/vfs.h>
+
+#ifdef KHEAP_PROFILE
+
+typedef struct {
+    uintptr_t site; // return address of the allocation call
+    size_t allocs; // estimated number of allocations made from the site
+    size_t bytes; // estimated number of bytes allocated from the site
+    size_t live_count; // estimated number of allocations from the site that have not been freed
+    size_t live_bytes; // estimated number of bytes allocated from the site that have not been freed
+} kheap_prof_site_t;
+
+/*
+ * void kheap_prof_alloc(void* ptr, size_t size, void* site)
+ *  Called by the kernel heap after each successful allocation. Every
+ *  Nth allocation (see kheap_prof_set_rate()) is recorded against the
+ *  call site until it is freed.
+ */
+void kheap_prof_alloc(void* ptr, size_t size, void* site);
+
+/*
+ * void kheap_prof_free(void* ptr)
+ *  Called by the kernel heap before a block is freed (or moved by
+ *  krealloc). Does nothing if the block was not sampled.
+ */
+void kheap_prof_free(void* ptr);
+
+/*
+ * void kheap_prof_retag(void* ptr, void* site)
+ *  Changes the call site of a sampled block. Used by allocation
+ *  wrappers (kcalloc etc.) to attribute blocks to their own caller.
+ */
+void kheap_prof_retag(void* ptr, void* site);
+
+/*
+ * void kheap_prof_set_rate(size_t rate)
+ *  Sets the sampling rate, i.e. one in every rate allocations is
+ *  recorded. A rate of 0 stops sampling new allocations.
+ */
+void kheap_prof_set_rate(size_t rate);
+
+/*
+ * size_t kheap_prof_get_sites(kheap_prof_site_t* sites, size_t max)
+ *  Copies up to max call site records into sites, sorted by the number
+ *  of live bytes in descending order. Returns the number of records
+ *  copied.
+ */
+size_t kheap_prof_get_sites(kheap_prof_site_t* sites, size_t max);
+
+/*
+ * void kheap_prof_devfs_init(vfs_node_t* root)
+ *  Creates the kheapprof device in the specified devfs root, which
+ *  reads out a symbolized report of the call sites.
+ */
+void kheap_prof_devfs_init(vfs_node_t* root);
+
+#endif
+
+#endif
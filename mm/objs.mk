@@ -1,6 +1,10 @@
 MM_OBJS=\
 mm/pmm.o \
 mm/vmm.o \
+mm/vmm_region.o \
 mm/addr.o \
+mm/arena.o \
 mm/kheap.o \
-mm/malloc.o
+mm/kheap_prof.o \
+mm/malloc.o \
+mm/slab.o
@@ -1,65 +1,1238 @@
 #include <mm/pmm.h>
 #include <mm/vmm.h>
+#include <mm/addr.h>
 #include <kernel/log.h>
 #include <helpers/mutex.h>
+#include <exec/task.h>
+#include <hal/intr.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 
 uintptr_t* pmm_bitmap = NULL;
 size_t pmm_frames = 0;
 
+#define PMM_BITMAP_BITS							(sizeof(uintptr_t) * 8) // number of frames covered by each bitmap word
+
 size_t pmm_framesz() {
 	return vmm_pgsz(0);
 }
 
+static mutex_t pmm_alloc_mutex = {0};
+
+/* buddy allocator */
+
+#ifndef PMM_BUDDY_MAX_ORDER
+#define PMM_BUDDY_MAX_ORDER						10 // maximum order of a buddy block (2^10 frames, or 4M with 4K frames)
+#endif
+
+#define PMM_BUDDY_NIL							((uint32_t)-1) // end of free list
+
+#ifndef PMM_DMA_LIMIT
+#define PMM_DMA_LIMIT							0x1000000 // physical address below which frames belong to the DMA zone (16M for ISA DMA)
+#endif
+
+#define PMM_ZONE_DMA							0 // frames below PMM_DMA_LIMIT
+#define PMM_ZONE_NORMAL							1 // everything else
+#define PMM_NUM_ZONES							2
+
+typedef struct {
+	uint32_t next; // next free block of the same order
+	uint32_t prev; // previous free block of the same order
+	uint8_t order; // order of the block (only valid if free is set)
+	uint8_t free; // set if the frame is the first frame of a free block
+} pmm_buddy_node_t;
+
+static pmm_buddy_node_t* pmm_buddy_nodes = NULL; // per-frame buddy information
+static uint32_t pmm_buddy_heads[PMM_NUM_ZONES][PMM_BUDDY_MAX_ORDER + 1]; // free list heads for each zone and order
+static size_t pmm_buddy_free_frames = 0; // number of frames in the free lists
+static size_t pmm_zone_free_frames[PMM_NUM_ZONES]; // number of frames in each zone's free lists
+static size_t pmm_dma_frames = 0; // number of frames in the DMA zone (set up by pmm_late_init())
+
+#define pmm_zone(frame)							(((frame) < pmm_dma_frames) ? PMM_ZONE_DMA : PMM_ZONE_NORMAL)
+static bool pmm_buddy_ready = false; // set once the buddy allocator is in charge of allocations
+
+static void pmm_buddy_push(size_t frame, size_t order) {
+	pmm_buddy_node_t* node = &pmm_buddy_nodes[frame];
+	node->order = order; node->free = 1;
+	uint32_t* head = &pmm_buddy_heads[pmm_zone(frame)][order];
+	node->prev = PMM_BUDDY_NIL; node->next = *head;
+	if(node->next != PMM_BUDDY_NIL) pmm_buddy_nodes[node->next].prev = frame;
+	*head = frame;
+	pmm_buddy_free_frames += (1 << order);
+	pmm_zone_free_frames[pmm_zone(frame)] += (1 << order);
+}
+
+static void pmm_buddy_remove(size_t frame) {
+	pmm_buddy_node_t* node = &pmm_buddy_nodes[frame];
+	if(node->prev != PMM_BUDDY_NIL) pmm_buddy_nodes[node->prev].next = node->next;
+	else pmm_buddy_heads[pmm_zone(frame)][node->order] = node->next;
+	if(node->next != PMM_BUDDY_NIL) pmm_buddy_nodes[node->next].prev = node->prev;
+	node->free = 0;
+	pmm_buddy_free_frames -= (1 << node->order);
+	pmm_zone_free_frames[pmm_zone(frame)] -= (1 << node->order);
+}
+
+/* frees a block, merging it with its buddies whenever possible */
+static void pmm_buddy_free_block(size_t frame, size_t order) {
+	while(order < PMM_BUDDY_MAX_ORDER) {
+		size_t buddy = frame ^ (1 << order);
+		if(buddy + (1 << order) > pmm_frames || !pmm_buddy_nodes[buddy].free || pmm_buddy_nodes[buddy].order != order) break; // buddy is not entirely free
+		pmm_buddy_remove(buddy);
+		frame &= ~(1 << order); // the merged block starts at the lower buddy
+		order++;
+	}
+	pmm_buddy_push(frame, order);
+}
+
+/* frees an arbitrary range of frames by splitting it into aligned blocks */
+static void pmm_buddy_free_range(size_t frame, size_t count) {
+	while(count) {
+		size_t order = 0;
+		while(order < PMM_BUDDY_MAX_ORDER && !(frame & (1 << order)) && (size_t)(2 << order) <= count) order++;
+		pmm_buddy_free_block(frame, order);
+		frame += (1 << order); count -= (1 << order);
+	}
+}
+
+/* takes a free block of the specified order from a zone, splitting larger blocks if needed */
+static size_t pmm_buddy_alloc_block_zone(size_t zone, size_t order) {
+	size_t i = order;
+	while(i <= PMM_BUDDY_MAX_ORDER && pmm_buddy_heads[zone][i] == PMM_BUDDY_NIL) i++;
+	if(i > PMM_BUDDY_MAX_ORDER) return (size_t)-1; // no block large enough
+	size_t frame = pmm_buddy_heads[zone][i];
+	pmm_buddy_remove(frame);
+	while(i > order) {
+		i--;
+		pmm_buddy_push(frame + (1 << i), i); // return the upper half
+	}
+	return frame;
+}
+
+/* takes a free block of the specified order, from the DMA zone only with PMM_DMA, or preferably from the normal zone otherwise */
+static size_t pmm_buddy_alloc_block(size_t order, size_t flags) {
+	size_t frame = (flags & PMM_DMA) ? (size_t)-1 : pmm_buddy_alloc_block_zone(PMM_ZONE_NORMAL, order);
+	if(frame == (size_t)-1) frame = pmm_buddy_alloc_block_zone(PMM_ZONE_DMA, order);
+	return frame;
+}
+
+/* removes a specific free frame from the free lists */
+static void pmm_buddy_take(size_t frame) {
+	size_t order = 0, head = frame;
+	for(; order <= PMM_BUDDY_MAX_ORDER; order++) {
+		head = frame & ~((1 << order) - 1);
+		if(pmm_buddy_nodes[head].free && pmm_buddy_nodes[head].order == order) break;
+	}
+	if(order > PMM_BUDDY_MAX_ORDER) return; // not in the free lists
+	pmm_buddy_remove(head);
+	while(order) {
+		order--;
+		size_t half = head + (1 << order);
+		if(frame < half) pmm_buddy_push(half, order); // frame is in the lower half
+		else {
+			pmm_buddy_push(head, order);
+			head = half;
+		}
+	}
+}
+
+static size_t pmm_scan(size_t start, size_t end, size_t sz);
+
+/* allocates sz contiguous frames, returning the first frame or -1 */
+static size_t pmm_buddy_alloc(size_t sz, size_t flags) {
+	size_t order = 0;
+	while((size_t)(1 << order) < sz) order++;
+	size_t frame = (order <= PMM_BUDDY_MAX_ORDER) ? pmm_buddy_alloc_block(order, flags) : (size_t)-1;
+	if(frame == (size_t)-1) {
+		/* too large for a single block, or no aligned block is available - find the run in the bitmap, then carve it out of the free lists */
+		if(!(flags & PMM_DMA)) frame = pmm_scan(pmm_dma_frames, pmm_frames, sz);
+		if(frame == (size_t)-1) {
+			frame = pmm_scan(0, pmm_dma_frames, sz);
+			if((flags & PMM_DMA) && frame != (size_t)-1 && frame + sz > pmm_dma_frames) frame = (size_t)-1; // run spills out of the DMA zone
+		}
+		if(frame == (size_t)-1) return (size_t)-1; // out of memory
+		for(size_t i = 0; i < sz; i++) pmm_buddy_take(frame + i);
+		return frame;
+	}
+	if((size_t)(1 << order) > sz) pmm_buddy_free_range(frame + sz, (1 << order) - sz); // give back the excess
+	return frame;
+}
+
+/* bitmap operations */
+
+#ifndef PMM_MAX_FRAMES
+#define PMM_MAX_FRAMES							1048576 // maximum number of frames to be managed (must not be less than the bootstrap code's limit)
+#endif
+
+#define pmm_ctz(x)								((size_t)__builtin_ctzl(x)) // count trailing zeros of a bitmap word (unsigned long is as wide as uintptr_t on our targets)
+
+/*
+ * second-level summary bitmap: each bit corresponds to a word in pmm_bitmap, and is cleared if the word
+ * is fully used. since the bootstrap code marks every frame as used, the all-zero initial state is correct.
+ */
+static uintptr_t pmm_summary[(PMM_MAX_FRAMES / PMM_BITMAP_BITS + PMM_BITMAP_BITS - 1) / PMM_BITMAP_BITS];
+
+static size_t pmm_hint = 0; // frame to resume scanning from (next-fit)
+
+static inline bool pmm_bitmap_test(size_t frame) {
+	return (pmm_bitmap[frame / PMM_BITMAP_BITS] & ((uintptr_t)1 << (frame % PMM_BITMAP_BITS)));
+}
+
+static inline void pmm_bitmap_set(size_t frame) {
+	size_t off = frame / PMM_BITMAP_BITS;
+	pmm_bitmap[off] |= (uintptr_t)1 << (frame % PMM_BITMAP_BITS);
+	if(pmm_bitmap[off] == (uintptr_t)-1) pmm_summary[off / PMM_BITMAP_BITS] &= ~((uintptr_t)1 << (off % PMM_BITMAP_BITS));
+}
+
+static inline void pmm_bitmap_clear(size_t frame) {
+	size_t off = frame / PMM_BITMAP_BITS;
+	pmm_bitmap[off] &= ~((uintptr_t)1 << (frame % PMM_BITMAP_BITS));
+	pmm_summary[off / PMM_BITMAP_BITS] |= (uintptr_t)1 << (off % PMM_BITMAP_BITS);
+}
+
+/* sets or clears bits [start, start + count) of a bitmap, filling whole words at once */
+static void pmm_bits_fill(uintptr_t* map, size_t start, size_t count, bool set) {
+	size_t end = start + count;
+	if(start % PMM_BITMAP_BITS) {
+		/* unaligned head */
+		size_t n = PMM_BITMAP_BITS - start % PMM_BITMAP_BITS;
+		if(n > count) n = count;
+		uintptr_t mask = (((uintptr_t)1 << n) - 1) << (start % PMM_BITMAP_BITS);
+		if(set) map[start / PMM_BITMAP_BITS] |= mask;
+		else map[start / PMM_BITMAP_BITS] &= ~mask;
+		start += n;
+	}
+	size_t words = (end - start) / PMM_BITMAP_BITS;
+	memset(&map[start / PMM_BITMAP_BITS], (set) ? 0xFF : 0x00, words * sizeof(uintptr_t));
+	start += words * PMM_BITMAP_BITS;
+	if(start < end) {
+		/* unaligned tail */
+		uintptr_t mask = ((uintptr_t)1 << (end - start)) - 1;
+		if(set) map[start / PMM_BITMAP_BITS] |= mask;
+		else map[start / PMM_BITMAP_BITS] &= ~mask;
+	}
+}
+
+/* marks frames [frame, frame + count) as used or free in both bitmap levels */
+static void pmm_bitmap_fill(size_t frame, size_t count, bool used) {
+	if(!count) return;
+	pmm_bits_fill(pmm_bitmap, frame, count, used);
+	size_t first = frame / PMM_BITMAP_BITS, last = (frame + count - 1) / PMM_BITMAP_BITS; // bitmap words touched
+	if(!used) pmm_bits_fill(pmm_summary, first, last - first + 1, true); // every word touched now has free frames
+	else {
+		/* words in between are now fully used, but the head and tail words may still have free frames */
+		if(last > first + 1) pmm_bits_fill(pmm_summary, first + 1, last - first - 1, false);
+		if(pmm_bitmap[first] == (uintptr_t)-1) pmm_summary[first / PMM_BITMAP_BITS] &= ~((uintptr_t)1 << (first % PMM_BITMAP_BITS));
+		if(pmm_bitmap[last] == (uintptr_t)-1) pmm_summary[last / PMM_BITMAP_BITS] &= ~((uintptr_t)1 << (last % PMM_BITMAP_BITS));
+	}
+}
+
+/* finds the first free frame in [frame, limit), or returns -1 */
+static size_t pmm_next_free(size_t frame, size_t limit) {
+	if(frame >= limit) return (size_t)-1;
+	size_t off = frame / PMM_BITMAP_BITS;
+	uintptr_t word = ~pmm_bitmap[off] & ((uintptr_t)-1 << (frame % PMM_BITMAP_BITS)); // free frames in the first word
+	if(!word) {
+		/* look for the next word with free frames using the summary bitmap */
+		off++;
+		while(1) {
+			if(off * PMM_BITMAP_BITS >= limit) return (size_t)-1;
+			uintptr_t sum = pmm_summary[off / PMM_BITMAP_BITS] & ((uintptr_t)-1 << (off % PMM_BITMAP_BITS));
+			if(sum) {
+				off = (off / PMM_BITMAP_BITS) * PMM_BITMAP_BITS + pmm_ctz(sum);
+				break;
+			}
+			off = (off / PMM_BITMAP_BITS + 1) * PMM_BITMAP_BITS; // skip to the next summary word
+		}
+		word = ~pmm_bitmap[off];
+	}
+	frame = off * PMM_BITMAP_BITS + pmm_ctz(word);
+	return (frame < limit) ? frame : (size_t)-1;
+}
+
+/* finds the first used frame in [frame, limit), or returns limit */
+static size_t pmm_next_used(size_t frame, size_t limit) {
+	size_t off = frame / PMM_BITMAP_BITS;
+	uintptr_t word = pmm_bitmap[off] & ((uintptr_t)-1 << (frame % PMM_BITMAP_BITS));
+	while(!word) {
+		off++;
+		if(off * PMM_BITMAP_BITS >= limit) return limit;
+		word = pmm_bitmap[off];
+	}
+	frame = off * PMM_BITMAP_BITS + pmm_ctz(word);
+	return (frame < limit) ? frame : limit;
+}
+
+/* finds the first run of sz free frames starting in [start, end) */
+static size_t pmm_scan(size_t start, size_t end, size_t sz) {
+	size_t frame = start;
+	while(1) {
+		frame = pmm_next_free(frame, end);
+		if(frame == (size_t)-1 || frame + sz > pmm_frames) return (size_t)-1;
+		size_t used = pmm_next_used(frame, frame + sz);
+		if(used == frame + sz) return frame;
+		frame = used + 1;
+	}
+}
+
+/* per-frame descriptors */
+
+static pmm_page_t* pmm_pages = NULL; // descriptors of all frames (set up by pmm_late_init())
+
+static inline void pmm_page_reset(size_t frame, size_t refcount, uint16_t flags) {
+	if(!pmm_pages) return;
+	pmm_page_t* page = &pmm_pages[frame];
+	atomic_store_explicit(&page->refcount, refcount, memory_order_relaxed);
+	page->flags = flags;
+	page->owner = NULL;
+	page->vaddr = 0;
+}
+
+pmm_page_t* pmm_page(size_t frame) {
+	return (pmm_pages && frame < pmm_frames) ? &pmm_pages[frame] : NULL;
+}
+
+void pmm_page_mark(size_t frame, size_t count, uint16_t flags, void* owner) {
+	if(!pmm_pages) return;
+	for(size_t i = 0; i < count && frame + i < pmm_frames; i++) {
+		pmm_pages[frame + i].flags |= flags;
+		pmm_pages[frame + i].owner = owner;
+	}
+}
+
+void pmm_page_map(size_t frame, uint16_t flags, void* owner, uintptr_t vaddr) {
+	pmm_page_t* page = pmm_page(frame);
+	if(!page) return;
+	page->flags |= flags | PMM_PAGE_MOVABLE;
+	page->owner = owner;
+	page->vaddr = vaddr;
+}
+
+size_t pmm_page_ref(size_t frame) {
+	pmm_page_t* page = pmm_page(frame);
+	if(!page) return 0;
+	return atomic_fetch_add_explicit(&page->refcount, 1, memory_order_relaxed) + 1;
+}
+
+size_t pmm_page_unref(size_t frame) {
+	pmm_page_t* page = pmm_page(frame);
+	if(page) {
+		unsigned short refcount = atomic_load_explicit(&page->refcount, memory_order_relaxed);
+		while(refcount > 1 && !atomic_compare_exchange_weak_explicit(&page->refcount, &refcount, refcount - 1, memory_order_acq_rel, memory_order_relaxed));
+		if(refcount > 1) {
+			if(refcount == 2) page->flags &= ~PMM_PAGE_COW; // no longer shared
+			return refcount - 1;
+		}
+	}
+	pmm_free(frame); // last reference is gone
+	return 0;
+}
+
+/* frames being evacuated by pmm_alloc_large() - these are kept (with a zero reference count) instead of being freed */
+static size_t pmm_isolate_start = 0, pmm_isolate_end = 0;
+#define pmm_isolated(frame)						((frame) >= pmm_isolate_start && (frame) < pmm_isolate_end)
+
+/* per-CPU frame magazines */
+
+#ifndef PMM_MAG_CPUS
+#define PMM_MAG_CPUS							1 // number of CPUs with their own frame magazine
+#endif
+
+#ifndef PMM_MAG_SIZE
+#define PMM_MAG_SIZE							32 // number of frames each magazine can hold
+#endif
+
+#ifndef PMM_MAG_BATCH
+#define PMM_MAG_BATCH							(PMM_MAG_SIZE / 2) // number of frames moved between a magazine and the global pool at once
+#endif
+
+typedef struct {
+	size_t count;
+	size_t frames[PMM_MAG_SIZE]; // cached frames (still marked as used in the bitmap, and with PMM_PAGE_CACHED set)
+} pmm_mag_t;
+
+static pmm_mag_t pmm_mags[PMM_MAG_CPUS];
+static pmm_mag_stats_t pmm_mag_stats[PMM_MAG_CPUS];
+static bool pmm_mag_ready = false; // set once single-frame allocations go through the magazines (which needs frame descriptors)
+#define pmm_cached(frame)						(pmm_mag_ready && (pmm_pages[frame].flags & PMM_PAGE_CACHED))
+
+__attribute__((weak)) size_t pmm_cpu_id() {
+	return 0;
+}
+
+/* returns the current CPU's magazine; must be called with task switching blocked */
+static pmm_mag_t* pmm_mag_current(pmm_mag_stats_t** stats) {
+	size_t cpu = pmm_cpu_id() % PMM_MAG_CPUS;
+	if(stats) *stats = &pmm_mag_stats[cpu];
+	return &pmm_mags[cpu];
+}
+
+/* hands frames back to the global pool; must be called with pmm_alloc_mutex held */
+static void pmm_mag_return(const size_t* frames, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		pmm_bitmap_clear(frames[i]); // the frame looks free before it stops looking cached, so that it cannot be freed again in between
+		pmm_pages[frames[i]].flags &= ~PMM_PAGE_CACHED;
+		pmm_buddy_free_block(frames[i], 0);
+	}
+}
+
+static void pmm_mag_release(const size_t* frames, size_t n) {
+	mutex_acquire(&pmm_alloc_mutex);
+	pmm_mag_return(frames, n);
+	mutex_release(&pmm_alloc_mutex);
+}
+
+/*
+ * The magazines are only touched with task switching blocked, and the global
+ * pool's mutex is never taken in that state: the mutex may be held by a task
+ * that we would then never switch back to.
+ */
+
+static size_t pmm_mag_alloc() {
+	pmm_mag_stats_t* stats;
+	task_yield_block();
+	pmm_mag_t* mag = pmm_mag_current(&stats);
+	if(mag->count) {
+		size_t frame = mag->frames[--mag->count];
+		pmm_pages[frame].flags &= ~PMM_PAGE_CACHED;
+		stats->hits++;
+		task_yield_unblock();
+		return frame;
+	}
+	stats->misses++;
+	task_yield_unblock();
+
+	/* refill from the global pool */
+	size_t batch[PMM_MAG_BATCH], n = 0;
+	mutex_acquire(&pmm_alloc_mutex);
+	for(; n < PMM_MAG_BATCH; n++) {
+		size_t frame = pmm_buddy_alloc_block(0, 0);
+		if(frame == (size_t)-1) break;
+		pmm_bitmap_set(frame);
+		batch[n] = frame;
+	}
+	mutex_release(&pmm_alloc_mutex);
+	if(!n) return (size_t)-1;
+
+	task_yield_block();
+	mag = pmm_mag_current(&stats);
+	stats->refills++;
+	size_t frame = batch[--n]; // keep one for ourselves
+	while(n && mag->count < PMM_MAG_SIZE) {
+		size_t cached = batch[--n];
+		pmm_pages[cached].flags |= PMM_PAGE_CACHED;
+		mag->frames[mag->count++] = cached;
+	}
+	task_yield_unblock();
+	if(n) pmm_mag_release(batch, n); // magazine has been refilled behind our back
+	return frame;
+}
+
+static void pmm_mag_free(size_t frame) {
+	pmm_mag_stats_t* stats;
+	task_yield_block();
+	if(!pmm_bitmap_test(frame) || pmm_cached(frame)) {
+		task_yield_unblock();
+		return; // already free
+	}
+	if(pmm_isolated(frame)) {
+		/* pmm_alloc_large() isolated the frame's block after pmm_free() looked - it will pick the frame up */
+		pmm_page_reset(frame, 0, 0);
+		task_yield_unblock();
+		return;
+	}
+	pmm_page_reset(frame, 0, PMM_PAGE_CACHED);
+	pmm_mag_t* mag = pmm_mag_current(&stats);
+	if(mag->count < PMM_MAG_SIZE) {
+		mag->frames[mag->count++] = frame;
+		task_yield_unblock();
+		return;
+	}
+
+	/* magazine is full - drain the oldest frames to the global pool */
+	size_t batch[PMM_MAG_BATCH];
+	memcpy(batch, mag->frames, sizeof(batch));
+	memmove(mag->frames, &mag->frames[PMM_MAG_BATCH], (PMM_MAG_SIZE - PMM_MAG_BATCH) * sizeof(size_t));
+	mag->count -= PMM_MAG_BATCH;
+	mag->frames[mag->count++] = frame;
+	stats->drains++;
+	task_yield_unblock();
+	pmm_mag_release(batch, PMM_MAG_BATCH);
+}
+
+/* takes a specific frame out of the current CPU's magazine, returning false if it's not there (other CPUs' magazines are off limits) */
+static bool pmm_mag_take(size_t frame) {
+	bool found = false;
+	task_yield_block();
+	if(pmm_cached(frame)) {
+		pmm_mag_t* mag = pmm_mag_current(NULL);
+		for(size_t i = 0; i < mag->count; i++) {
+			if(mag->frames[i] != frame) continue;
+			mag->frames[i] = mag->frames[--mag->count];
+			pmm_pages[frame].flags &= ~PMM_PAGE_CACHED;
+			found = true;
+			break;
+		}
+	}
+	task_yield_unblock();
+	return found;
+}
+
+/* empties the current CPU's magazine into batch, returning the number of frames taken; must be called with task switching blocked */
+static size_t pmm_mag_empty(size_t* batch) {
+	pmm_mag_t* mag = pmm_mag_current(NULL);
+	size_t n = mag->count;
+	memcpy(batch, mag->frames, n * sizeof(size_t));
+	mag->count = 0;
+	return n;
+}
+
+/* returns all frames in the current CPU's magazine to the global pool */
+static size_t pmm_mag_flush() {
+	size_t batch[PMM_MAG_SIZE];
+	task_yield_block();
+	size_t n = pmm_mag_empty(batch);
+	task_yield_unblock();
+	if(n) pmm_mag_release(batch, n);
+	return n;
+}
+
+void pmm_mag_get_stats(size_t cpu, pmm_mag_stats_t* stats) {
+	if(cpu >= PMM_MAG_CPUS) {
+		memset(stats, 0, sizeof(pmm_mag_stats_t));
+		return;
+	}
+	task_yield_block();
+	memcpy(stats, &pmm_mag_stats[cpu], sizeof(pmm_mag_stats_t));
+	task_yield_unblock();
+}
+
+/* memory pressure handling */
+
+#ifndef PMM_WMARK_LOW
+#define PMM_WMARK_LOW							1024 // number of free frames below which caches are shrunk in the background
+#endif
+
+#ifndef PMM_WMARK_MIN
+#define PMM_WMARK_MIN							256 // number of free frames below which caches are shrunk before an allocation returns
+#endif
+
+#ifndef PMM_SHRINKERS_MAX
+#define PMM_SHRINKERS_MAX						8 // maximum number of registered shrinkers
+#endif
+
+typedef struct {
+	const char* name;
+	size_t (*shrink)(size_t target);
+	pmm_shrinker_stats_t stats;
+} pmm_shrinker_t;
+
+static pmm_shrinker_t pmm_shrinkers[PMM_SHRINKERS_MAX];
+static size_t pmm_shrinkers_cnt = 0;
+static mutex_t pmm_shrinkers_mutex = {0}; // for registration only - the list never shrinks, so it can be walked without locking
+
+static size_t pmm_wmark_low = PMM_WMARK_LOW, pmm_wmark_min = PMM_WMARK_MIN;
+static bool pmm_below_low = false, pmm_below_min = false; // set while the number of free frames is below the watermark
+static bool pmm_reclaim_wanted = false; // set when the background reclaimer (see pmm_zero_task()) should run
+static atomic_flag pmm_reclaiming = ATOMIC_FLAG_INIT; // set while shrinkers are running, so that their own allocations don't recurse
+static pmm_pressure_stats_t pmm_pressure_stats;
+
+int pmm_shrinker_register(const char* name, size_t (*shrink)(size_t target)) {
+	mutex_acquire(&pmm_shrinkers_mutex);
+	if(pmm_shrinkers_cnt == PMM_SHRINKERS_MAX) {
+		mutex_release(&pmm_shrinkers_mutex);
+		kerror("too many shrinkers, cannot register %s", name);
+		return -1;
+	}
+	pmm_shrinker_t* shrinker = &pmm_shrinkers[pmm_shrinkers_cnt];
+	shrinker->name = name;
+	shrinker->shrink = shrink;
+	memset(&shrinker->stats, 0, sizeof(pmm_shrinker_stats_t));
+	int id = pmm_shrinkers_cnt++;
+	mutex_release(&pmm_shrinkers_mutex);
+	kdebug("registered shrinker %s (ID %d)", name, id);
+	return id;
+}
+
+int pmm_shrinker_get_stats(size_t id, pmm_shrinker_stats_t* stats) {
+	if(id >= pmm_shrinkers_cnt) return -1;
+	memcpy(stats, &pmm_shrinkers[id].stats, sizeof(pmm_shrinker_stats_t));
+	return 0;
+}
+
+size_t pmm_reclaim(size_t target) {
+	if(atomic_flag_test_and_set(&pmm_reclaiming)) return 0; // already reclaiming further up the call chain (or on another task)
+	pmm_pressure_stats.reclaims++;
+	size_t freed = 0;
+	for(size_t i = 0; i < pmm_shrinkers_cnt && freed < target; i++) {
+		size_t n = pmm_shrinkers[i].shrink(target - freed);
+		pmm_shrinkers[i].stats.calls++;
+		pmm_shrinkers[i].stats.freed += n;
+		freed += n;
+	}
+	if(pmm_mag_ready) pmm_mag_flush(); // frames freed by the shrinkers may have ended up in our magazine
+	pmm_pressure_stats.reclaimed += freed;
+	atomic_flag_clear(&pmm_reclaiming);
+	return freed;
+}
+
+void pmm_set_watermarks(size_t low, size_t min) {
+	if(min > low) min = low;
+	pmm_wmark_low = low; pmm_wmark_min = min;
+}
+
+void pmm_pressure_get_stats(pmm_pressure_stats_t* stats) {
+	memcpy(stats, &pmm_pressure_stats, sizeof(pmm_pressure_stats_t));
+}
+
+/* checks the number of free frames against the watermarks after an allocation */
+static void pmm_check_watermarks() {
+	if(!pmm_buddy_ready) return;
+	size_t free = pmm_buddy_free_frames;
+
+	if(free < pmm_wmark_low) {
+		if(!pmm_below_low) pmm_pressure_stats.low_crossings++;
+		pmm_below_low = true;
+		pmm_reclaim_wanted = true; // have the background reclaimer bring us back up
+	} else pmm_below_low = false;
+
+	if(free < pmm_wmark_min) {
+		if(!pmm_below_min) pmm_pressure_stats.min_crossings++;
+		pmm_below_min = true;
+		pmm_reclaim(pmm_wmark_low - free); // memory is tight - don't wait for the background reclaimer
+	} else pmm_below_min = false;
+}
+
 int pmm_alloc(size_t frame) {
-	size_t off = frame / (sizeof(uintptr_t) * 8);
-	size_t bit = frame % (sizeof(uintptr_t) * 8);
-	if(pmm_bitmap[off] & (1 << bit)) return -1;
-	pmm_bitmap[off] |= 1 << bit;
+	if(pmm_mag_ready && pmm_mag_take(frame)) {
+		pmm_page_reset(frame, 1, 0);
+		return 0;
+	}
+
+	mutex_acquire(&pmm_alloc_mutex);
+	if(pmm_bitmap_test(frame)) {
+		mutex_release(&pmm_alloc_mutex);
+		return -1;
+	}
+	pmm_bitmap_set(frame);
+	if(pmm_buddy_ready) pmm_buddy_take(frame);
+	mutex_release(&pmm_alloc_mutex);
+	pmm_page_reset(frame, 1, 0);
 	return 0;
 }
 
 void pmm_free(size_t frame) {
-	size_t off = frame / (sizeof(uintptr_t) * 8);
-	size_t bit = frame % (sizeof(uintptr_t) * 8);
-	pmm_bitmap[off] &= ~(1 << bit);
+	if(pmm_mag_ready && pmm_zone(frame) == PMM_ZONE_NORMAL && !pmm_isolated(frame)) {
+		pmm_mag_free(frame);
+		return;
+	} // DMA frames go straight back to their zone
+
+	if(pmm_bitmap_test(frame) && !pmm_cached(frame)) pmm_page_reset(frame, 0, 0);
+	if(pmm_isolated(frame)) return; // pmm_alloc_large() will pick it up
+
+	mutex_acquire(&pmm_alloc_mutex);
+	if(pmm_bitmap_test(frame) && !pmm_cached(frame)) {
+		pmm_bitmap_clear(frame);
+		if(pmm_buddy_ready) pmm_buddy_free_block(frame, 0);
+	}
+	mutex_release(&pmm_alloc_mutex);
+}
+
+/* clamps a frame range to the managed frames, returning the new count */
+static size_t pmm_range_clamp(size_t frame, size_t count) {
+	if(frame >= pmm_frames) return 0;
+	return (count > pmm_frames - frame) ? (pmm_frames - frame) : count;
+}
+
+void pmm_mark_range_free(size_t frame, size_t count) {
+	count = pmm_range_clamp(frame, count);
+	if(pmm_buddy_ready) {
+		/* the buddy allocator needs to see each frame that actually changes state */
+		for(size_t i = 0; i < count; i++) pmm_free(frame + i);
+		return;
+	}
+	mutex_acquire(&pmm_alloc_mutex);
+	pmm_bitmap_fill(frame, count, false);
+	mutex_release(&pmm_alloc_mutex);
+}
+
+void pmm_mark_range_used(size_t frame, size_t count) {
+	count = pmm_range_clamp(frame, count);
+	if(pmm_buddy_ready) {
+		for(size_t i = 0; i < count; i++) pmm_alloc(frame + i);
+		return;
+	}
+	mutex_acquire(&pmm_alloc_mutex);
+	pmm_bitmap_fill(frame, count, true);
+	mutex_release(&pmm_alloc_mutex);
 }
 
 size_t pmm_first_free(size_t sz) {
-	size_t frame = 0;
-	while(frame < pmm_frames) {
-		size_t off = frame / (sizeof(uintptr_t) * 8);
-		if(pmm_bitmap[off] == (uintptr_t)-1) goto next;
-		size_t bit = frame % (sizeof(uintptr_t) * 8);
-		if(!(pmm_bitmap[off] & (1 << bit))) {
-			size_t fail = (size_t) -1;
-			for(size_t i = 0; i < sz; i++) {
-				size_t of2 = (frame + i) / (sizeof(uintptr_t) * 8);
-				if(pmm_bitmap[of2] == (uintptr_t)-1) goto fail;
-				size_t bi2 = (frame + i) % (sizeof(uintptr_t) * 8);
-				if(pmm_bitmap[of2] & (1 << bi2)) {
-fail:
-					fail = frame + i;
-					break;
-				}
+	size_t hint = pmm_hint;
+	if(hint >= pmm_frames) hint = 0;
+	size_t frame = pmm_scan(hint, pmm_frames, sz);
+	if(frame == (size_t)-1 && hint) frame = pmm_scan(0, hint, sz); // wrap around
+	if(frame == (size_t)-1) {
+		kerror("out of memory");
+		return (size_t) -1; // out of memory
+	}
+	pmm_hint = frame + sz;
+	return frame;
+}
+
+static size_t pmm_alloc_global(size_t sz, size_t flags) {
+	mutex_acquire(&pmm_alloc_mutex);
+	size_t frame = (pmm_buddy_ready) ? pmm_buddy_alloc(sz, flags) : pmm_first_free(sz);
+	if(frame != (size_t)-1) {
+		for(size_t i = 0; i < sz; i++) pmm_bitmap_set(frame + i);
+	}
+	mutex_release(&pmm_alloc_mutex);
+	return frame;
+}
+
+/* allocates sz contiguous frames from the zone(s) selected by flags */
+static size_t pmm_alloc_zone(size_t sz, size_t flags) {
+	size_t frame = (pmm_mag_ready && sz == 1 && !(flags & PMM_DMA)) ? pmm_mag_alloc() : pmm_alloc_global(sz, flags);
+	if(frame == (size_t)-1 && pmm_mag_ready) {
+		/* frames sitting in our magazine may be what's missing */
+		pmm_mag_flush();
+		frame = pmm_alloc_global(sz, flags);
+	}
+	if(frame == (size_t)-1 && pmm_reclaim(sz)) frame = pmm_alloc_global(sz, flags); // shrink caches and try again
+	if(frame == (size_t)-1) {
+		kerror("out of memory (requested %u frame(s))", sz);
+		return (size_t)-1;
+	}
+	for(size_t i = 0; i < sz; i++) pmm_page_reset(frame + i, 1, 0);
+	pmm_check_watermarks();
+	return frame;
+}
+
+size_t pmm_alloc_free(size_t sz) {
+	return pmm_alloc_zone(sz, 0);
+}
+
+/* attempts to allocate n non-contiguous frames from the zone(s) selected by flags */
+static int pmm_alloc_many_try(size_t n, size_t* frames, size_t flags) {
+	size_t got = 0;
+
+	if(pmm_mag_ready && !(flags & PMM_DMA)) {
+		/* use up whatever is in our magazine first */
+		task_yield_block();
+		pmm_mag_t* mag = pmm_mag_current(NULL);
+		while(got < n && mag->count) {
+			frames[got] = mag->frames[--mag->count];
+			pmm_pages[frames[got++]].flags &= ~PMM_PAGE_CACHED;
+		}
+		task_yield_unblock();
+	}
+
+	mutex_acquire(&pmm_alloc_mutex);
+	if(pmm_buddy_ready) {
+		/* take the largest blocks that still fit, then split them into frames */
+		size_t order = PMM_BUDDY_MAX_ORDER;
+		while(got < n) {
+			while(order && (size_t)(1 << order) > n - got) order--;
+			size_t frame = pmm_buddy_alloc_block(order, flags);
+			if(frame == (size_t)-1) {
+				if(!order) break; // out of frames
+				order--; continue; // no blocks of this order or above are left
 			}
-			if(fail != (size_t)-1) frame = fail + 1;
-			else return frame;
+			for(size_t i = 0; i < (size_t)(1 << order); i++) {
+				pmm_bitmap_set(frame + i);
+				frames[got++] = frame + i;
+			}
+		}
+	} else {
+		for(size_t frame = pmm_next_free(0, pmm_frames); got < n && frame != (size_t)-1; frame = pmm_next_free(frame + 1, pmm_frames)) {
+			pmm_bitmap_set(frame);
+			frames[got++] = frame;
 		}
-next:
-		frame++;
 	}
-	kerror("out of memory");
-	return (size_t) -1; // out of memory
+
+	if(got < n) {
+		/* roll back */
+		for(size_t i = 0; i < got; i++) {
+			pmm_bitmap_clear(frames[i]);
+			if(pmm_buddy_ready) pmm_buddy_free_block(frames[i], 0);
+		}
+		mutex_release(&pmm_alloc_mutex);
+		return -1;
+	}
+	mutex_release(&pmm_alloc_mutex);
+	for(size_t i = 0; i < n; i++) pmm_page_reset(frames[i], 1, 0);
+	return 0;
 }
 
-static mutex_t pmm_alloc_mutex = {0};
+/* allocates n non-contiguous frames from the zone(s) selected by flags */
+static int pmm_alloc_many_zone(size_t n, size_t* frames, size_t flags) {
+	if(pmm_alloc_many_try(n, frames, flags) && !(pmm_reclaim(n) && !pmm_alloc_many_try(n, frames, flags))) {
+		kerror("out of memory (requested %u frame(s))", n);
+		return -1;
+	}
+	pmm_check_watermarks();
+	return 0;
+}
 
-size_t pmm_alloc_free(size_t sz) {
+int pmm_alloc_many(size_t n, size_t* frames) {
+	return pmm_alloc_many_zone(n, frames, 0);
+}
+
+void pmm_free_many(size_t n, const size_t* frames) {
 	mutex_acquire(&pmm_alloc_mutex);
-	size_t frame = pmm_first_free(sz);
-	if(frame != (size_t)-1) {
-		for(size_t i = 0; i < sz; i++) pmm_alloc(frame + i);
+	for(size_t i = 0; i < n; i++) {
+		if(pmm_bitmap_test(frames[i]) && !pmm_cached(frames[i])) { // frames in a magazine are already free
+			pmm_page_reset(frames[i], 0, 0);
+			if(pmm_isolated(frames[i])) continue;
+			pmm_bitmap_clear(frames[i]);
+			if(pmm_buddy_ready) pmm_buddy_free_block(frames[i], 0);
+		}
 	}
 	mutex_release(&pmm_alloc_mutex);
+}
+
+/* large frame allocation and compaction */
+
+static mutex_t pmm_compact_mutex = {0}; // only one compaction can be in progress at a time
+
+size_t pmm_large_frames() {
+	return (1 << PMM_BUDDY_MAX_ORDER);
+}
+
+/* returns the VMM configuration through which a movable frame's mapping can be changed without mapping paging structures, or NULL */
+static void* pmm_compact_vmm(const pmm_page_t* page) {
+	if(page->vaddr >= kernel_start) return vmm_current; // kernel space is shared between all VMM configurations
+	return (page->owner == vmm_current) ? vmm_current : NULL;
+}
+
+/* checks if a used frame can be migrated */
+static bool pmm_compact_movable(size_t frame) {
+	pmm_page_t* page = &pmm_pages[frame];
+	return (atomic_load_explicit(&page->refcount, memory_order_relaxed) == 1 && (page->flags & (PMM_PAGE_MOVABLE | PMM_PAGE_PT | PMM_PAGE_COW)) == PMM_PAGE_MOVABLE && pmm_compact_vmm(page));
+}
+
+/* finds the normal zone block with the fewest used frames that can all be migrated; must be called with pmm_alloc_mutex held */
+static size_t pmm_compact_find() {
+	size_t blksz = pmm_large_frames(), best = (size_t)-1, best_used = blksz;
+	for(size_t block = pmm_dma_frames; block + blksz <= pmm_frames; block += blksz) {
+		size_t used = 0;
+		for(size_t frame = pmm_next_used(block, block + blksz); frame < block + blksz; frame = pmm_next_used(frame + 1, block + blksz)) {
+			if(!pmm_compact_movable(frame)) {
+				used = blksz; // cannot be evacuated
+				break;
+			}
+			used++;
+		}
+		if(used < best_used && used <= pmm_buddy_free_frames - (blksz - used)) {
+			best = block; best_used = used;
+		}
+	}
+	return best;
+}
+
+/* moves a movable frame somewhere outside the isolated block; returns false on failure */
+static bool pmm_compact_migrate(size_t frame) {
+	pmm_page_t* page = &pmm_pages[frame];
+	if(pmm_cached(frame)) return false; // sitting in another CPU's magazine, which may hand it out at any time
+	if(!atomic_load_explicit(&page->refcount, memory_order_relaxed)) return true; // freed since isolation - it's ours already
+	if(!pmm_compact_movable(frame)) return false;
+
+	size_t dst = pmm_alloc_free(1); // everything in the isolated block is either in use or claimed, so this will land elsewhere
+	if(dst == (size_t)-1) return false;
+
+	size_t framesz = pmm_framesz();
+	bool ret = false;
+	bool intr = intr_test();
+	intr_disable(); // nobody (interrupt handlers included) may write to the frame until it's remapped
+	void* vmm = pmm_compact_vmm(page);
+	if(vmm && (page->flags & PMM_PAGE_MOVABLE) && atomic_load_explicit(&page->refcount, memory_order_relaxed) == 1 && vmm_get_paddr(vmm, page->vaddr) == frame * framesz) {
+		void* copy_src = vmm_kmap(frame * framesz);
+		void* copy_dst = vmm_kmap(dst * framesz);
+		if(copy_src && copy_dst) {
+			memcpy(copy_dst, copy_src, framesz);
+			vmm_set_paddr(vmm, page->vaddr, dst * framesz);
+			pmm_pages[dst].flags = page->flags; pmm_pages[dst].owner = page->owner; pmm_pages[dst].vaddr = page->vaddr;
+			pmm_page_reset(frame, 0, 0); // claimed by us now
+			ret = true;
+		}
+		vmm_kunmap(copy_src); vmm_kunmap(copy_dst);
+	}
+	if(intr) intr_enable();
+
+	if(!ret) pmm_free(dst);
+	return ret;
+}
+
+size_t pmm_alloc_large() {
+	if(!pmm_buddy_ready) return (size_t)-1;
+	size_t blksz = pmm_large_frames();
+
+	mutex_acquire(&pmm_alloc_mutex);
+	size_t block = pmm_buddy_alloc_block_zone(PMM_ZONE_NORMAL, PMM_BUDDY_MAX_ORDER);
+	if(block != (size_t)-1) {
+		for(size_t i = 0; i < blksz; i++) pmm_bitmap_set(block + i);
+		mutex_release(&pmm_alloc_mutex);
+		for(size_t i = 0; i < blksz; i++) pmm_page_reset(block + i, 1, 0);
+		return block;
+	}
+	mutex_release(&pmm_alloc_mutex);
+	if(!pmm_pages) return (size_t)-1; // cannot tell which frames are movable
+
+	mutex_acquire(&pmm_compact_mutex);
+	pmm_mag_flush(); // cached frames look like used frames that cannot be moved
+
+	/* pick a block and claim its free frames */
+	mutex_acquire(&pmm_alloc_mutex);
+	block = pmm_compact_find();
+	if(block == (size_t)-1) {
+		mutex_release(&pmm_alloc_mutex);
+		mutex_release(&pmm_compact_mutex);
+		kdebug("no block can be compacted");
+		return (size_t)-1;
+	}
+	/*
+	 * isolate the block and empty the magazine without switching tasks in between, so that pmm_mag_free() either
+	 * sees the isolation or has cached the frame before we return the magazine's contents below
+	 */
+	size_t cached[PMM_MAG_SIZE];
+	task_yield_block();
+	pmm_isolate_start = block; pmm_isolate_end = block + blksz;
+	size_t n_cached = pmm_mag_empty(cached);
+	task_yield_unblock();
+	pmm_mag_return(cached, n_cached);
+	for(size_t frame = pmm_next_free(block, block + blksz); frame != (size_t)-1; frame = pmm_next_free(frame + 1, block + blksz)) {
+		pmm_bitmap_set(frame);
+		pmm_buddy_take(frame);
+		pmm_page_reset(frame, 0, 0);
+	}
+	mutex_release(&pmm_alloc_mutex);
+
+	/* move the remaining frames out */
+	size_t moved = 0;
+	bool ok = true;
+	for(size_t i = 0; i < blksz && ok; i++) {
+		bool used = atomic_load_explicit(&pmm_pages[block + i].refcount, memory_order_relaxed);
+		ok = pmm_compact_migrate(block + i);
+		if(ok && used) moved++;
+	}
+
+	mutex_acquire(&pmm_alloc_mutex);
+	pmm_isolate_start = pmm_isolate_end = 0;
+	if(!ok) {
+		/* give back whatever we have claimed */
+		for(size_t i = 0; i < blksz; i++) {
+			if(!atomic_load_explicit(&pmm_pages[block + i].refcount, memory_order_relaxed)) {
+				pmm_bitmap_clear(block + i);
+				pmm_buddy_free_block(block + i, 0);
+			}
+		}
+	}
+	mutex_release(&pmm_alloc_mutex);
+	mutex_release(&pmm_compact_mutex);
+
+	if(!ok) {
+		kerror("cannot evacuate block at frame %u", block);
+		return (size_t)-1;
+	}
+	for(size_t i = 0; i < blksz; i++) pmm_page_reset(block + i, 1, 0);
+	kdebug("compacted block at frame %u (%u frame(s) migrated)", block, moved);
+	return block;
+}
+
+/* pre-zeroed frame pool */
+
+#ifndef PMM_ZERO_POOL_SIZE
+#define PMM_ZERO_POOL_SIZE						64 // number of pre-zeroed frames to keep in the pool
+#endif
+
+#ifndef PMM_ZERO_MIN_FREE
+#define PMM_ZERO_MIN_FREE						256 // number of free frames below which the pool is not refilled
+#endif
+
+static size_t pmm_zero_pool[PMM_ZERO_POOL_SIZE];
+static size_t pmm_zero_depth = 0; // number of frames in the pool
+static mutex_t pmm_zero_mutex = {0};
+static pmm_zero_stats_t pmm_zero_stats;
+
+/* clears a frame through the direct map (or a kmap window), returning false if it cannot be mapped */
+static bool pmm_zero_frame(size_t frame, size_t* counter) {
+	size_t framesz = pmm_framesz();
+	void* ptr = vmm_kmap(frame * framesz);
+	if(!ptr) return false;
+	memset(ptr, 0, framesz);
+	vmm_kunmap(ptr);
+	mutex_acquire(&pmm_zero_mutex);
+	(*counter)++;
+	mutex_release(&pmm_zero_mutex);
+	return true;
+}
+
+/* takes up to n frames from the pool, returning the number of frames taken */
+static size_t pmm_zero_take(size_t* frames, size_t n) {
+	size_t got = 0;
+	mutex_acquire(&pmm_zero_mutex);
+	while(got < n && pmm_zero_depth) frames[got++] = pmm_zero_pool[--pmm_zero_depth];
+	pmm_zero_stats.hits += got;
+	mutex_release(&pmm_zero_mutex);
+	return got;
+}
+
+size_t pmm_alloc_free_flags(size_t sz, size_t flags) {
+	size_t frame;
+	if((flags & PMM_ZEROED) && !(flags & PMM_DMA) && sz == 1 && pmm_zero_take(&frame, 1)) {
+		pmm_page_reset(frame, 1, PMM_PAGE_ZEROED);
+		return frame;
+	}
+	frame = pmm_alloc_zone(sz, flags);
+	if(frame != (size_t)-1 && (flags & PMM_ZEROED)) {
+		for(size_t i = 0; i < sz; i++) {
+			if(!pmm_zero_frame(frame + i, &pmm_zero_stats.misses)) {
+				kerror("cannot map frame %u for zeroing", frame + i);
+				for(size_t j = 0; j < sz; j++) pmm_free(frame + j);
+				return (size_t)-1;
+			}
+			pmm_page_reset(frame + i, 1, PMM_PAGE_ZEROED);
+		}
+	}
 	return frame;
 }
+
+int pmm_alloc_many_flags(size_t n, size_t* frames, size_t flags) {
+	size_t got = ((flags & PMM_ZEROED) && !(flags & PMM_DMA)) ? pmm_zero_take(frames, n) : 0; // pool frames may come from either zone
+	if(pmm_alloc_many_zone(n - got, &frames[got], flags)) {
+		pmm_free_many(got, frames);
+		return -1;
+	}
+	if(flags & PMM_ZEROED) {
+		for(size_t i = got; i < n; i++) {
+			if(!pmm_zero_frame(frames[i], &pmm_zero_stats.misses)) {
+				kerror("cannot map frame %u for zeroing", frames[i]);
+				pmm_free_many(n, frames);
+				return -1;
+			}
+		}
+		for(size_t i = 0; i < n; i++) pmm_page_reset(frames[i], 1, PMM_PAGE_ZEROED);
+	}
+	return 0;
+}
+
+/* gives pre-zeroed frames back when memory is tight */
+static size_t pmm_zero_shrink(size_t target) {
+	(void) target;
+	size_t frames[PMM_ZERO_POOL_SIZE];
+	mutex_acquire(&pmm_zero_mutex);
+	size_t n = pmm_zero_depth;
+	memcpy(frames, pmm_zero_pool, n * sizeof(size_t));
+	pmm_zero_depth = 0;
+	mutex_release(&pmm_zero_mutex);
+	pmm_free_many(n, frames);
+	return n;
+}
+
+void pmm_zero_task() {
+	while(1) {
+		if(pmm_reclaim_wanted) {
+			/* we're also the background reclaimer */
+			pmm_reclaim_wanted = false;
+			size_t free = pmm_buddy_free_frames;
+			if(free < pmm_wmark_low) pmm_reclaim(pmm_wmark_low - free);
+		}
+
+		if(pmm_zero_depth >= PMM_ZERO_POOL_SIZE || pmm_below_low || (pmm_buddy_ready && pmm_buddy_free_frames < PMM_ZERO_MIN_FREE)) {
+			task_yield_noirq(); // pool is full, or memory is tight
+			continue;
+		}
+
+		size_t frame = pmm_alloc_free(1);
+		if(frame == (size_t)-1) {
+			task_yield_noirq();
+			continue;
+		}
+		if(!pmm_zero_frame(frame, &pmm_zero_stats.refills)) {
+			pmm_free(frame); // all kmap windows are taken - try again later
+			task_yield_noirq();
+			continue;
+		}
+
+		mutex_acquire(&pmm_zero_mutex);
+		if(pmm_zero_depth < PMM_ZERO_POOL_SIZE) {
+			pmm_zero_pool[pmm_zero_depth++] = frame;
+			frame = (size_t)-1;
+		}
+		mutex_release(&pmm_zero_mutex);
+		if(frame != (size_t)-1) pmm_free(frame); // pool got filled up behind our back
+	}
+}
+
+void pmm_zero_get_stats(pmm_zero_stats_t* stats) {
+	mutex_acquire(&pmm_zero_mutex);
+	memcpy(stats, &pmm_zero_stats, sizeof(pmm_zero_stats_t));
+	stats->depth = pmm_zero_depth;
+	mutex_release(&pmm_zero_mutex);
+}
+
+/* PMM late initialization */
+
+static void* pmm_alloc_meta(size_t sz) {
+	size_t framesz = pmm_framesz();
+	size_t frames = (sz + framesz - 1) / framesz;
+	size_t frame = pmm_alloc_free(frames);
+	if(frame == (size_t)-1) return NULL;
+	void* ret = (void*) vmm_alloc_map(vmm_kernel, frame * framesz, frames * framesz, kernel_end, UINTPTR_MAX, 0, 1, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_GLOBAL | VMM_FLAGS_CACHE);
+	if(!ret) {
+		for(size_t i = 0; i < frames; i++) pmm_free(frame + i);
+	}
+	return ret;
+}
+
+#ifdef DEBUG
+/* counts frames sitting in the magazines */
+static size_t pmm_mag_cached() {
+	size_t cached = 0;
+	for(size_t i = 0; i < PMM_MAG_CPUS; i++) cached += pmm_mags[i].count;
+	return cached;
+}
+
+/* compares the buddy allocator's state and results against the bitmap */
+static void pmm_buddy_selftest() {
+	pmm_mag_flush();
+	size_t bitmap_free = 0;
+	for(size_t i = 0; i < pmm_frames; i++) {
+		if(!pmm_bitmap_test(i)) bitmap_free++;
+	}
+
+	size_t list_free = 0;
+	for(size_t zone = 0; zone < PMM_NUM_ZONES; zone++) {
+		size_t zone_free = 0;
+		for(size_t order = 0; order <= PMM_BUDDY_MAX_ORDER; order++) {
+			for(uint32_t frame = pmm_buddy_heads[zone][order]; frame != PMM_BUDDY_NIL; frame = pmm_buddy_nodes[frame].next) {
+				if(frame & ((1 << order) - 1)) kerror("buddy block %u (order %u) is misaligned", frame, order);
+				if(pmm_zone(frame) != zone || pmm_zone(frame + (1 << order) - 1) != zone) kerror("buddy block %u (order %u) is not entirely in zone %u", frame, order, zone);
+				for(size_t i = 0; i < (size_t)(1 << order); i++) {
+					if(pmm_bitmap_test(frame + i)) kerror("frame %u is in buddy block %u (order %u) but is marked as used in the bitmap", frame + i, frame, order);
+				}
+				zone_free += (1 << order);
+			}
+		}
+		if(zone_free != pmm_zone_free_frames[zone]) kerror("zone %u free frame count mismatch: free lists %u, counter %u", zone, zone_free, pmm_zone_free_frames[zone]);
+		list_free += zone_free;
+	}
+	if(bitmap_free != list_free || list_free != pmm_buddy_free_frames) kerror("free frame count mismatch: bitmap %u, buddy free lists %u, buddy counter %u", bitmap_free, list_free, pmm_buddy_free_frames);
+
+	if(pmm_zone_free_frames[PMM_ZONE_DMA]) {
+		size_t frame = pmm_alloc_free_flags(1, PMM_DMA);
+		if(frame == (size_t)-1 || pmm_zone(frame) != PMM_ZONE_DMA) kerror("DMA allocation returned frame %u", frame);
+		else pmm_free(frame);
+	}
+
+	if(pmm_pages) {
+		size_t frame = pmm_alloc_free(1);
+		if(frame != (size_t)-1) {
+			if(pmm_page_ref(frame) != 2 || pmm_page_unref(frame) != 1 || !pmm_bitmap_test(frame)) kerror("frame %u reference counting is broken", frame);
+			if(pmm_page_unref(frame) || atomic_load(&pmm_pages[frame].refcount)) kerror("frame %u is not freed after dropping its last reference", frame);
+		}
+	}
+
+	static const size_t sizes[] = {1, 2, 3, 5, 8, 13, 64, 1024};
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size_t sz = sizes[i];
+		size_t ref = pmm_first_free(sz); // what the bitmap path would have done
+		size_t frame = pmm_alloc_free(sz);
+		if(frame == (size_t)-1) {
+			if(ref != (size_t)-1) kerror("buddy allocator cannot allocate %u frame(s), but the bitmap can (frame %u)", sz, ref);
+			continue;
+		}
+		for(size_t j = 0; j < sz; j++) {
+			if(!pmm_bitmap_test(frame + j)) kerror("frame %u of %u-frame allocation at %u is not marked as used", j, sz, frame);
+		}
+		if(pmm_buddy_free_frames + pmm_mag_cached() != list_free - sz) kerror("buddy counter is %u (+%u cached) after allocating %u frame(s), expected %u", pmm_buddy_free_frames, pmm_mag_cached(), sz, list_free - sz);
+		for(size_t j = 0; j < sz; j++) pmm_free(frame + j);
+		if(pmm_buddy_free_frames + pmm_mag_cached() != list_free) kerror("buddy counter is %u (+%u cached) after freeing %u frame(s), expected %u", pmm_buddy_free_frames, pmm_mag_cached(), sz, list_free);
+	}
+	kdebug("buddy allocator self-check done, %u free frame(s)", pmm_buddy_free_frames);
+}
+
+/* checks that frames sitting in a magazine are neither freed twice nor handed out as part of a large block */
+static void pmm_mag_selftest() {
+	size_t blksz = pmm_large_frames();
+	size_t block = pmm_alloc_large();
+	if(block == (size_t)-1) return;
+	for(size_t i = 0; i < blksz; i++) pmm_free(block + i); // the last ones stay in the magazine
+
+	size_t cached = pmm_mag_cached();
+	if(!cached || !pmm_cached(block + blksz - 1)) kerror("frame %u is not cached after being freed", block + blksz - 1);
+	pmm_free(block + blksz - 1);
+	if(pmm_mag_cached() != cached) kerror("frame %u is cached twice after being freed twice", block + blksz - 1);
+
+	size_t large = pmm_alloc_large();
+	if(large != (size_t)-1) {
+		for(size_t i = 0; i < blksz; i++) {
+			if(pmm_cached(large + i)) kerror("frame %u of large block %u is still cached", large + i, large);
+		}
+		for(size_t i = 0; i < PMM_MAG_CPUS; i++) {
+			for(size_t j = 0; j < pmm_mags[i].count; j++) {
+				if(pmm_mags[i].frames[j] >= large && pmm_mags[i].frames[j] < large + blksz) kerror("frame %u of large block %u is in magazine %u", pmm_mags[i].frames[j], large, i);
+			}
+		}
+		for(size_t i = 0; i < blksz; i++) pmm_free(large + i);
+	}
+	pmm_mag_flush();
+	kdebug("frame magazine self-check done, %u free frame(s)", pmm_buddy_free_frames);
+}
+#endif
+
+void pmm_late_init() {
+	/* set up zones - the boundary is aligned so that no buddy block straddles it */
+	pmm_dma_frames = (PMM_DMA_LIMIT / pmm_framesz()) & ~((1 << PMM_BUDDY_MAX_ORDER) - 1);
+	if(pmm_dma_frames > pmm_frames) pmm_dma_frames = pmm_frames;
+	pmm_hint = pmm_dma_frames; // keep our own structures out of the DMA zone if possible
+
+	pmm_buddy_nodes = pmm_alloc_meta(pmm_frames * sizeof(pmm_buddy_node_t));
+	if(!pmm_buddy_nodes) {
+		kerror("cannot allocate buddy allocator structures, falling back to bitmap allocation");
+		return;
+	}
+	kdebug("buddy allocator structures @ 0x%08x (%u bytes)", (uintptr_t) pmm_buddy_nodes, pmm_frames * sizeof(pmm_buddy_node_t));
+
+	/* set up frame descriptors - everything allocated so far belongs to the kernel */
+	pmm_page_t* pages = pmm_alloc_meta(pmm_frames * sizeof(pmm_page_t));
+	if(!pages) kerror("cannot allocate frame descriptors, reference counting will be unavailable");
+	else {
+		memset(pages, 0, pmm_frames * sizeof(pmm_page_t));
+		for(size_t i = 0; i < pmm_frames; i++) {
+			if(pmm_bitmap_test(i)) {
+				atomic_store_explicit(&pages[i].refcount, 1, memory_order_relaxed);
+				pages[i].flags = PMM_PAGE_KERNEL;
+			}
+		}
+		pmm_pages = pages;
+		kdebug("frame descriptors @ 0x%08x (%u bytes)", (uintptr_t) pmm_pages, pmm_frames * sizeof(pmm_page_t));
+	}
+
+	/* build free lists from bitmap */
+	for(size_t i = 0; i < PMM_NUM_ZONES; i++) {
+		for(size_t j = 0; j <= PMM_BUDDY_MAX_ORDER; j++) pmm_buddy_heads[i][j] = PMM_BUDDY_NIL;
+	}
+	for(size_t i = 0; i < pmm_frames; i++) pmm_buddy_nodes[i].free = 0;
+	mutex_acquire(&pmm_alloc_mutex);
+	for(size_t frame = pmm_next_free(0, pmm_frames); frame != (size_t)-1; ) {
+		size_t used = pmm_next_used(frame, pmm_frames);
+		pmm_buddy_free_range(frame, used - frame);
+		frame = pmm_next_free(used, pmm_frames);
+	}
+	pmm_buddy_ready = true;
+	mutex_release(&pmm_alloc_mutex);
+	kdebug("buddy allocator ready, %u free frame(s) (DMA zone: %u, normal zone: %u)", pmm_buddy_free_frames, pmm_zone_free_frames[PMM_ZONE_DMA], pmm_zone_free_frames[PMM_ZONE_NORMAL]);
+
+#ifdef DEBUG
+	pmm_buddy_selftest();
+#endif
+
+	pmm_mag_ready = (pmm_pages != NULL); // cached frames can only be told apart from used ones by their descriptors
+	if(pmm_mag_ready) kdebug("frame magazines enabled (%u CPU(s), %u frames each)", PMM_MAG_CPUS, PMM_MAG_SIZE);
+#ifdef DEBUG
+	if(pmm_mag_ready) pmm_mag_selftest();
+#endif
+
+	pmm_shrinker_register("pmm_zero", &pmm_zero_shrink); // our own cache is the cheapest to shrink, so it goes first
+}
@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 /*
  * uintptr_t* pmm_bitmap
@@ -27,6 +28,8 @@ size_t pmm_framesz();
 /*
  * int pmm_alloc(size_t frame)
  *  Marks the specified frame as in use, then returns 0 on success.
+ *  A free frame that sits in the calling CPU's magazine is taken out
+ *  of it.
  */
 int pmm_alloc(size_t frame);
 
@@ -36,10 +39,26 @@ int pmm_alloc(size_t frame);
  */
 void pmm_free(size_t frame);
 
+/*
+ * void pmm_mark_range_free(size_t frame, size_t count)
+ *  Marks count frame(s) starting from frame as free. Whole bitmap
+ *  words are filled at once, so this is much faster than calling
+ *  pmm_free() on each frame when setting up the bitmap.
+ */
+void pmm_mark_range_free(size_t frame, size_t count);
+
+/*
+ * void pmm_mark_range_used(size_t frame, size_t count)
+ *  Marks count frame(s) starting from frame as in use, filling whole
+ *  bitmap words at once.
+ */
+void pmm_mark_range_used(size_t frame, size_t count);
+
 /*
  * size_t pmm_first_free(size_t sz)
- *  Finds the first sz frame(s) of contiguous free frames and return it
- *  if available, otherwise returns -1.
+ *  Finds sz frame(s) of contiguous free frames in the bitmap and return
+ *  the first one if available, otherwise returns -1.
+ *  The scan resumes from the end of the last run found (next-fit).
  */
 size_t pmm_first_free(size_t sz);
 
@@ -50,12 +69,221 @@ size_t pmm_first_free(size_t sz);
  */
 void pmm_init();
 
+/*
+ * void pmm_late_init()
+ *  Sets up the buddy allocator on top of the bitmap filled by
+ *  pmm_init(). Until this is called, allocations are served by
+ *  scanning the bitmap.
+ *  This must be called after the VMM has been initialized.
+ */
+void pmm_late_init();
+
 /*
  * size_t pmm_alloc_free(size_t sz)
- *  Finds the first sz frame(s) of contiguous free frames, then allocate
- *  and return it if available. Returns -1 on failure.
+ *  Finds sz frame(s) of contiguous free frames, then allocate and
+ *  return it if available. Returns -1 on failure.
+ *  Single frames are taken from the calling CPU's magazine when
+ *  possible, without locking the global pool.
  *  This function is thread-safe.
  */
 size_t pmm_alloc_free(size_t sz);
 
+/*
+ * int pmm_alloc_many(size_t n, size_t* frames)
+ *  Allocates n frame(s) that do not need to be contiguous and stores
+ *  their numbers in frames. Returns 0 on success, or -1 (with nothing
+ *  allocated) if there are not enough free frames.
+ *  This function is thread-safe.
+ */
+int pmm_alloc_many(size_t n, size_t* frames);
+
+/*
+ * void pmm_free_many(size_t n, const size_t* frames)
+ *  Frees n frame(s) whose numbers are stored in frames.
+ *  This function is thread-safe.
+ */
+void pmm_free_many(size_t n, const size_t* frames);
+
+#define PMM_ZEROED                  (1 << 0) // frames must be filled with zeros
+#define PMM_DMA                     (1 << 1) // frames must come from the DMA zone (below PMM_DMA_LIMIT)
+
+/*
+ * size_t pmm_alloc_free_flags(size_t sz, size_t flags)
+ *  Same as pmm_alloc_free(), but with allocation flags (PMM_*).
+ *  With PMM_ZEROED, single frames are taken from the pre-zeroed
+ *  pool when possible; otherwise they are zeroed on the spot.
+ *  With PMM_DMA, frames are taken from the DMA zone only. Other
+ *  allocations prefer the normal zone, and only fall back to the
+ *  DMA zone when it runs out.
+ */
+size_t pmm_alloc_free_flags(size_t sz, size_t flags);
+
+/*
+ * int pmm_alloc_many_flags(size_t n, size_t* frames, size_t flags)
+ *  Same as pmm_alloc_many(), but with allocation flags (PMM_*).
+ */
+int pmm_alloc_many_flags(size_t n, size_t* frames, size_t flags);
+
+/*
+ * void pmm_zero_task()
+ *  Entry point of the kernel task that keeps the pre-zeroed frame
+ *  pool filled. This task is meant to run at idle priority.
+ */
+void pmm_zero_task();
+
+typedef struct {
+	size_t depth; // number of frames currently in the pool
+	size_t hits; // PMM_ZEROED frames taken from the pool
+	size_t misses; // PMM_ZEROED frames that had to be zeroed on the spot
+	size_t refills; // frames zeroed by the background task
+} pmm_zero_stats_t;
+
+/*
+ * void pmm_zero_get_stats(pmm_zero_stats_t* stats)
+ *  Retrieves the pre-zeroed frame pool's statistics.
+ */
+void pmm_zero_get_stats(pmm_zero_stats_t* stats);
+
+#define PMM_PAGE_KERNEL             (1 << 0) // frame is used by the kernel
+#define PMM_PAGE_USER               (1 << 1) // frame is mapped into user space
+#define PMM_PAGE_PT                 (1 << 2) // frame holds a paging structure
+#define PMM_PAGE_COW                (1 << 3) // frame is shared copy-on-write
+#define PMM_PAGE_ZEROED             (1 << 4) // frame was handed out zero-filled
+#define PMM_PAGE_MOVABLE            (1 << 5) // frame can be migrated elsewhere (its mapping is recorded in owner and vaddr)
+#define PMM_PAGE_CACHED             (1 << 6) // frame is free, but sits in a frame magazine (and is still marked as used in the bitmap)
+
+typedef struct {
+	atomic_ushort refcount; // number of references to the frame (0 if it's free)
+	uint16_t flags; // PMM_PAGE_* flags
+	void* owner; // owner hint (e.g. the VMM configuration the frame is mapped into)
+	uintptr_t vaddr; // virtual address the frame is mapped at in owner (only valid with PMM_PAGE_MOVABLE)
+} pmm_page_t;
+
+/*
+ * pmm_page_t* pmm_page(size_t frame)
+ *  Returns the descriptor of the specified frame, or NULL if frame
+ *  descriptors are not available (yet).
+ *  Frames are given a reference count of 1 when allocated.
+ */
+pmm_page_t* pmm_page(size_t frame);
+
+/*
+ * void pmm_page_mark(size_t frame, size_t count, uint16_t flags, void* owner)
+ *  Sets the specified PMM_PAGE_* flags and owner hint on count frame(s)
+ *  starting from frame.
+ */
+void pmm_page_mark(size_t frame, size_t count, uint16_t flags, void* owner);
+
+/*
+ * void pmm_page_map(size_t frame, uint16_t flags, void* owner, uintptr_t vaddr)
+ *  Same as pmm_page_mark() on a single frame, but also records that the
+ *  frame is mapped at vaddr in the VMM configuration owner, which allows
+ *  it to be migrated by pmm_alloc_large().
+ */
+void pmm_page_map(size_t frame, uint16_t flags, void* owner, uintptr_t vaddr);
+
+/*
+ * size_t pmm_page_ref(size_t frame)
+ *  Adds a reference to the specified frame, then returns the new
+ *  reference count.
+ */
+size_t pmm_page_ref(size_t frame);
+
+/*
+ * size_t pmm_page_unref(size_t frame)
+ *  Drops a reference to the specified frame and frees it once no
+ *  references remain. Returns the remaining reference count.
+ */
+size_t pmm_page_unref(size_t frame);
+
+/*
+ * size_t pmm_large_frames()
+ *  Returns the number of frames in a block allocated by
+ *  pmm_alloc_large() (1024 frames, or 4M, on x86).
+ */
+size_t pmm_large_frames();
+
+/*
+ * size_t pmm_alloc_large()
+ *  Allocates a naturally aligned block of pmm_large_frames() contiguous
+ *  frames, suitable for backing a huge page. If no such block is free,
+ *  movable frames (see pmm_page_map()) are migrated out of the most
+ *  suitable candidate block. Returns the first frame, or -1 on failure.
+ *  Only frames mapped in kernel space or in the current VMM
+ *  configuration can be migrated.
+ */
+size_t pmm_alloc_large();
+
+typedef struct {
+	size_t calls; // number of times the shrinker was invoked
+	size_t freed; // total number of frames it reported freeing
+} pmm_shrinker_stats_t;
+
+/*
+ * int pmm_shrinker_register(const char* name, size_t (*shrink)(size_t target))
+ *  Registers a callback that releases memory held in a cache when free
+ *  frames run low. The callback is asked to free target frame(s) and
+ *  returns the number of frames it actually freed. Shrinkers are
+ *  invoked in registration order. Returns the shrinker's ID, or -1 on
+ *  failure.
+ */
+int pmm_shrinker_register(const char* name, size_t (*shrink)(size_t target));
+
+/*
+ * int pmm_shrinker_get_stats(size_t id, pmm_shrinker_stats_t* stats)
+ *  Retrieves a shrinker's statistics. Returns 0 on success, or -1 if
+ *  the ID is invalid.
+ */
+int pmm_shrinker_get_stats(size_t id, pmm_shrinker_stats_t* stats);
+
+/*
+ * size_t pmm_reclaim(size_t target)
+ *  Runs the registered shrinkers until target frame(s) have been freed
+ *  or all shrinkers have been invoked, then returns the number of frames
+ *  freed. This is done automatically below the low watermark (in the
+ *  background), below the min watermark (synchronously) and before an
+ *  allocation fails.
+ */
+size_t pmm_reclaim(size_t target);
+
+/*
+ * void pmm_set_watermarks(size_t low, size_t min)
+ *  Sets the low and min free frame watermarks (PMM_WMARK_LOW and
+ *  PMM_WMARK_MIN by default).
+ */
+void pmm_set_watermarks(size_t low, size_t min);
+
+typedef struct {
+	size_t low_crossings; // times the number of free frames dropped below the low watermark
+	size_t min_crossings; // times the number of free frames dropped below the min watermark
+	size_t reclaims; // number of reclaim passes
+	size_t reclaimed; // total number of frames freed by shrinkers
+} pmm_pressure_stats_t;
+
+/*
+ * void pmm_pressure_get_stats(pmm_pressure_stats_t* stats)
+ *  Retrieves memory pressure statistics.
+ */
+void pmm_pressure_get_stats(pmm_pressure_stats_t* stats);
+
+/*
+ * size_t pmm_cpu_id()
+ *  Returns the index of the calling CPU, which selects its frame
+ *  magazine. The default implementation always returns 0.
+ */
+size_t pmm_cpu_id();
+
+typedef struct {
+	size_t hits; // single-frame allocations served from the magazine
+	size_t misses; // single-frame allocations that found the magazine empty
+	size_t refills; // batches taken from the global pool
+	size_t drains; // batches returned to the global pool
+} pmm_mag_stats_t;
+
+/*
+ * void pmm_mag_get_stats(size_t cpu, pmm_mag_stats_t* stats)
+ *  Retrieves the frame magazine counters of the specified CPU.
+ */
+void pmm_mag_get_stats(size_t cpu, pmm_mag_stats_t* stats);
+
 #endif
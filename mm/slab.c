@@ -0,0 +1,215 @@
+#include <mm/slab.h>
+#include <mm/kheap.h>
+#include <exec/task.h>
+#include <kernel/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifndef KMEM_SLAB_SIZE
+#define KMEM_SLAB_SIZE							4096 // minimum size of a slab (must be a power of two)
+#endif
+
+#ifndef KMEM_SLAB_MIN_OBJS
+#define KMEM_SLAB_MIN_OBJS						4 // minimum number of objects in a slab (bigger slabs are used for large objects)
+#endif
+
+#ifndef KMEM_EMPTY_MAX
+#define KMEM_EMPTY_MAX							1 // number of empty slabs each cache holds on to when objects are freed
+#endif
+
+/* slab header - this sits at the start of each slab, which is aligned to its size so that it can be found from any of its objects */
+typedef struct kmem_slab {
+	struct kmem_slab* prev;
+	struct kmem_slab* next;
+	kmem_cache_t* cache; // cache owning the slab
+	void* free; // first free object
+	size_t used; // number of allocated objects
+} kmem_slab_t;
+
+struct kmem_cache {
+	const char* name;
+	size_t size; // object size
+	size_t stride; // distance between objects
+	size_t link_off; // offset of the free list link in each free object
+	size_t offset; // offset of the first object in each slab
+	size_t count; // number of objects in each slab
+	size_t slab_size; // size of each slab
+	void (*ctor)(void* obj); // object constructor
+	kmem_slab_t* partial; // slabs with both used and free objects
+	kmem_slab_t* full; // slabs with no free objects
+	kmem_slab_t* empty; // slabs with no used objects
+	size_t num_empty; // number of slabs in the empty list
+	kmem_cache_stats_t stats;
+	struct kmem_cache* next; // next cache in kmem_caches
+};
+
+static kmem_cache_t* kmem_caches = NULL; // list of all caches (for shrinking)
+
+#define kmem_align(x, align)					(((x) + (align) - 1) & ~((align) - 1))
+#define kmem_link(cache, obj)					(*(void**)((uintptr_t)(obj) + (cache)->link_off)) // free list link of an object
+
+/* list operations - these must be called with task switching blocked */
+
+static void kmem_list_push(kmem_slab_t** list, kmem_slab_t* slab) {
+	slab->prev = NULL;
+	slab->next = *list;
+	if(*list) (*list)->prev = slab;
+	*list = slab;
+}
+
+static void kmem_list_remove(kmem_slab_t** list, kmem_slab_t* slab) {
+	if(slab->prev) slab->prev->next = slab->next;
+	else *list = slab->next;
+	if(slab->next) slab->next->prev = slab->prev;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void* obj)) {
+	if(!align) align = sizeof(void*);
+	if(align & (align - 1)) {
+		kerror("alignment %u for cache %s is not a power of two", align, name);
+		return NULL;
+	}
+
+	kmem_cache_t* cache = kcalloc(1, sizeof(kmem_cache_t));
+	if(!cache) {
+		kerror("cannot allocate memory for cache %s", name);
+		return NULL;
+	}
+	cache->name = name;
+	cache->size = size;
+	cache->ctor = ctor;
+
+	/* objects with a constructor must keep their contents while free, so the free list link goes after them */
+	if(ctor) {
+		cache->link_off = kmem_align(size, sizeof(void*));
+		cache->stride = cache->link_off + sizeof(void*);
+	} else cache->stride = (size < sizeof(void*)) ? sizeof(void*) : size;
+	cache->stride = kmem_align(cache->stride, align);
+	cache->offset = kmem_align(sizeof(kmem_slab_t), align);
+	cache->slab_size = KMEM_SLAB_SIZE;
+	while((cache->slab_size - cache->offset) / cache->stride < KMEM_SLAB_MIN_OBJS) cache->slab_size <<= 1;
+	cache->count = (cache->slab_size - cache->offset) / cache->stride;
+	cache->stats.objs_per_slab = cache->count;
+
+	task_yield_block();
+	cache->next = kmem_caches;
+	kmem_caches = cache;
+	task_yield_unblock();
+
+	kdebug("created cache %s: %u-byte objects, %u per %u-byte slab", name, size, cache->count, cache->slab_size);
+	return cache;
+}
+
+/* allocates and sets up a new slab */
+static kmem_slab_t* kmem_slab_new(kmem_cache_t* cache) {
+	kmem_slab_t* slab = kmemalign(cache->slab_size, cache->slab_size);
+	if(!slab) {
+		kerror("cannot allocate slab for cache %s", cache->name);
+		return NULL;
+	}
+	slab->cache = cache;
+	slab->used = 0;
+	slab->free = NULL;
+	for(size_t i = cache->count; i > 0; i--) {
+		/* build the free list backwards so that objects are handed out in address order */
+		void* obj = (void*)((uintptr_t) slab + cache->offset + (i - 1) * cache->stride);
+		if(cache->ctor) cache->ctor(obj);
+		kmem_link(cache, obj) = slab->free;
+		slab->free = obj;
+	}
+	return slab;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+	task_yield_block();
+	kmem_slab_t* slab = cache->partial;
+	if(!slab && cache->empty) {
+		/* reuse an empty slab */
+		slab = cache->empty;
+		kmem_list_remove(&cache->empty, slab);
+		cache->num_empty--;
+		kmem_list_push(&cache->partial, slab);
+	}
+	if(!slab) {
+		/* get a new slab - this goes to the heap, so we cannot keep task switching blocked */
+		task_yield_unblock();
+		slab = kmem_slab_new(cache);
+		if(!slab) return NULL;
+		task_yield_block();
+		kmem_list_push(&cache->partial, slab);
+		cache->stats.slabs++;
+	}
+
+	void* obj = slab->free;
+	slab->free = kmem_link(cache, obj);
+	if(++slab->used == cache->count) {
+		kmem_list_remove(&cache->partial, slab);
+		kmem_list_push(&cache->full, slab);
+	}
+	cache->stats.allocs++;
+	task_yield_unblock();
+	return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+	if(!obj) return;
+	kmem_slab_t* slab = (kmem_slab_t*)((uintptr_t) obj & ~(cache->slab_size - 1));
+	if(slab->cache != cache) {
+		kerror("object 0x%x does not belong to cache %s", (uintptr_t) obj, cache->name);
+		return;
+	}
+
+	kmem_slab_t* release = NULL; // slab to be given back to the heap
+	task_yield_block();
+	if(slab->used == cache->count) {
+		kmem_list_remove(&cache->full, slab);
+		kmem_list_push(&cache->partial, slab);
+	}
+	kmem_link(cache, obj) = slab->free;
+	slab->free = obj;
+	if(!--slab->used) {
+		kmem_list_remove(&cache->partial, slab);
+		if(cache->num_empty < KMEM_EMPTY_MAX) {
+			kmem_list_push(&cache->empty, slab);
+			cache->num_empty++;
+		} else {
+			release = slab;
+			cache->stats.slabs--;
+		}
+	}
+	cache->stats.frees++;
+	task_yield_unblock();
+
+	if(release) kfree(release);
+}
+
+size_t kmem_cache_shrink(kmem_cache_t* cache) {
+	task_yield_block();
+	kmem_slab_t* slab = cache->empty;
+	size_t n = cache->num_empty;
+	cache->empty = NULL;
+	cache->num_empty = 0;
+	cache->stats.slabs -= n;
+	task_yield_unblock();
+
+	while(slab) {
+		kmem_slab_t* next = slab->next;
+		kfree(slab);
+		slab = next;
+	}
+	return n;
+}
+
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+	task_yield_block();
+	memcpy(stats, &cache->stats, sizeof(kmem_cache_stats_t));
+	task_yield_unblock();
+}
+
+size_t kmem_shrink(size_t target) {
+	size_t slabs = 0;
+	for(kmem_cache_t* cache = kmem_caches; cache; cache = cache->next) slabs += kmem_cache_shrink(cache); // caches are never removed, so the list can be walked as is
+	if(slabs) kdebug("released %u empty slab(s)", slabs);
+	return kheap_shrink(target); // slabs go back to the heap, so the heap has to give them back to the PMM
+}
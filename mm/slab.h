@@ -0,0 +1,61 @@
+#ifndef MM_SLAB_H
+#define MM_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct kmem_cache kmem_cache_t;
+
+typedef struct {
+	size_t allocs; // number of objects allocated
+	size_t frees; // number of objects freed
+	size_t slabs; // number of slabs currently owned by the cache
+	size_t objs_per_slab; // number of objects in each slab
+} kmem_cache_stats_t;
+
+/*
+ * kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void* obj))
+ *  Creates a cache of size-byte objects aligned to align bytes (or to
+ *  the pointer size if align is 0). If ctor is given, it is called on
+ *  each object once when its slab is set up, and freed objects are
+ *  expected to be returned in their constructed state.
+ *  Returns NULL on failure.
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void* obj));
+
+/*
+ * void* kmem_cache_alloc(kmem_cache_t* cache)
+ *  Allocates an object from the cache. Returns NULL on failure.
+ *  This function is thread-safe.
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+/*
+ * void kmem_cache_free(kmem_cache_t* cache, void* obj)
+ *  Returns an object to the cache it was allocated from.
+ *  This function is thread-safe.
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+/*
+ * size_t kmem_cache_shrink(kmem_cache_t* cache)
+ *  Gives the cache's empty slabs back to the kernel heap, then returns
+ *  the number of slabs released.
+ */
+size_t kmem_cache_shrink(kmem_cache_t* cache);
+
+/*
+ * void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats)
+ *  Retrieves the cache's statistics.
+ */
+void kmem_cache_get_stats(kmem_cache_t* cache, kmem_cache_stats_t* stats);
+
+/*
+ * size_t kmem_shrink(size_t target)
+ *  Shrinker callback (see pmm_shrinker_register()) that releases the
+ *  empty slabs of all caches and trims the kernel heap afterwards.
+ *  Returns the number of frames given back to the PMM.
+ */
+size_t kmem_shrink(size_t target);
+
+#endif
@@ -1,15 +1,20 @@
 #include <mm/vmm.h>
 #include <mm/pmm.h>
 #include <mm/addr.h>
+#include <mm/slab.h>
+#include <mm/kheap.h>
 #include <stdlib.h>
 #include <kernel/log.h>
 #include <helpers/mutex.h>
 #include <string.h>
+#include <stdatomic.h>
 
 void* vmm_current = NULL;
 void* vmm_kernel = NULL;
 
-uintptr_t vmm_map(void* vmm, uintptr_t pa, uintptr_t va, size_t sz, size_t pgsz_max_idx, size_t flags) {
+uintptr_t vmm_txn_map(vmm_txn_t* txn, uintptr_t pa, uintptr_t va, size_t sz, size_t pgsz_max_idx, size_t flags) {
+	if(!vmm_region_reserve(txn->vmm, va, sz)) kwarn("cannot reserve address space 0x%x-0x%x", va, va + sz - 1); // the mapping can still go ahead
+
 	size_t pgsz_num = vmm_pgsz_num();
 	if(pgsz_max_idx >= pgsz_num) pgsz_max_idx = pgsz_num - 1;
 
@@ -34,7 +39,7 @@ uintptr_t vmm_map(void* vmm, uintptr_t pa, uintptr_t va, size_t sz, size_t pgsz_
 		for(int i = pgsz_max_idx; i >= 0; i--) {
 			size_t pgsz = vmm_pgsz(i);
 			if(va + pgsz > va_end || pa % pgsz || va % pgsz) continue; // use something else!
-			vmm_pgmap(vmm, pa, va, i, flags);
+			vmm_txn_pgmap(txn, pa, va, i, flags);
 			pa += pgsz; va += pgsz;
 			break; // exit from the for loop
 		}
@@ -43,109 +48,304 @@ uintptr_t vmm_map(void* vmm, uintptr_t pa, uintptr_t va, size_t sz, size_t pgsz_
 	return (va - sz + delta);
 }
 
-void vmm_unmap(void* vmm, uintptr_t va, size_t sz) {
+uintptr_t vmm_map(void* vmm, uintptr_t pa, uintptr_t va, size_t sz, size_t pgsz_max_idx, size_t flags) {
+	vmm_txn_t txn;
+	if(!vmm_txn_begin(&txn, vmm)) return 0;
+	uintptr_t ret = vmm_txn_map(&txn, pa, va, sz, pgsz_max_idx, flags);
+	vmm_txn_commit(&txn);
+	return ret;
+}
+
+/* page-aligns the range of sz bytes starting from *va and returns its size */
+static size_t vmm_align_range(uintptr_t* va, size_t sz) {
 	size_t pgsz_min = vmm_pgsz(0);
-	if(va % pgsz_min) {
-		size_t delta = va;
-		va = (va / pgsz_min) * pgsz_min;
-		delta -= va;
-		sz += delta;
+	if(*va % pgsz_min) {
+		sz += *va % pgsz_min;
+		*va -= *va % pgsz_min;
 	}
 	if(sz % pgsz_min) sz += pgsz_min - sz % pgsz_min;
+	return sz;
+}
+
+void vmm_txn_unmap(vmm_txn_t* txn, uintptr_t va, size_t sz) {
+	sz = vmm_align_range(&va, sz);
+	vmm_region_release(txn->vmm, va, sz);
 	size_t va_end = va + sz;
 	size_t pgsz_max_idx = vmm_pgsz_num() - 1;
 	while(va < va_end) {
 		for(int i = pgsz_max_idx; i >= 0; i--) {
 			size_t pgsz = vmm_pgsz(i);
 			if(va + pgsz > va_end || va % pgsz) continue; // use something else!
-			vmm_pgunmap(vmm, va, i);
+			vmm_txn_pgunmap(txn, va, i);
 			va += pgsz;
+			break; // exit from the for loop
 		}
 	}
 }
 
-uintptr_t vmm_first_free(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t sz, size_t align, bool reverse) {
-	/* convert virtual address to VMM page number */
-	size_t pgsz = vmm_pgsz(0); // minimum page size
-	if(!va_start) va_start++; // avoid null
-	else va_start = (va_start + pgsz - 1) / pgsz;
-	va_end /= pgsz;
-	sz = (sz + pgsz - 1) / pgsz; // sz now stores the number of pages required
-	align /= sz; // convert to pages
-	uintptr_t result = (!reverse) ? va_start : (va_end - sz); size_t blk_sz = 0;
-	while(result >= va_start && result + sz <= va_end) {
-		if(vmm_get_pgsz(vmm, (result + blk_sz) * pgsz) != (size_t) -1) {
-			/* block end */
-			if(reverse) {
-				result -= blk_sz + 1;
-				if(align && result % align) result -= result % align;
-			} else {
-				result += blk_sz + 1;
-				if(align && result % align) result += align - result % align;
-			}
-			blk_sz = 0;
-			continue;
-		}
-		/* this page is free */
-		blk_sz++;
-		if(blk_sz == sz) return result * pgsz; // we've reached our target
+void vmm_unmap(void* vmm, uintptr_t va, size_t sz) {
+	vmm_txn_t txn;
+	if(!vmm_txn_begin(&txn, vmm)) return;
+	vmm_txn_unmap(&txn, va, sz);
+	vmm_txn_commit(&txn);
+}
+
+void vmm_txn_protect(vmm_txn_t* txn, uintptr_t va, size_t sz, size_t flags) {
+	sz = vmm_align_range(&va, sz);
+	size_t va_end = va + sz;
+	while(va < va_end) {
+		size_t pgsz_idx = vmm_get_pgsz(txn->vmm, va);
+		size_t pgsz = vmm_pgsz((pgsz_idx == (size_t)-1) ? 0 : pgsz_idx);
+		if(pgsz_idx != (size_t)-1) vmm_txn_set_flags(txn, va, flags);
+		va = va - va % pgsz + pgsz;
 	}
-	return 0; // cannot find block
 }
 
 uintptr_t vmm_alloc_map(void* vmm, uintptr_t pa, size_t sz, uintptr_t va_start, uintptr_t va_end, size_t va_align, size_t pgsz_max_idx, bool reverse, size_t flags) {
 	size_t off = pa % vmm_pgsz(0);
 	pa -= off; sz += off;
-	uintptr_t vaddr = vmm_first_free(vmm, va_start, va_end, sz, va_align, reverse);
+	uintptr_t vaddr = vmm_region_alloc(vmm, va_start, va_end, sz, va_align, reverse);
 	if(!vaddr) return 0; // cannot find space
 	vmm_map(vmm, pa, vaddr, sz, pgsz_max_idx, flags);
 	return (vaddr + off);
 }
 
-static vmm_trap_t* vmm_traps = NULL;
-static size_t vmm_traps_maxlen = 0;
-static mutex_t vmm_traps_mutex = {0};
+/* physical memory direct map and kmap windows */
 
-#ifndef VMM_TRAP_ALLOCSZ
-#define VMM_TRAP_ALLOCSZ			4 // number of entries to be allocated at once
+#ifndef VMM_DMAP_BASE
+extern uintptr_t __dmap_start;
+#define VMM_DMAP_BASE								(uintptr_t)&__dmap_start // base address of the direct map - use config from linker script
 #endif
 
-vmm_trap_t* vmm_new_trap(void* vmm, uintptr_t vaddr, enum vmm_trap_type type) {
-	vmm_trap_t* trap = NULL;
-	mutex_acquire(&vmm_traps_mutex);
-	for(size_t i = 0; i < vmm_traps_maxlen; i++) {
-		if(vmm_traps[i].type == VMM_TRAP_NONE) {
-			trap = &vmm_traps[i];
-			break;
+#ifndef VMM_DMAP_MAX_SIZE
+extern uintptr_t __dmap_end;
+#define VMM_DMAP_MAX_SIZE							((size_t)&__dmap_end - (size_t)&__dmap_start) // maximum amount of physical memory to be direct mapped - use config from linker script
+#endif
+
+#ifndef VMM_KMAP_WINDOWS
+#define VMM_KMAP_WINDOWS							16 // number of windows for accessing frames outside of the direct map (32 at most)
+#endif
+
+#ifndef VMM_KMAP_WINDOW_SIZE
+#define VMM_KMAP_WINDOW_SIZE						4096 // size of each window (must be the minimum page size)
+#endif
+
+static size_t vmm_dmap_size = 0; // number of bytes of physical memory covered by the direct map
+
+/* kernel address space set aside for mapping frames outside of the direct map - no frames are mapped there until a window is claimed */
+static uintptr_t vmm_kmap_windows = 0;
+static _Atomic uint32_t vmm_kmap_used = 0; // bitmap of windows in use
+
+void vmm_dmap_init() {
+	size_t hugesz = vmm_pgsz(vmm_pgsz_num() - 1); // the direct map is done in the largest page size
+	size_t size = (pmm_frames * pmm_framesz() + hugesz - 1) / hugesz * hugesz;
+	if(size > VMM_DMAP_MAX_SIZE) {
+		kinfo("only %u of %u MiB of physical memory can be direct mapped", VMM_DMAP_MAX_SIZE >> 20, size >> 20);
+		size = VMM_DMAP_MAX_SIZE;
+	}
+	vmm_map(vmm_kernel, 0, VMM_DMAP_BASE, size, vmm_pgsz_num() - 1, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_GLOBAL | VMM_FLAGS_CACHE);
+	vmm_dmap_size = size;
+	kdebug("direct mapped %u MiB of physical memory at 0x%x", size >> 20, VMM_DMAP_BASE);
+
+	/* kernel page tables are all in place by now, so mapping a window never needs to allocate one */
+	vmm_kmap_windows = vmm_region_alloc(vmm_kernel, kernel_start, UINTPTR_MAX, VMM_KMAP_WINDOWS * VMM_KMAP_WINDOW_SIZE, 0, true);
+	if(!vmm_kmap_windows) kerror("cannot reserve address space for kmap windows");
+	else kdebug("kmap windows @ 0x%x", vmm_kmap_windows);
+}
+
+void* vmm_phys_to_virt(uintptr_t pa) {
+	return (pa < vmm_dmap_size) ? (void*) (VMM_DMAP_BASE + pa) : NULL;
+}
+
+void* vmm_kmap(uintptr_t pa) {
+	if(pa < vmm_dmap_size) return (void*) (VMM_DMAP_BASE + pa);
+	if(!vmm_kmap_windows) {
+		kerror("no kmap windows for paddr 0x%x", pa);
+		return NULL;
+	}
+
+	/* claim a window */
+	uint32_t used = atomic_load_explicit(&vmm_kmap_used, memory_order_relaxed);
+	size_t i;
+	do {
+		for(i = 0; i < VMM_KMAP_WINDOWS && (used & ((uint32_t)1 << i)); i++);
+		if(i == VMM_KMAP_WINDOWS) {
+			kerror("no kmap window available for paddr 0x%x", pa);
+			return NULL;
+		}
+	} while(!atomic_compare_exchange_weak_explicit(&vmm_kmap_used, &used, used | ((uint32_t)1 << i), memory_order_acquire, memory_order_relaxed));
+
+	uintptr_t window = vmm_kmap_windows + i * VMM_KMAP_WINDOW_SIZE;
+	vmm_pgmap(vmm_current, pa - pa % VMM_KMAP_WINDOW_SIZE, window, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_CACHE); // kernel space is shared, so this works in any VMM configuration
+	return (void*) (window + pa % VMM_KMAP_WINDOW_SIZE);
+}
+
+void vmm_kunmap(void* ptr) {
+	uintptr_t va = (uintptr_t) ptr;
+	if(!vmm_kmap_windows || va < vmm_kmap_windows || va >= vmm_kmap_windows + VMM_KMAP_WINDOWS * VMM_KMAP_WINDOW_SIZE) return; // direct map - nothing to be done
+	size_t i = (va - vmm_kmap_windows) / VMM_KMAP_WINDOW_SIZE;
+	vmm_pgunmap(vmm_current, vmm_kmap_windows + i * VMM_KMAP_WINDOW_SIZE, 0); // stale mappings would keep the frame reachable
+	atomic_fetch_and_explicit(&vmm_kmap_used, ~((uint32_t)1 << i), memory_order_release);
+}
+
+/* page traps - these are indexed by (vmm, vaddr) in a hash table, and each VMM configuration keeps a list of its own traps for vmm_trap_remove() */
+
+#ifndef VMM_TRAP_BUCKETS
+#define VMM_TRAP_BUCKETS			256 // initial number of buckets in the trap hash table (must be a power of two); doubled once there are twice as many traps
+#endif
+
+#ifndef VMM_TRAP_LISTS
+#define VMM_TRAP_LISTS				64 // number of buckets in the VMM configuration to trap list hash table (must be a power of two)
+#endif
+
+/* per-VMM trap list */
+typedef struct vmm_trap_list {
+	void* vmm;
+	vmm_trap_t* head; // first trap in the VMM configuration
+	struct vmm_trap_list* next; // next list in the hash bucket
+} vmm_trap_list_t;
+
+static vmm_trap_t** vmm_traps = NULL; // trap hash table
+static size_t vmm_traps_buckets = 0; // number of buckets in vmm_traps
+static size_t vmm_traps_count = 0; // number of traps in vmm_traps
+static vmm_trap_list_t* vmm_trap_lists[VMM_TRAP_LISTS];
+static mutex_t vmm_traps_mutex = {0};
+static kmem_cache_t* vmm_traps_cache = NULL;
+
+#define vmm_trap_hash(vmm, vaddr, buckets)	(((((uintptr_t)(vmm) >> 12) ^ ((uintptr_t)(vaddr) >> 12)) * 2654435761U) & ((buckets) - 1))
+#define vmm_trap_list_hash(vmm)				(((uintptr_t)(vmm) >> 12) & (VMM_TRAP_LISTS - 1))
+
+/* trap table operations - these must be called with vmm_traps_mutex held */
+
+/* retrieves vmm's trap list, optionally creating it */
+static vmm_trap_list_t* vmm_trap_list_get(void* vmm, bool create) {
+	vmm_trap_list_t** bucket = &vmm_trap_lists[vmm_trap_list_hash(vmm)];
+	for(vmm_trap_list_t* list = *bucket; list; list = list->next) {
+		if(list->vmm == vmm) return list;
+	}
+	if(!create) return NULL;
+	vmm_trap_list_t* list = kmalloc(sizeof(vmm_trap_list_t));
+	if(!list) return NULL;
+	list->vmm = vmm;
+	list->head = NULL;
+	list->next = *bucket;
+	*bucket = list;
+	return list;
+}
+
+/* doubles the number of buckets in the trap table (or sets it up if it hasn't been) */
+static bool vmm_trap_grow() {
+	size_t buckets = (vmm_traps_buckets) ? (vmm_traps_buckets << 1) : VMM_TRAP_BUCKETS;
+	vmm_trap_t** traps = kcalloc(buckets, sizeof(vmm_trap_t*));
+	if(!traps) return false;
+	for(size_t i = 0; i < vmm_traps_buckets; i++) {
+		vmm_trap_t* trap = vmm_traps[i];
+		while(trap) {
+			vmm_trap_t* next = trap->next;
+			size_t h = vmm_trap_hash(trap->vmm, trap->vaddr, buckets);
+			trap->next = traps[h];
+			traps[h] = trap;
+			trap = next;
 		}
 	}
-	if(!trap) {
-		/* create new trap */
-		vmm_trap_t* new_trap = krealloc(vmm_traps, (vmm_traps_maxlen + VMM_TRAP_ALLOCSZ) * sizeof(vmm_trap_t));
-		if(!new_trap) {
-			kerror("cannot allocate memory for new trap (type %u, vmm 0x%x, vaddr 0x%x)", type, vmm, vaddr);
-		} else {
-			trap = &new_trap[vmm_traps_maxlen];
-			vmm_traps = new_trap;
-			memset(&new_trap[vmm_traps_maxlen + 1], 0, (VMM_TRAP_ALLOCSZ - 1) * sizeof(vmm_trap_t));
-			vmm_traps_maxlen += VMM_TRAP_ALLOCSZ;
+	kfree(vmm_traps);
+	vmm_traps = traps;
+	vmm_traps_buckets = buckets;
+	return true;
+}
+
+static vmm_trap_t* vmm_trap_find(void* vmm, uintptr_t vaddr, enum vmm_trap_type type) {
+	if(!vmm_traps_count) return NULL;
+	for(vmm_trap_t* trap = vmm_traps[vmm_trap_hash(vmm, vaddr, vmm_traps_buckets)]; trap; trap = trap->next) {
+		if(trap->vmm == vmm && trap->vaddr == vaddr && trap->type == type) return trap;
+	}
+	return NULL;
+}
+
+static vmm_trap_t* vmm_trap_insert(void* vmm, uintptr_t vaddr, enum vmm_trap_type type) {
+	if(!vmm_traps_cache) {
+		vmm_traps_cache = kmem_cache_create("vmm_trap", sizeof(vmm_trap_t), 0, NULL);
+		if(!vmm_traps_cache) {
+			kerror("cannot create trap cache");
+			return NULL;
 		}
 	}
-	if(trap) {
-		trap->type = type;
-		trap->vmm = vmm;
-		trap->vaddr = vaddr;
+	if((!vmm_traps_buckets || vmm_traps_count >= vmm_traps_buckets * 2) && !vmm_trap_grow() && !vmm_traps_buckets) {
+		kerror("cannot allocate trap table");
+		return NULL;
+	} // if growing fails, the chains will just get longer
+
+	vmm_trap_list_t* list = vmm_trap_list_get(vmm, true);
+	vmm_trap_t* trap = (list) ? kmem_cache_alloc(vmm_traps_cache) : NULL;
+	if(!trap) {
+		kerror("cannot allocate memory for new trap (type %u, vmm 0x%x, vaddr 0x%x)", type, (uintptr_t) vmm, vaddr);
+		return NULL;
+	}
+	trap->type = type;
+	trap->vmm = vmm;
+	trap->vaddr = vaddr;
+	trap->info = NULL;
+
+	size_t h = vmm_trap_hash(vmm, vaddr, vmm_traps_buckets);
+	trap->next = vmm_traps[h];
+	vmm_traps[h] = trap;
+	trap->vmm_prev = NULL;
+	trap->vmm_next = list->head;
+	if(list->head) list->head->vmm_prev = trap;
+	list->head = trap;
+	vmm_traps_count++;
+	return trap;
+}
+
+static void vmm_trap_unlink(vmm_trap_t* trap) {
+	if(trap->type == VMM_TRAP_COW && trap->info) ((vmm_trap_t*) trap->info)->info = NULL; // the other side now resolves its order by itself
+
+	vmm_trap_t** link = &vmm_traps[vmm_trap_hash(trap->vmm, trap->vaddr, vmm_traps_buckets)];
+	while(*link && *link != trap) link = &(*link)->next;
+	if(!*link) {
+		kerror("trap 0x%x (vmm 0x%x, vaddr 0x%x) is not in the trap table", (uintptr_t) trap, (uintptr_t) trap->vmm, trap->vaddr);
+		return;
+	}
+	*link = trap->next;
+	vmm_traps_count--;
+
+	if(trap->vmm_next) trap->vmm_next->vmm_prev = trap->vmm_prev;
+	if(trap->vmm_prev) trap->vmm_prev->vmm_next = trap->vmm_next;
+	else {
+		/* first trap in its VMM configuration's list */
+		vmm_trap_list_t** plist = &vmm_trap_lists[vmm_trap_list_hash(trap->vmm)];
+		while(*plist && (*plist)->vmm != trap->vmm) plist = &(*plist)->next;
+		if(*plist) {
+			vmm_trap_list_t* list = *plist;
+			list->head = trap->vmm_next;
+			if(!list->head) {
+				/* no more traps left in the VMM configuration */
+				*plist = list->next;
+				kfree(list);
+			}
+		}
 	}
+	kmem_cache_free(vmm_traps_cache, trap);
+}
+
+vmm_trap_t* vmm_new_trap(void* vmm, uintptr_t vaddr, enum vmm_trap_type type) {
+	mutex_acquire(&vmm_traps_mutex);
+	vmm_trap_t* trap = vmm_trap_insert(vmm, vaddr, type);
 	mutex_release(&vmm_traps_mutex);
-	return trap; // cannot create new trap
+	return trap;
 }
 
 void vmm_delete_trap(vmm_trap_t* trap) {
 	if(!trap) return;
-	trap->type = VMM_TRAP_NONE;
+	mutex_acquire(&vmm_traps_mutex);
+	vmm_trap_unlink(trap);
+	mutex_release(&vmm_traps_mutex);
 }
 
-size_t vmm_cow_setup(void* vmm_src, uintptr_t vaddr_src, void* vmm_dst, uintptr_t vaddr_dst, size_t size) {
+size_t vmm_cow_setup_txn(vmm_txn_t* txn_src, vmm_txn_t* txn_dst, uintptr_t vaddr_src, uintptr_t vaddr_dst, size_t size) {
+	void* vmm_src = txn_src->vmm;
+	void* vmm_dst = txn_dst->vmm;
+
 	/* page-align addresses */
 	size_t size_delta = 0;
 	size_t pgsz_min = vmm_pgsz(0); // minimum page size
@@ -159,7 +359,7 @@ size_t vmm_cow_setup(void* vmm_src, uintptr_t vaddr_src, void* vmm_dst, uintptr_
 		vaddr_dst -= d;
 	}
 	size += size_delta;
-	if(size % pgsz_min) size += size - size % pgsz_min; // round up size to the nearest minimum page boundary
+	if(size % pgsz_min) size += pgsz_min - size % pgsz_min; // round up size to the nearest minimum page boundary
 	
 	size_t done_sz = 0;
 	while(done_sz < size) {
@@ -172,13 +372,17 @@ size_t vmm_cow_setup(void* vmm_src, uintptr_t vaddr_src, void* vmm_dst, uintptr_
 			uintptr_t va_start = vaddr_src - vaddr_src % vmm_pgsz(pgsz_src);
 			uintptr_t pa_start = vmm_get_paddr(vmm_src, va_start);
 			uintptr_t va_end = va_start + vmm_pgsz(pgsz_src);
-			vmm_map(vmm_src, pa_start, va_start, vaddr_src - va_start, pgsz_src, flags); // space before our page
+			vmm_txn_map(txn_src, pa_start, va_start, vaddr_src - va_start, pgsz_src, flags); // space before our page
 			size_t new_sz = vmm_pgsz(pgsz_src_new);
-			vmm_map(vmm_src, pa_start + vaddr_src - va_start, vaddr_src, new_sz, pgsz_src_new, flags); // our page
-			vmm_map(vmm_src, pa_start + vaddr_src - va_start + new_sz, vaddr_src + new_sz, va_end - (vaddr_src + new_sz), pgsz_src, flags); // space after our page
+			vmm_txn_map(txn_src, pa_start + vaddr_src - va_start, vaddr_src, new_sz, pgsz_src_new, flags); // our page
+			vmm_txn_map(txn_src, pa_start + vaddr_src - va_start + new_sz, vaddr_src + new_sz, va_end - (vaddr_src + new_sz), pgsz_src, flags); // space after our page
 			pgsz_src = pgsz_src_new;
 		}
-		vmm_pgmap(vmm_dst, vmm_get_paddr(vmm_src, vaddr_src), vaddr_dst + done_sz, pgsz_src, (vmm_get_flags(vmm_src, vaddr_src + done_sz) & ~VMM_FLAGS_RW) | VMM_FLAGS_TRAPPED);
+		uintptr_t paddr = vmm_get_paddr(vmm_src, vaddr_src);
+		vmm_txn_pgmap(txn_dst, paddr, vaddr_dst, pgsz_src, (vmm_get_flags(vmm_src, vaddr_src) & ~VMM_FLAGS_RW) | VMM_FLAGS_TRAPPED);
+		size_t framesz = pmm_framesz();
+		for(size_t i = 0; i < vmm_pgsz(pgsz_src) / framesz; i++) pmm_page_ref(paddr / framesz + i); // destination now references the frame(s) too
+		pmm_page_mark(paddr / framesz, vmm_pgsz(pgsz_src) / framesz, PMM_PAGE_COW, vmm_src);
 		vmm_trap_t* src = vmm_new_trap(vmm_src, vaddr_src, VMM_TRAP_COW);
 		vmm_trap_t* dst = vmm_new_trap(vmm_dst, vaddr_dst, VMM_TRAP_COW);
 		if(!src || !dst) {
@@ -189,7 +393,7 @@ size_t vmm_cow_setup(void* vmm_src, uintptr_t vaddr_src, void* vmm_dst, uintptr_
 		}
 		dst->info = src;
 		src->info = dst;
-		vmm_set_flags(vmm_src, vaddr_src, (vmm_get_flags(vmm_src, vaddr_src) & ~VMM_FLAGS_RW) | VMM_FLAGS_TRAPPED); // disable RW so that we get page faults
+		vmm_txn_set_flags(txn_src, vaddr_src, (vmm_get_flags(vmm_src, vaddr_src) & ~VMM_FLAGS_RW) | VMM_FLAGS_TRAPPED); // disable RW so that we get page faults
 		// vmm_set_flags(vmm_dst, vaddr_dst, vmm_get_flags(vmm_dst, vaddr_dst) & ~VMM_FLAGS_RW);
 
 		size_t pgsz = vmm_pgsz(pgsz_src);
@@ -199,143 +403,174 @@ size_t vmm_cow_setup(void* vmm_src, uintptr_t vaddr_src, void* vmm_dst, uintptr_
 	return done_sz;
 }
 
+size_t vmm_cow_setup(void* vmm_src, uintptr_t vaddr_src, void* vmm_dst, uintptr_t vaddr_dst, size_t size) {
+	vmm_txn_t txn_src, txn_dst;
+	if(!vmm_txn_begin(&txn_src, vmm_src)) return 0;
+	if(!vmm_txn_begin(&txn_dst, vmm_dst)) {
+		vmm_txn_commit(&txn_src);
+		return 0;
+	}
+	size_t ret = vmm_cow_setup_txn(&txn_src, &txn_dst, vaddr_src, vaddr_dst, size);
+	vmm_txn_commit(&txn_dst);
+	vmm_txn_commit(&txn_src);
+	return ret;
+}
+
+/* drops all of vmm's COW traps on vaddr, returning the other side of the last one that still had one */
+static vmm_trap_t* vmm_cow_unlink(void* vmm, uintptr_t vaddr) {
+	vmm_trap_t* peer = NULL;
+	vmm_trap_t* trap;
+	while((trap = vmm_trap_find(vmm, vaddr, VMM_TRAP_COW))) {
+		if(trap->info) peer = trap->info;
+		vmm_trap_unlink(trap);
+	}
+	return peer;
+}
+
+/* checks if the page at vaddr still has a COW order on it; must be called with vmm_traps_mutex held */
+static bool vmm_cow_pending(void* vmm, uintptr_t vaddr) {
+	return (vmm_trap_find(vmm, vaddr, VMM_TRAP_COW) || (vmm_get_flags(vmm, vaddr) & VMM_FLAGS_TRAPPED)); // pages that came from an unshared page table are only marked as trapped
+}
+
+/* checks if anyone other than us is still holding on to the specified frame(s) */
+static bool vmm_cow_shared(uintptr_t paddr, size_t frames) {
+	size_t framesz = pmm_framesz();
+	for(size_t i = 0; i < frames; i++) {
+		pmm_page_t* page = pmm_page(paddr / framesz + i);
+		if(!page || atomic_load_explicit(&page->refcount, memory_order_relaxed) > 1) return true; // without frame descriptors, we cannot tell
+	}
+	return false;
+}
+
+/* gives vmm write access to the page at vaddr, which nobody else shares anymore; must be called with vmm_traps_mutex held */
+static void vmm_cow_takeover(void* vmm, uintptr_t vaddr) {
+	vmm_cow_unlink(vmm, vaddr);
+	vmm_set_flags(vmm, vaddr, (vmm_get_flags(vmm, vaddr) & ~VMM_FLAGS_TRAPPED) | VMM_FLAGS_RW);
+	kdebug("resolved CoW: vaddr 0x%x (VMM 0x%x) is the last user of paddr 0x%x", vaddr, (uintptr_t) vmm, vmm_get_paddr(vmm, vaddr));
+}
+
+/* splits a COW huge page into small pages that are only marked as trapped, then resolves the order on the small page at fault alone */
+static bool vmm_cow_split(void* vmm, uintptr_t vaddr, size_t pgsz_idx, uintptr_t paddr, uintptr_t fault) {
+	mutex_acquire(&vmm_traps_mutex);
+	if(vmm_get_pgsz(vmm, vaddr) != pgsz_idx || vmm_get_paddr(vmm, vaddr) != paddr || !vmm_cow_pending(vmm, vaddr)) {
+		mutex_release(&vmm_traps_mutex);
+		return true; // the order has been resolved in the meantime
+	}
+	size_t flags = (vmm_get_flags(vmm, vaddr) & ~VMM_FLAGS_RW) | VMM_FLAGS_TRAPPED;
+	vmm_cow_unlink(vmm, vaddr); // the other side resolves its order by the reference counts from now on
+	vmm_pgmap(vmm, paddr + (fault - vaddr), fault, 0, flags); // the rest of the huge page keeps its flags (and its frame references)
+	mutex_release(&vmm_traps_mutex);
+	kdebug("split CoW huge page at 0x%x (VMM 0x%x) for lack of a large block", vaddr, (uintptr_t) vmm);
+	return vmm_cow_duplicate(vmm, fault, 0);
+}
+
 bool vmm_cow_duplicate(void* vmm, uintptr_t vaddr, size_t pgsz) {
+	bool unshared = vmm_unshare(vmm, vaddr); // the page table must be ours before we can look at (or change) the page
 	if(pgsz == (size_t)-1) pgsz = vmm_get_pgsz(vmm, vaddr);
 	if(pgsz == (size_t)-1) {
 		// kdebug("page fault is caused by accessing an non-existant page, exiting");
 		return false;
 	}
+	size_t pgsz_idx = pgsz;
 	pgsz = vmm_pgsz(pgsz); // resolve to size in bytes
 
+	uintptr_t fault = vaddr - vaddr % vmm_pgsz(0); // small page being accessed
 	vaddr -= vaddr % pgsz; // page-align address
 	
-	/* find the page's COW trap index */
-	size_t idx_dst = 0;
+	/* find the page's COW order */
 	mutex_acquire(&vmm_traps_mutex);
-	for(; idx_dst < vmm_traps_maxlen; idx_dst++) {
-		if(vmm_traps[idx_dst].type == VMM_TRAP_COW && vmm_traps[idx_dst].vmm == vmm && vmm_traps[idx_dst].vaddr == vaddr) break;
-	}
-	if(idx_dst == vmm_traps_maxlen) {
+	if(!vmm_cow_pending(vmm, vaddr)) {
 		mutex_release(&vmm_traps_mutex);
-		return false; // cannot find COW trap entry
+		return unshared; // not COW, but the page may have become writable with the page table
 	}
-	vmm_trap_t* dst = &vmm_traps[idx_dst];
-	vmm_trap_t* src = dst->info;
 
-	/* find virtual address space to map memory to for copying */
+	/* check if anyone else is still holding on to the frame(s) */
 	size_t framesz = pmm_framesz(); // PMM frame size
-    void* copy_src = (void*) vmm_alloc_map(vmm_current, 0, 2 * framesz, kernel_end, UINTPTR_MAX, 0, 0, false, VMM_FLAGS_PRESENT | VMM_FLAGS_RW);
-	if(!copy_src) {
-		kerror("cannot find virtual address space to map for copying");
+	size_t rq_frames = pgsz / framesz; // number of frames we'll be requesting
+	uintptr_t paddr_shared = vmm_get_paddr(vmm, vaddr); // the frame(s) we may be moving away from
+	if(!vmm_cow_shared(paddr_shared, rq_frames)) {
+		/* everyone else has let go of the page - take it over */
+		vmm_cow_takeover(vmm, vaddr);
 		mutex_release(&vmm_traps_mutex);
-		return false;
+		return true;
 	}
+	mutex_release(&vmm_traps_mutex); // allocation may go through compaction, so neither it nor the copy is done with the mutex held
 
-	/* allocate memory for the new page */
-	size_t rq_frames = pgsz / framesz; // number of frames we'll be requesting
-	size_t frame = pmm_alloc_free(rq_frames);
+	/* allocate memory for the new page (huge pages must start on a large block boundary) */
+	size_t frame = (rq_frames == pmm_large_frames()) ? pmm_alloc_large() : pmm_alloc_free(rq_frames);
+	if(frame == (size_t)-1 && rq_frames == pmm_large_frames()) return vmm_cow_split(vmm, vaddr, pgsz_idx, paddr_shared, fault);
 	if(frame == (size_t)-1) {
 		kerror("cannot allocate memory for COW");
-		mutex_release(&vmm_traps_mutex);
 		return false;
 	}
 
-	/* map memory and perform copy */
+	/* map memory and perform copy - the shared frame(s) are read-only to everyone, and we still hold our reference to them */
 	for(size_t i = 0; i < rq_frames; i++) {
-		vmm_set_paddr(vmm_current, (uintptr_t) copy_src, vmm_get_paddr(src->vmm, src->vaddr) + i * framesz);
-		vmm_set_paddr(vmm_current, (uintptr_t) copy_src + framesz, (frame + i) * framesz);
-		memcpy((void*)((uintptr_t) copy_src + pgsz), copy_src, framesz);
+		void* copy_src = vmm_kmap(paddr_shared + i * framesz);
+		void* copy_dst = vmm_kmap((frame + i) * framesz);
+		if(!copy_src || !copy_dst) {
+			kerror("cannot map frames for copying");
+			vmm_kunmap(copy_src); vmm_kunmap(copy_dst);
+			for(size_t j = 0; j < rq_frames; j++) pmm_free(frame + j);
+			return false;
+		}
+		memcpy(copy_dst, copy_src, framesz);
+		vmm_kunmap(copy_src); vmm_kunmap(copy_dst);
+	}
+
+	mutex_acquire(&vmm_traps_mutex);
+	if(vmm_get_pgsz(vmm, vaddr) != pgsz_idx || vmm_get_paddr(vmm, vaddr) != paddr_shared || !vmm_cow_pending(vmm, vaddr) || !vmm_cow_shared(paddr_shared, rq_frames)) {
+		/* the order has been resolved (or the page unmapped) while we were copying, or we're the last user now */
+		if(vmm_get_pgsz(vmm, vaddr) == pgsz_idx && vmm_get_paddr(vmm, vaddr) == paddr_shared && vmm_cow_pending(vmm, vaddr)) vmm_cow_takeover(vmm, vaddr);
+		mutex_release(&vmm_traps_mutex);
+		for(size_t j = 0; j < rq_frames; j++) pmm_free(frame + j);
+		return true;
 	}
 
 	/* change destination's physical address to the allocated frame */
 	vmm_set_paddr(vmm, vaddr, frame * framesz);
-	vmm_set_flags(vmm, vaddr, vmm_get_flags(vmm, vaddr) | VMM_FLAGS_RW);
+	vmm_set_flags(vmm, vaddr, (vmm_get_flags(vmm, vaddr) & ~VMM_FLAGS_TRAPPED) | VMM_FLAGS_RW);
 	kdebug("resolved CoW: vaddr 0x%x (VMM 0x%x) mapped to paddr 0x%x", vaddr, (uintptr_t) vmm, frame * framesz);
+	vmm_trap_t* peer = vmm_cow_unlink(vmm, vaddr);
 
-	/* check if the source will not be referenced */
-	size_t idx_src_ref = 0;
-	for(; idx_src_ref < vmm_traps_maxlen; idx_src_ref++) {
-		if(src == &vmm_traps[idx_src_ref]) continue;
-		if(vmm_traps[idx_src_ref].type == VMM_TRAP_COW && vmm_traps[idx_src_ref].vmm == vmm && vmm_traps[idx_src_ref].vaddr == vaddr) break;
+	/* drop our reference to the shared frame(s), and give the other side its write access back if nobody else shares them */
+	size_t refs = 0; // highest remaining reference count
+	for(size_t i = 0; i < rq_frames; i++) {
+		size_t shared_frame = paddr_shared / framesz + i;
+		size_t r = (pmm_page(shared_frame)) ? pmm_page_unref(shared_frame) : 1; // without frame descriptors, assume that the other side is the only one left
+		if(r > refs) refs = r;
 	}
-	if(idx_src_ref != vmm_traps_maxlen) {
-		vmm_set_flags(src->vmm, src->vaddr, (vmm_get_flags(src->vmm, src->vaddr) & ~VMM_FLAGS_TRAPPED) | VMM_FLAGS_RW);
+	if(refs <= 1 && peer) {
+		/* this saves the other side a page fault */
+		void* peer_vmm = peer->vmm; uintptr_t peer_vaddr = peer->vaddr;
+		vmm_cow_unlink(peer_vmm, peer_vaddr);
+		vmm_set_flags(peer_vmm, peer_vaddr, (vmm_get_flags(peer_vmm, peer_vaddr) & ~VMM_FLAGS_TRAPPED) | VMM_FLAGS_RW);
 	}
 
-	/* delete traps */
-	vmm_delete_trap(src);
-	vmm_delete_trap(dst);
-
 	mutex_release(&vmm_traps_mutex);
 	
 	return true;
 }
 
-bool vmm_trap_remove(void* vmm) {
+void vmm_cow_release(void* vmm, uintptr_t vaddr) {
 	mutex_acquire(&vmm_traps_mutex);
+	vmm_cow_unlink(vmm, vaddr);
+	mutex_release(&vmm_traps_mutex);
+}
 
-	size_t resolved_cnt = 0, resolved_maxcnt = 0; // TODO: something like a hashmap would be more appropriate here
-	uintptr_t* resolved = NULL; // resolved[3k] = vaddr, resolved[3k+1] = corresponding new source vmm, resolved[3k+2] = corresponding new source vaddr
-
-	for(size_t i = 0; i < vmm_traps_maxlen; i++) {
-		vmm_trap_t* trap = &vmm_traps[i];
-		if(trap->type == VMM_TRAP_NONE) continue;
-
-		/* resolve CoW orders */
-		if(trap->type == VMM_TRAP_COW && ((vmm_trap_t*)trap->info)->vmm == vmm) { // CoW order sourcing from vmm
-			bool done = false;
-			for(size_t j = 0; j < resolved_cnt; j++) { // check if it has been resolved before
-				if(resolved[j * 3] == trap->vaddr) {
-					void* dst_vmm = trap->vmm; uintptr_t dst_vaddr = trap->vaddr;
-					void* src_vmm = (void*)resolved[j * 3 + 1]; uintptr_t src_vaddr = resolved[j * 3 + 2];
-					size_t pgsz = vmm_get_pgsz(dst_vmm, dst_vaddr);
-					vmm_delete_trap((vmm_trap_t*)trap->info); vmm_delete_trap(trap); // delete old relation
-					if(pgsz == (size_t)-1) { // unmapped - nothing to do here
-						done = true;
-						break;
-					} else pgsz = vmm_pgsz(pgsz); // convert to bytes
-					if(!vmm_cow_setup(src_vmm, src_vaddr, dst_vmm, dst_vaddr, pgsz)) {
-						kerror("cannot set up new CoW relation: vmm:vaddr 0x%x:0x%x <-> 0x%x:0x%x", (uintptr_t)src_vmm, src_vaddr, (uintptr_t)dst_vmm, dst_vaddr);
-						mutex_release(&vmm_traps_mutex);
-						kfree(resolved);
-						return false;
-					}
-					done = true;
-					break;
-				}
-			}
-			if(done) continue;
-
-			/* first occurrence */
-			if(resolved_maxcnt == resolved_cnt) {
-				resolved_maxcnt += VMM_TRAP_ALLOCSZ;
-				resolved = krealloc(resolved, resolved_maxcnt * 3 * sizeof(uintptr_t));
-				if(!resolved) {
-					kerror("cannot allocate CoW resolution tracking table");
-					mutex_release(&vmm_traps_mutex);
-					return false;
-				}
-			}
-			void* dst_vmm = trap->vmm; uintptr_t dst_vaddr = trap->vaddr;
-			vmm_set_flags(dst_vmm, dst_vaddr, vmm_get_flags(dst_vmm, dst_vaddr) | VMM_FLAGS_RW); // destination now owns the frame
-			vmm_delete_trap((vmm_trap_t*)trap->info); vmm_delete_trap(trap);
-			resolved[resolved_cnt * 3] = trap->vaddr;
-			resolved[resolved_cnt * 3 + 1] = (uintptr_t)dst_vmm;
-			resolved[resolved_cnt * 3 + 2] = dst_vaddr;
-			resolved_cnt++;
-		}
-		else if(trap->vmm == vmm) { // traps targeting this vmm in general
-			vmm_delete_trap(trap);
-		}
-	}
-
-	kfree(resolved);
-
+bool vmm_trap_remove(void* vmm) {
+	mutex_acquire(&vmm_traps_mutex);
+	vmm_trap_list_t* list;
+	while((list = vmm_trap_list_get(vmm, false))) vmm_trap_unlink(list->head); // the list goes away along with its last trap
 	mutex_release(&vmm_traps_mutex);
 	return true;
 }
 
 bool vmm_handle_fault(uintptr_t vaddr, size_t flags) {
+#ifdef KHEAP_DEMAND_PAGING
+	if(!(flags & (VMM_FLAGS_PRESENT | VMM_FLAGS_USER)) && kheap_handle_fault(vaddr)) return true; // first touch of a heap page (checked before logging, since this is expected)
+#endif
+	if(!(flags & VMM_FLAGS_PRESENT) && vmm_anon_fault(vmm_current, vaddr)) return true; // first touch of an anonymous page (stack, BSS etc.)
 	kdebug("page fault on vaddr 0x%x (vmm_current = 0x%x), flags 0x%x", vaddr, vmm_current, flags);
 	if(flags & VMM_FLAGS_RW) {
 		/* write access caused this fault */
@@ -352,16 +587,9 @@ vmm_trap_t* vmm_is_cow(void* vmm, uintptr_t vaddr, bool validated) {
 	}
 
 	mutex_acquire(&vmm_traps_mutex);
-
-	for(size_t i = 0; i < vmm_traps_maxlen; i++) {
-		if(vmm_traps[i].type == VMM_TRAP_COW && vmm_traps[i].vmm == vmm && vmm_traps[i].vaddr == vaddr) {
-			mutex_release(&vmm_traps_mutex);
-			return &vmm_traps[i];
-		}
-	}
-
+	vmm_trap_t* trap = vmm_trap_find(vmm, vaddr, VMM_TRAP_COW);
 	mutex_release(&vmm_traps_mutex);
-	return NULL;
+	return trap;
 }
 
 /* deallocation staging */
@@ -408,3 +636,219 @@ void vmm_do_cleanup() {
 	}
 	mutex_release(&vmm_frstage_mutex);
 }
+
+#if defined(VMM_COW_BENCH) || defined(VMM_FORK_BENCH) || defined(VMM_HUGE_BENCH)
+#include <hal/timer.h>
+#endif
+
+#ifdef VMM_COW_BENCH
+
+#ifndef VMM_COW_BENCH_FAULTS
+#define VMM_COW_BENCH_FAULTS						256 // number of COW faults timed in each round
+#endif
+
+#ifndef VMM_COW_BENCH_MAX
+#define VMM_COW_BENCH_MAX							16384 // number of live COW pages in the last round (each round quadruples the previous one's; all rounds together must stay below the 16-bit frame reference count)
+#endif
+
+#define VMM_COW_BENCH_BASE							0x40000000 // where the pages are mapped in the benchmark's VMM configurations
+
+void vmm_cow_bench() {
+	size_t pgsz = vmm_pgsz(0), framesz = pmm_framesz();
+	size_t frame = pmm_alloc_free(pgsz / framesz); // every page shares this frame, so that the benchmark does not need much memory
+	void* src = vmm_clone(vmm_kernel, false);
+	if(frame == (size_t)-1 || !src) {
+		kerror("cannot set up COW benchmark");
+		if(src) vmm_free(src);
+		if(frame != (size_t)-1) pmm_free(frame);
+		return;
+	}
+
+	vmm_txn_t txn;
+	if(!vmm_txn_begin(&txn, src)) {
+		vmm_free(src); pmm_free(frame);
+		return;
+	}
+	for(size_t i = 0; i < VMM_COW_BENCH_MAX; i++) vmm_txn_pgmap(&txn, frame * framesz, VMM_COW_BENCH_BASE + i * pgsz, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_USER);
+	vmm_txn_commit(&txn);
+
+	for(size_t pages = VMM_COW_BENCH_FAULTS; pages <= VMM_COW_BENCH_MAX; pages <<= 2) {
+		void* dst = vmm_clone(vmm_kernel, false);
+		if(!dst) {
+			kerror("cannot create destination VMM configuration");
+			break;
+		}
+		size_t live = vmm_cow_setup(src, VMM_COW_BENCH_BASE, dst, VMM_COW_BENCH_BASE, pages * pgsz) / pgsz;
+
+		/* fault on pages spread evenly over the range, as the first write of a forked process would */
+		size_t stride = live / VMM_COW_BENCH_FAULTS, faults = 0;
+		timer_tick_t t_start = timer_tick;
+		for(size_t i = 0; stride && i < VMM_COW_BENCH_FAULTS; i++) {
+			if(vmm_cow_duplicate(dst, VMM_COW_BENCH_BASE + i * stride * pgsz, 0)) faults++;
+		}
+		timer_tick_t t_elapsed = timer_tick - t_start;
+		kinfo("vmm: %u COW fault(s) with %u live COW page(s) took %llu us (%llu ns each)", faults, live, (uint64_t) t_elapsed, (faults) ? ((uint64_t) t_elapsed * 1000 / faults) : 0);
+
+		/* give back the copies and drop the remaining orders */
+		for(size_t i = 0; stride && i < VMM_COW_BENCH_FAULTS; i++) {
+			uintptr_t va = VMM_COW_BENCH_BASE + i * stride * pgsz;
+			if(!vmm_is_cow(dst, va, true)) pmm_free(vmm_get_paddr(dst, va) / framesz);
+		}
+		vmm_free(dst);
+	}
+
+	vmm_free(src);
+	pmm_free(frame);
+}
+
+#endif
+
+#ifdef VMM_FORK_BENCH
+
+#ifndef VMM_FORK_BENCH_ITERS
+#define VMM_FORK_BENCH_ITERS						64 // number of forks timed for each process size
+#endif
+
+#ifndef VMM_FORK_BENCH_MAX
+#define VMM_FORK_BENCH_MAX							(64 << 20) // largest process size (each smaller one is a quarter of the next, down to 1M)
+#endif
+
+#define VMM_FORK_BENCH_BASE							0x40000000 // where the process' pages are mapped
+
+void vmm_fork_bench() {
+	size_t pgsz = vmm_pgsz(0), framesz = pmm_framesz();
+	size_t frame = pmm_alloc_free(pgsz / framesz); // every page shares this frame, so that the benchmark does not need much memory
+	void* src = vmm_clone(vmm_kernel, false);
+	if(frame == (size_t)-1 || !src) {
+		kerror("cannot set up fork benchmark");
+		if(src) vmm_free(src);
+		if(frame != (size_t)-1) pmm_free(frame);
+		return;
+	}
+
+	size_t mapped = 0; // bytes mapped into src so far
+	for(size_t size = (1 << 20); size <= VMM_FORK_BENCH_MAX; size <<= 2) {
+		/* grow the process */
+		vmm_txn_t txn;
+		if(!vmm_txn_begin(&txn, src)) break;
+		for(; mapped < size; mapped += pgsz) vmm_txn_pgmap(&txn, frame * framesz, VMM_FORK_BENCH_BASE + mapped, 0, VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_USER);
+		vmm_txn_commit(&txn);
+
+		/* fork (and tear down the child) repeatedly */
+		timer_tick_t t_clone = 0, t_free = 0;
+		size_t forks = 0;
+		for(; forks < VMM_FORK_BENCH_ITERS; forks++) {
+			timer_tick_t t_start = timer_tick;
+			void* dst = vmm_clone(src, true);
+			timer_tick_t t_mid = timer_tick;
+			if(!dst) {
+				kerror("cannot fork %u KiB process", size >> 10);
+				break;
+			}
+			vmm_free(dst);
+			t_clone += t_mid - t_start; t_free += timer_tick - t_mid;
+		}
+
+		/* the first write after a fork pays for the page table copy */
+		timer_tick_t t_write = 0;
+		void* dst = vmm_clone(src, true);
+		if(dst) {
+			timer_tick_t t_start = timer_tick;
+			bool ok = vmm_cow_duplicate(dst, VMM_FORK_BENCH_BASE, (size_t)-1);
+			t_write = timer_tick - t_start;
+			if(ok) pmm_free(vmm_get_paddr(dst, VMM_FORK_BENCH_BASE) / framesz); // the page's private copy
+			vmm_free(dst);
+		}
+
+		kinfo("vmm: %u KiB process: %u fork(s) took %llu us to clone and %llu us to free, first write took %llu us", size >> 10, forks, (uint64_t) t_clone, (uint64_t) t_free, (uint64_t) t_write);
+	}
+
+	vmm_free(src);
+	pmm_free(frame);
+}
+
+#endif
+
+#ifdef VMM_HUGE_BENCH
+
+#include <exec/task.h>
+
+#ifndef VMM_HUGE_BENCH_SIZE
+#define VMM_HUGE_BENCH_SIZE							(32 << 20) // size of the array (must be a power of two, and a multiple of the huge page size)
+#endif
+
+#ifndef VMM_HUGE_BENCH_PASSES
+#define VMM_HUGE_BENCH_PASSES						64 // number of times each page of the array is read in each run
+#endif
+
+#define VMM_HUGE_BENCH_STEP							1031 // pages between consecutive reads (odd, so that each pass visits every page once; large, so that prefetching does not help)
+#define VMM_HUGE_BENCH_BASE							0x40000000 // where the array is mapped
+
+/* reads one word from every page of the array in a scattered order, and returns how long that took */
+static timer_tick_t vmm_huge_bench_run(void* vmm, volatile size_t* sum) {
+	size_t pgsz = vmm_pgsz(0), pages = VMM_HUGE_BENCH_SIZE / pgsz;
+	void* vmm_old = vmm_current;
+	task_yield_block(); // a task switch would take us out of the benchmark's VMM configuration
+	vmm_switch(vmm);
+	timer_tick_t t_start = timer_tick;
+	for(size_t n = 0; n < VMM_HUGE_BENCH_PASSES; n++) {
+		for(size_t i = 0; i < pages; i++) {
+			size_t page = (i * VMM_HUGE_BENCH_STEP + n) & (pages - 1);
+			*sum += *(volatile size_t*) (VMM_HUGE_BENCH_BASE + page * pgsz + (page & 63) * sizeof(size_t));
+		}
+	}
+	timer_tick_t t_elapsed = timer_tick - t_start;
+	vmm_switch(vmm_old);
+	task_yield_unblock();
+	return t_elapsed;
+}
+
+void vmm_huge_bench() {
+	if(vmm_pgsz_num() < 2 || vmm_pgsz(1) != pmm_large_frames() * pmm_framesz()) {
+		kerror("huge pages cannot be backed by large blocks");
+		return;
+	}
+	size_t pgsz = vmm_pgsz(0), hpgsz = vmm_pgsz(1), framesz = pmm_framesz();
+	size_t blocks_num = VMM_HUGE_BENCH_SIZE / hpgsz;
+	size_t* blocks = kcalloc(blocks_num, sizeof(size_t));
+	void* small = vmm_clone(vmm_kernel, false);
+	void* huge = vmm_clone(vmm_kernel, false);
+	size_t got = 0;
+	if(blocks && small && huge) {
+		for(; got < blocks_num; got++) {
+			blocks[got] = pmm_alloc_large();
+			if(blocks[got] == (size_t)-1) break;
+		}
+	}
+	if(got < blocks_num) {
+		kerror("cannot set up huge page benchmark");
+		goto done;
+	}
+
+	/* map the same frames with small pages into one configuration and huge pages into the other, so that only the TLB footprint differs */
+	vmm_txn_t txn;
+	size_t flags = VMM_FLAGS_PRESENT | VMM_FLAGS_RW | VMM_FLAGS_USER | VMM_FLAGS_CACHE;
+	if(!vmm_txn_begin(&txn, small)) goto done;
+	for(size_t off = 0; off < VMM_HUGE_BENCH_SIZE; off += pgsz) vmm_txn_pgmap(&txn, blocks[off / hpgsz] * framesz + off % hpgsz, VMM_HUGE_BENCH_BASE + off, 0, flags);
+	vmm_txn_commit(&txn);
+	if(!vmm_txn_begin(&txn, huge)) goto done;
+	for(size_t i = 0; i < blocks_num; i++) vmm_txn_pgmap(&txn, blocks[i] * framesz, VMM_HUGE_BENCH_BASE + i * hpgsz, 1, flags);
+	vmm_txn_commit(&txn);
+
+	volatile size_t sum = 0;
+	vmm_huge_bench_run(small, &sum); vmm_huge_bench_run(huge, &sum); // warm up the caches and page tables
+	timer_tick_t t_small = vmm_huge_bench_run(small, &sum), t_huge = vmm_huge_bench_run(huge, &sum);
+	uint64_t reads = (uint64_t) VMM_HUGE_BENCH_PASSES * (VMM_HUGE_BENCH_SIZE / pgsz);
+	kinfo("vmm: %u KiB array, %llu scattered read(s): %llu us with small pages (%llu ps each), %llu us with huge pages (%llu ps each)", VMM_HUGE_BENCH_SIZE >> 10, reads, (uint64_t) t_small, (uint64_t) t_small * 1000000 / reads, (uint64_t) t_huge, (uint64_t) t_huge * 1000000 / reads);
+
+done:
+	/* the frames are not referenced by the mappings, so they can simply be unmapped along with the configurations */
+	if(small) vmm_free(small);
+	if(huge) vmm_free(huge);
+	for(size_t i = 0; i < got; i++) {
+		for(size_t j = 0; j < pmm_large_frames(); j++) pmm_free(blocks[i] + j);
+	}
+	kfree(blocks);
+}
+
+#endif
@@ -99,7 +99,8 @@ void vmm_init();
  *  Creates a new VMM configuration from the specified source.
  *  The cow parameter specifies whether frames mapped in userland
  *  address space shall be copy-on-write instead of being referenced
- *  in the new VMM configuration.
+ *  in the new VMM configuration. Copy-on-write may be set up on whole
+ *  page tables, which are only copied once either side modifies them.
  *  Returns NULL on failure.
  */
 void* vmm_clone(void* src, bool cow);
@@ -110,6 +111,14 @@ void* vmm_clone(void* src, bool cow);
  */
 void vmm_free(void* vmm);
 
+/*
+ * bool vmm_unshare(void* vmm, uintptr_t va)
+ *  Gives the specified VMM configuration its own copy of the page
+ *  table covering va, if vmm_clone() has left it shared copy-on-write
+ *  with other configurations. Returns true if a table was unshared.
+ */
+bool vmm_unshare(void* vmm, uintptr_t va);
+
 /*
  * bool vmm_get_dirty(void* vmm, uintptr_t va)
  *  Checks whether the page corresponding to the specified virtual
@@ -124,6 +133,60 @@ bool vmm_get_dirty(void* vmm, uintptr_t va);
  */
 void vmm_set_dirty(void* vmm, uintptr_t va, bool dirty);
 
+/* VMM transaction for batching page table changes (see vmm_txn_begin()) */
+typedef struct {
+    void* vmm; // VMM configuration being modified
+    void* pd; // page directory, mapped for the duration of the transaction
+    void* pt; // last page table accessed, kept mapped until another one is needed
+    size_t pt_idx; // page directory entry of pt
+    uintptr_t pt_paddr; // physical address of pt (to detect page tables being replaced behind our back)
+    uintptr_t flush_start; // first page to be invalidated from the TLB
+    uintptr_t flush_end; // last page to be invalidated from the TLB
+    size_t flush_pages; // number of pending invalidations (0 if there is nothing to invalidate)
+    bool flush_global; // set if global pages are to be invalidated
+} vmm_txn_t;
+
+/*
+ * bool vmm_txn_begin(vmm_txn_t* txn, void* vmm)
+ *  Starts a transaction on the specified VMM configuration. The page
+ *  directory (and the page tables as they are accessed) stay mapped,
+ *  and TLB invalidations are deferred until vmm_txn_commit().
+ *  Returns false if the page directory cannot be mapped.
+ */
+bool vmm_txn_begin(vmm_txn_t* txn, void* vmm);
+
+/*
+ * void vmm_txn_pgmap(vmm_txn_t* txn, uintptr_t pa, uintptr_t va, size_t pgsz_idx, size_t flags)
+ *  Transaction counterpart of vmm_pgmap().
+ */
+void vmm_txn_pgmap(vmm_txn_t* txn, uintptr_t pa, uintptr_t va, size_t pgsz_idx, size_t flags);
+
+/*
+ * void vmm_txn_pgunmap(vmm_txn_t* txn, uintptr_t va, size_t pgsz_idx)
+ *  Transaction counterpart of vmm_pgunmap().
+ */
+void vmm_txn_pgunmap(vmm_txn_t* txn, uintptr_t va, size_t pgsz_idx);
+
+/*
+ * void vmm_txn_set_flags(vmm_txn_t* txn, uintptr_t va, size_t flags)
+ *  Transaction counterpart of vmm_set_flags().
+ */
+void vmm_txn_set_flags(vmm_txn_t* txn, uintptr_t va, size_t flags);
+
+/*
+ * void vmm_txn_flush(vmm_txn_t* txn)
+ *  Performs the TLB invalidations queued up so far, either page by
+ *  page or with a full flush if there are too many of them. This must
+ *  be done before any unmapped frame is given away.
+ */
+void vmm_txn_flush(vmm_txn_t* txn);
+
+/*
+ * void vmm_txn_commit(vmm_txn_t* txn)
+ *  Flushes the TLB (see vmm_txn_flush()) and ends the transaction.
+ */
+void vmm_txn_commit(vmm_txn_t* txn);
+
 /* generic code */
 
 /*
@@ -153,6 +216,25 @@ uintptr_t vmm_map(void* vmm, uintptr_t pa, uintptr_t va, size_t sz, size_t pgsz_
  */
 void vmm_unmap(void* vmm, uintptr_t va, size_t sz);
 
+/*
+ * uintptr_t vmm_txn_map(vmm_txn_t* txn, uintptr_t pa, uintptr_t va, size_t sz, size_t pgsz_max_idx, size_t flags)
+ *  Transaction counterpart of vmm_map().
+ */
+uintptr_t vmm_txn_map(vmm_txn_t* txn, uintptr_t pa, uintptr_t va, size_t sz, size_t pgsz_max_idx, size_t flags);
+
+/*
+ * void vmm_txn_unmap(vmm_txn_t* txn, uintptr_t va, size_t sz)
+ *  Transaction counterpart of vmm_unmap().
+ */
+void vmm_txn_unmap(vmm_txn_t* txn, uintptr_t va, size_t sz);
+
+/*
+ * void vmm_txn_protect(vmm_txn_t* txn, uintptr_t va, size_t sz, size_t flags)
+ *  Sets the flags of all mapped pages in the sz byte(s) starting from
+ *  linear address va.
+ */
+void vmm_txn_protect(vmm_txn_t* txn, uintptr_t va, size_t sz, size_t flags);
+
 /*
  * uintptr_t vmm_first_free(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t sz, size_t align, bool reverse)
  *  Finds the first unmapped contiguous address space of size sz
@@ -161,11 +243,93 @@ void vmm_unmap(void* vmm, uintptr_t va, size_t sz);
  *  to find a space towards va_end. The virtual address' boundary
  *  alignment (which must be a multiple of the minimum page size)
  *  can also be specified; if not, align must be set to 0.
+ *  Free space is looked up in the address space regions (see
+ *  vmm_region_reserve()), so page tables are never walked.
  *  Returns the space's starting virtual address, or 0 if none
  *  can be found.
  */
 uintptr_t vmm_first_free(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t sz, size_t align, bool reverse);
 
+/*
+ * uintptr_t vmm_region_alloc(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t sz, size_t align, bool reverse)
+ *  Same as vmm_first_free(), but also reserves the space that has
+ *  been found.
+ */
+uintptr_t vmm_region_alloc(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t sz, size_t align, bool reverse);
+
+/*
+ * bool vmm_region_reserve(void* vmm, uintptr_t va, size_t sz)
+ *  Marks sz byte(s) starting from linear address va as in use, so
+ *  that vmm_first_free() does not return them. vmm_map() does this
+ *  by itself; code mapping pages at fixed addresses with vmm_pgmap()
+ *  must do it explicitly. Kernel space is shared between all VMM
+ *  configurations.
+ *  Returns false if memory for the bookkeeping cannot be allocated.
+ */
+bool vmm_region_reserve(void* vmm, uintptr_t va, size_t sz);
+
+/*
+ * void vmm_region_release(void* vmm, uintptr_t va, size_t sz)
+ *  Makes sz byte(s) starting from linear address va available again.
+ *  vmm_unmap() does this by itself.
+ */
+void vmm_region_release(void* vmm, uintptr_t va, size_t sz);
+
+/*
+ * bool vmm_region_clone(void* src, void* dst)
+ *  Copies the user space regions of src to dst. Called by
+ *  vmm_clone().
+ *  Returns false on failure.
+ */
+bool vmm_region_clone(void* src, void* dst);
+
+/*
+ * void vmm_region_destroy(void* vmm)
+ *  Deletes the user space regions of the specified VMM configuration.
+ *  Called by vmm_free().
+ */
+void vmm_region_destroy(void* vmm);
+
+/*
+ * bool vmm_anon_map(void* vmm, uintptr_t va, size_t sz, size_t flags)
+ *  Sets up sz byte(s) of user space starting from va as an anonymous
+ *  region: its pages are not mapped until first accessed, at which point
+ *  vmm_anon_fault() maps a zero-filled frame there with the specified
+ *  flags. The caller must have reserved the address space beforehand.
+ *  Returns false on failure.
+ */
+bool vmm_anon_map(void* vmm, uintptr_t va, size_t sz, size_t flags);
+
+/*
+ * bool vmm_anon_stack(void* vmm, uintptr_t top, size_t sz, size_t max_sz, size_t flags)
+ *  Same as vmm_anon_map() on the sz byte(s) right below top, but the
+ *  region also grows down on demand when the pages below it are touched,
+ *  until it reaches max_sz byte(s). The page below that is never mapped,
+ *  so that overflows fault instead of running into other mappings.
+ *  The caller must reserve max_sz byte(s) plus that guard page.
+ */
+bool vmm_anon_stack(void* vmm, uintptr_t top, size_t sz, size_t max_sz, size_t flags);
+
+/*
+ * void vmm_anon_unmap(void* vmm, uintptr_t va, size_t sz)
+ *  Unmaps sz byte(s) starting from va and drops the references to the
+ *  frames that were mapped there, then takes the range out of the
+ *  anonymous regions. The address space stays reserved.
+ */
+void vmm_anon_unmap(void* vmm, uintptr_t va, size_t sz);
+
+/*
+ * bool vmm_anon_fault(void* vmm, uintptr_t va)
+ *  Maps a zero-filled frame to the page containing va if it belongs to
+ *  (or can be grown into by) one of vmm's anonymous regions. Called by
+ *  vmm_handle_fault() on accesses to pages that are not present.
+ *  If the region covers the whole huge page around va and none of it
+ *  is mapped yet, a zero-filled huge page is mapped instead.
+ *  Returns false if va is not in an anonymous region, or if no frame
+ *  can be allocated.
+ */
+bool vmm_anon_fault(void* vmm, uintptr_t va);
+
 /*
  * uintptr_t vmm_alloc_map(void* vmm, uintptr_t pa, size_t sz, uintptr_t va_start, uintptr_t va_end, size_t va_align, size_t pgsz_max_idx, bool reverse, size_t flags) 
  *  Finds a contiguous address space sufficient for mapping the
@@ -178,16 +342,52 @@ uintptr_t vmm_first_free(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t
  */
 uintptr_t vmm_alloc_map(void* vmm, uintptr_t pa, size_t sz, uintptr_t va_start, uintptr_t va_end, size_t va_align, size_t pgsz_max_idx, bool reverse, size_t flags);
 
+/*
+ * void vmm_dmap_init()
+ *  Maps physical memory (as much of it as fits) into the kernel's
+ *  direct map region, and reserves the address space for vmm_kmap()
+ *  windows. Must be called after pmm_init() and vmm_init(), and before
+ *  any VMM configuration is cloned.
+ */
+void vmm_dmap_init();
+
+/*
+ * void* vmm_phys_to_virt(uintptr_t pa)
+ *  Returns the virtual address of pa in the direct map, or NULL if
+ *  pa is not covered by the direct map.
+ */
+void* vmm_phys_to_virt(uintptr_t pa);
+
+/*
+ * void* vmm_kmap(uintptr_t pa)
+ *  Returns a kernel virtual address through which the page containing
+ *  pa can be accessed in any VMM configuration: its direct map address,
+ *  or a temporary window if pa is not covered by the direct map.
+ *  The address must be released with vmm_kunmap() after use.
+ *  Returns NULL if no window is available (including before
+ *  vmm_dmap_init()).
+ */
+void* vmm_kmap(uintptr_t pa);
+
+/*
+ * void vmm_kunmap(void* ptr)
+ *  Releases an address returned by vmm_kmap().
+ */
+void vmm_kunmap(void* ptr);
+
 /* list of page traps (pages destined to cause a fault and to be handled by the kernel) */
 enum vmm_trap_type {
     VMM_TRAP_NONE = 0,
     VMM_TRAP_COW // copy-on-write page - info points to the page's source entry
 };
-typedef struct {
+typedef struct vmm_trap {
     enum vmm_trap_type type;
     void* vmm;
     uintptr_t vaddr;
     void* info;
+    struct vmm_trap* next; // next trap in the same hash bucket
+    struct vmm_trap* vmm_prev; // previous trap in the same VMM configuration
+    struct vmm_trap* vmm_next; // next trap in the same VMM configuration
 } vmm_trap_t;
 
 /*
@@ -198,22 +398,38 @@ typedef struct {
  */
 size_t vmm_cow_setup(void* vmm_src, uintptr_t vaddr_src, void* vmm_dst, uintptr_t vaddr_dst, size_t size);
 
+/*
+ * size_t vmm_cow_setup_txn(vmm_txn_t* txn_src, vmm_txn_t* txn_dst, uintptr_t vaddr_src, uintptr_t vaddr_dst, size_t size)
+ *  Same as vmm_cow_setup(), but as part of transactions on the source
+ *  and destination VMM configurations, so that many ranges can be set
+ *  up with a single TLB flush.
+ */
+size_t vmm_cow_setup_txn(vmm_txn_t* txn_src, vmm_txn_t* txn_dst, uintptr_t vaddr_src, uintptr_t vaddr_dst, size_t size);
+
 /*
  * bool vmm_cow_duplicate(void* vmm, uintptr_t vaddr, size_t pgsz)
  *  Resolves the COW order on the specified page if it has one.
+ *  The page is only copied if its frame(s) are still referenced by
+ *  someone else; otherwise, vmm simply gets write access back.
  *  The pgsz parameter allows the caller to pre-specify the page's
  *  size index (see vmm_pgsz); if this is set to -1, the function will 
  *  call vmm_get_pgsz() to find out the actual page size.
  */
 bool vmm_cow_duplicate(void* vmm, uintptr_t vaddr, size_t pgsz);
 
+/*
+ * void vmm_cow_release(void* vmm, uintptr_t vaddr)
+ *  Drops the COW orders on the specified page without resolving them.
+ *  This is to be called when the page is unmapped; the caller is still
+ *  responsible for dropping its reference to the page's frame(s).
+ */
+void vmm_cow_release(void* vmm, uintptr_t vaddr);
+
 /*
  * bool vmm_trap_remove(void* vmm)
- *  Removes the specified VMM structure's relations in the traps list.
- *  This includes the following:
- *   - Resolving the first CoW order of each address whose source is vmm
- *     and pointing any subsequent order to that VMM structure.
- *   - Deleting traps that apply on vmm.
+ *  Deletes all traps that apply on the specified VMM structure. Pages
+ *  it shares copy-on-write with others are resolved by the other side
+ *  on its next write, based on the frames' reference counts.
  *  This function is to be called by vmm_free before deallocating vmm,
  *  and wil return true on success.
  */
@@ -225,6 +441,7 @@ bool vmm_trap_remove(void* vmm);
  *  The validated flag indicates whether the address is guaranteed
  *  to be mapped and aligned to its page size.
  *  Returns the first CoW trap entry found, or NULL if there's none.
+ *  The entry is freed once its CoW order is resolved.
  */
 vmm_trap_t* vmm_is_cow(void* vmm, uintptr_t vaddr, bool validated);
 
@@ -253,4 +470,34 @@ void vmm_stage_free(void* vmm);
  */
 void vmm_do_cleanup();
 
+#ifdef VMM_COW_BENCH
+/*
+ * void vmm_cow_bench()
+ *  Sets up increasing numbers of live COW pages between two VMM
+ *  configurations, and logs how long it takes to resolve a fixed
+ *  number of COW faults with each of them.
+ */
+void vmm_cow_bench();
+#endif
+
+#ifdef VMM_FORK_BENCH
+/*
+ * void vmm_fork_bench()
+ *  Forks VMM configurations of increasing sizes repeatedly, and logs
+ *  how long cloning and freeing them takes, as well as the cost of
+ *  the first write into the child.
+ */
+void vmm_fork_bench();
+#endif
+
+#ifdef VMM_HUGE_BENCH
+/*
+ * void vmm_huge_bench()
+ *  Maps the same large array with small pages and with huge pages,
+ *  and logs how long scattered reads over it take with each, which
+ *  shows the cost of the TLB misses that huge pages avoid.
+ */
+void vmm_huge_bench();
+#endif
+
 #endif
@@ -0,0 +1,655 @@
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <mm/addr.h>
+#include <mm/slab.h>
+#include <kernel/log.h>
+#include <helpers/mutex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef VMM_REGION_POOL
+#define VMM_REGION_POOL							128 // number of statically allocated extents (used until they run out, so that early boot does not depend on the kernel heap)
+#endif
+
+#ifndef VMM_SPACE_BUCKETS
+#define VMM_SPACE_BUCKETS						64 // number of buckets in the VMM configuration to address space hash table (must be a power of two)
+#endif
+
+#ifndef VMM_ANON_GROW_PAGES
+#define VMM_ANON_GROW_PAGES						16 // number of pages below a stack region in which faults grow it (anything further down is treated as an overflow)
+#endif
+
+/* linker script regions that are never handed out */
+extern uintptr_t __dmap_start;
+extern uintptr_t __dmap_end;
+extern uintptr_t __kheap_start;
+extern uintptr_t __kheap_end;
+
+/* free extent - each address space is an AVL tree of these, sorted by address */
+typedef struct vmm_extent {
+	struct vmm_extent* left;
+	struct vmm_extent* right;
+	uintptr_t start; // first address of the extent
+	uintptr_t end; // address right after the extent
+	size_t max; // size of the largest extent in the subtree
+	size_t height; // height of the subtree
+} vmm_extent_t;
+
+/* anonymous region - a range of user space whose pages are only mapped when first accessed */
+typedef struct vmm_anon {
+	uintptr_t start; // first address of the region
+	uintptr_t end; // address right after the region
+	uintptr_t limit; // lowest address the region can grow down to (start if it does not grow)
+	size_t flags; // flags of the pages mapped in the region
+	bool huge; // set while faults in the region may be backed by huge pages (cleared once a large block cannot be allocated)
+	struct vmm_anon* next;
+} vmm_anon_t;
+
+/* address space - either the user space of a VMM configuration, or the kernel space shared by all of them */
+typedef struct vmm_space {
+	void* vmm;
+	vmm_extent_t* root;
+	uintptr_t lo; // lowest address that can be handed out
+	uintptr_t hi; // address right after the highest address that can be handed out
+	vmm_anon_t* anon; // anonymous regions (user space only)
+	struct vmm_space* next; // next space in the hash bucket
+} vmm_space_t;
+
+static vmm_extent_t vmm_extent_pool[VMM_REGION_POOL];
+static size_t vmm_extent_pool_used = 0; // number of pool extents that have ever been handed out
+static vmm_extent_t* vmm_extent_free = NULL; // returned pool extents (linked through left)
+static kmem_cache_t* vmm_extent_cache = NULL;
+
+static vmm_space_t* vmm_spaces[VMM_SPACE_BUCKETS];
+static vmm_space_t vmm_space_kernel = {0};
+static mutex_t vmm_regions_mutex = {0};
+
+#define vmm_space_hash(vmm)						(((uintptr_t)(vmm) >> 12) & (VMM_SPACE_BUCKETS - 1))
+
+/* extent allocation - these must be called with vmm_regions_mutex held */
+
+static vmm_extent_t* vmm_extent_alloc() {
+	if(vmm_extent_free) {
+		vmm_extent_t* ext = vmm_extent_free;
+		vmm_extent_free = ext->left;
+		return ext;
+	}
+	if(vmm_extent_pool_used < VMM_REGION_POOL) return &vmm_extent_pool[vmm_extent_pool_used++];
+
+	if(!vmm_extent_cache) {
+		vmm_extent_cache = kmem_cache_create("vmm_extent", sizeof(vmm_extent_t), 0, NULL);
+		if(!vmm_extent_cache) {
+			kerror("cannot create extent cache");
+			return NULL;
+		}
+	}
+	vmm_extent_t* ext = kmem_cache_alloc(vmm_extent_cache);
+	if(!ext) kerror("cannot allocate memory for extent");
+	return ext;
+}
+
+static void vmm_extent_dealloc(vmm_extent_t* ext) {
+	if(ext >= vmm_extent_pool && ext < &vmm_extent_pool[VMM_REGION_POOL]) {
+		ext->left = vmm_extent_free;
+		vmm_extent_free = ext;
+	} else kmem_cache_free(vmm_extent_cache, ext);
+}
+
+/* AVL tree operations */
+
+#define vmm_extent_height(ext)					((ext) ? (ext)->height : 0)
+#define vmm_extent_max(ext)						((ext) ? (ext)->max : 0)
+
+static void vmm_extent_update(vmm_extent_t* ext) {
+	size_t hl = vmm_extent_height(ext->left), hr = vmm_extent_height(ext->right);
+	ext->height = ((hl > hr) ? hl : hr) + 1;
+	size_t max = ext->end - ext->start;
+	if(vmm_extent_max(ext->left) > max) max = ext->left->max;
+	if(vmm_extent_max(ext->right) > max) max = ext->right->max;
+	ext->max = max;
+}
+
+static vmm_extent_t* vmm_extent_rotate_right(vmm_extent_t* ext) {
+	vmm_extent_t* top = ext->left;
+	ext->left = top->right;
+	top->right = ext;
+	vmm_extent_update(ext);
+	vmm_extent_update(top);
+	return top;
+}
+
+static vmm_extent_t* vmm_extent_rotate_left(vmm_extent_t* ext) {
+	vmm_extent_t* top = ext->right;
+	ext->right = top->left;
+	top->left = ext;
+	vmm_extent_update(ext);
+	vmm_extent_update(top);
+	return top;
+}
+
+static vmm_extent_t* vmm_extent_balance(vmm_extent_t* ext) {
+	vmm_extent_update(ext);
+	size_t hl = vmm_extent_height(ext->left), hr = vmm_extent_height(ext->right);
+	if(hl > hr + 1) {
+		if(vmm_extent_height(ext->left->left) < vmm_extent_height(ext->left->right)) ext->left = vmm_extent_rotate_left(ext->left);
+		return vmm_extent_rotate_right(ext);
+	}
+	if(hr > hl + 1) {
+		if(vmm_extent_height(ext->right->right) < vmm_extent_height(ext->right->left)) ext->right = vmm_extent_rotate_right(ext->right);
+		return vmm_extent_rotate_left(ext);
+	}
+	return ext;
+}
+
+static vmm_extent_t* vmm_extent_insert(vmm_extent_t* root, vmm_extent_t* ext) {
+	if(!root) {
+		ext->left = NULL; ext->right = NULL;
+		vmm_extent_update(ext);
+		return ext;
+	}
+	if(ext->start < root->start) root->left = vmm_extent_insert(root->left, ext);
+	else root->right = vmm_extent_insert(root->right, ext);
+	return vmm_extent_balance(root);
+}
+
+static vmm_extent_t* vmm_extent_remove_min(vmm_extent_t* root, vmm_extent_t** min) {
+	if(!root->left) {
+		*min = root;
+		return root->right;
+	}
+	root->left = vmm_extent_remove_min(root->left, min);
+	return vmm_extent_balance(root);
+}
+
+/* unlinks the extent starting at start from the tree (without deallocating it) */
+static vmm_extent_t* vmm_extent_remove(vmm_extent_t* root, uintptr_t start) {
+	if(!root) return NULL;
+	if(start < root->start) root->left = vmm_extent_remove(root->left, start);
+	else if(start > root->start) root->right = vmm_extent_remove(root->right, start);
+	else {
+		vmm_extent_t* left = root->left;
+		vmm_extent_t* right = root->right;
+		if(!right) return left;
+		vmm_extent_t* min;
+		right = vmm_extent_remove_min(right, &min);
+		min->left = left; min->right = right;
+		return vmm_extent_balance(min);
+	}
+	return vmm_extent_balance(root);
+}
+
+/* finds any extent overlapping [start, end) */
+static vmm_extent_t* vmm_extent_find(vmm_extent_t* ext, uintptr_t start, uintptr_t end) {
+	while(ext) {
+		if(ext->end <= start) ext = ext->right;
+		else if(ext->start >= end) ext = ext->left;
+		else return ext;
+	}
+	return NULL;
+}
+
+/* returns the lowest (or highest if reverse is set) address of a block of sz bytes aligned to align within both ext and [lo, hi), or 0 if there is none */
+static uintptr_t vmm_extent_fit(vmm_extent_t* ext, uintptr_t lo, uintptr_t hi, size_t sz, size_t align, bool reverse) {
+	uintptr_t start = (ext->start > lo) ? ext->start : lo;
+	uintptr_t end = (ext->end < hi) ? ext->end : hi;
+	if(end <= start || end - start < sz) return 0;
+	if(reverse) {
+		uintptr_t ret = end - sz;
+		if(align) ret -= ret % align;
+		return (ret >= start) ? ret : 0;
+	}
+	if(align && start % align) {
+		if(align - start % align > end - start - sz) return 0;
+		start += align - start % align;
+	}
+	return start;
+}
+
+/* first-fit search, skipping subtrees without a big enough extent and those outside of [lo, hi) */
+static uintptr_t vmm_extent_search(vmm_extent_t* ext, uintptr_t lo, uintptr_t hi, size_t sz, size_t align, bool reverse) {
+	if(!ext || ext->max < sz) return 0;
+	uintptr_t ret;
+	if(!reverse) {
+		if(ext->start > lo && (ret = vmm_extent_search(ext->left, lo, hi, sz, align, false))) return ret;
+		if((ret = vmm_extent_fit(ext, lo, hi, sz, align, false))) return ret;
+		return (ext->end < hi) ? vmm_extent_search(ext->right, lo, hi, sz, align, false) : 0;
+	} else {
+		if(ext->end < hi && (ret = vmm_extent_search(ext->right, lo, hi, sz, align, true))) return ret;
+		if((ret = vmm_extent_fit(ext, lo, hi, sz, align, true))) return ret;
+		return (ext->start > lo) ? vmm_extent_search(ext->left, lo, hi, sz, align, true) : 0;
+	}
+}
+
+static vmm_extent_t* vmm_extent_copy(vmm_extent_t* src, bool* ok) {
+	if(!src) return NULL;
+	vmm_extent_t* ext = vmm_extent_alloc();
+	if(!ext) {
+		*ok = false;
+		return NULL;
+	}
+	memcpy(ext, src, sizeof(vmm_extent_t));
+	ext->left = vmm_extent_copy(src->left, ok);
+	ext->right = vmm_extent_copy(src->right, ok);
+	return ext;
+}
+
+static void vmm_extent_destroy(vmm_extent_t* ext) {
+	if(!ext) return;
+	vmm_extent_destroy(ext->left);
+	vmm_extent_destroy(ext->right);
+	vmm_extent_dealloc(ext);
+}
+
+static vmm_anon_t* vmm_anon_copy(vmm_anon_t* src, bool* ok) {
+	vmm_anon_t* head = NULL;
+	for(vmm_anon_t** link = &head; src; src = src->next, link = &(*link)->next) {
+		*link = kmalloc(sizeof(vmm_anon_t));
+		if(!*link) {
+			*ok = false;
+			break;
+		}
+		memcpy(*link, src, sizeof(vmm_anon_t));
+		(*link)->next = NULL;
+	}
+	return head;
+}
+
+static void vmm_anon_destroy(vmm_anon_t* anon) {
+	while(anon) {
+		vmm_anon_t* next = anon->next;
+		kfree(anon);
+		anon = next;
+	}
+}
+
+/* address space operations - these must be called with vmm_regions_mutex held */
+
+/* takes [start, end) out of the space's free extents */
+static bool vmm_space_carve(vmm_space_t* space, uintptr_t start, uintptr_t end) {
+	vmm_extent_t* ext;
+	while((ext = vmm_extent_find(space->root, start, end))) {
+		space->root = vmm_extent_remove(space->root, ext->start);
+
+		/* put back whatever is left on either side */
+		uintptr_t ext_start = ext->start, ext_end = ext->end;
+		vmm_extent_t* rest = NULL;
+		if(ext_start < start && ext_end > end) {
+			rest = vmm_extent_alloc(); // extent is split in two
+			if(!rest) {
+				space->root = vmm_extent_insert(space->root, ext);
+				return false;
+			}
+		}
+		if(ext_start < start) {
+			ext->end = start;
+			space->root = vmm_extent_insert(space->root, ext);
+			ext = rest;
+		}
+		if(ext_end > end) {
+			ext->start = end; ext->end = ext_end;
+			space->root = vmm_extent_insert(space->root, ext);
+			ext = NULL;
+		}
+		if(ext) vmm_extent_dealloc(ext);
+	}
+	return true;
+}
+
+/* gives [start, end) back to the space's free extents, merging it with its neighbours */
+static void vmm_space_free(vmm_space_t* space, uintptr_t start, uintptr_t end) {
+	if(!vmm_space_carve(space, start, end)) return; // the range cannot be partially free after this
+	vmm_extent_t* prev = vmm_extent_find(space->root, start - 1, start);
+	vmm_extent_t* next = vmm_extent_find(space->root, end, end + 1);
+	vmm_extent_t* ext = NULL;
+	if(prev) {
+		space->root = vmm_extent_remove(space->root, prev->start);
+		start = prev->start;
+		ext = prev;
+	}
+	if(next) {
+		space->root = vmm_extent_remove(space->root, next->start);
+		end = next->end;
+		if(ext) vmm_extent_dealloc(next);
+		else ext = next;
+	}
+	if(!ext) ext = vmm_extent_alloc();
+	if(!ext) {
+		kerror("cannot release address space 0x%x-0x%x", start, end - 1);
+		return;
+	}
+	ext->start = start; ext->end = end;
+	space->root = vmm_extent_insert(space->root, ext);
+}
+
+static bool vmm_space_init(vmm_space_t* space, void* vmm, uintptr_t lo, uintptr_t hi) {
+	space->vmm = vmm;
+	space->lo = lo; space->hi = hi;
+	space->anon = NULL;
+	space->root = vmm_extent_alloc();
+	if(!space->root) return false;
+	space->root->start = lo; space->root->end = hi;
+	space->root = vmm_extent_insert(NULL, space->root);
+	return true;
+}
+
+/* retrieves the address space covering va (the kernel space, or vmm's user space) */
+static vmm_space_t* vmm_space_get(void* vmm, uintptr_t va, bool create) {
+	size_t pgsz = vmm_pgsz(0);
+	if(va >= kernel_start) {
+		if(!vmm_space_kernel.root) {
+			/* everything between the kernel image and the top page is up for grabs, except for the regions set aside in the linker script */
+			if(!vmm_space_init(&vmm_space_kernel, NULL, (kernel_end + pgsz - 1) / pgsz * pgsz, UINTPTR_MAX - pgsz + 1)) return NULL;
+			vmm_space_carve(&vmm_space_kernel, (uintptr_t) &__dmap_start, (uintptr_t) &__dmap_end);
+			vmm_space_carve(&vmm_space_kernel, (uintptr_t) &__kheap_start, (uintptr_t) &__kheap_end);
+		}
+		return &vmm_space_kernel;
+	}
+
+	size_t bucket = vmm_space_hash(vmm);
+	for(vmm_space_t* space = vmm_spaces[bucket]; space; space = space->next) {
+		if(space->vmm == vmm) return space;
+	}
+	if(!create) return NULL;
+
+	vmm_space_t* space = kmalloc(sizeof(vmm_space_t));
+	if(!space) {
+		kerror("cannot allocate memory for address space of VMM 0x%x", (uintptr_t) vmm);
+		return NULL;
+	}
+	if(!vmm_space_init(space, vmm, pgsz, kernel_start)) { // the first page is left out to catch null pointers
+		kfree(space);
+		return NULL;
+	}
+	space->next = vmm_spaces[bucket];
+	vmm_spaces[bucket] = space;
+	return space;
+}
+
+/* takes [start, end) out of the space's anonymous regions */
+static bool vmm_space_anon_trim(vmm_space_t* space, uintptr_t start, uintptr_t end) {
+	vmm_anon_t** link = &space->anon;
+	while(*link) {
+		vmm_anon_t* anon = *link;
+		if(anon->end <= start || anon->limit >= end) {
+			link = &anon->next; // no overlap (the room a stack region can grow into counts as part of it)
+			continue;
+		}
+		if(end >= anon->end && (start <= anon->limit || (start <= anon->start && end > anon->start))) {
+			/* range covers the whole region (or at least all of its pages) */
+			*link = anon->next;
+			kfree(anon);
+			continue;
+		}
+		if(end <= anon->start) anon->limit = end; // range only takes away room the region could grow into
+		else if(start <= anon->start) anon->start = anon->limit = end; // range covers the bottom of the region, which can no longer grow
+		else if(end >= anon->end) anon->end = start; // range covers the top of the region
+		else {
+			/* range is in the middle of the region - split it in two */
+			vmm_anon_t* upper = kmalloc(sizeof(vmm_anon_t));
+			if(!upper) return false;
+			upper->start = upper->limit = end; upper->end = anon->end;
+			upper->flags = anon->flags; upper->huge = anon->huge;
+			upper->next = anon->next;
+			anon->next = upper;
+			anon->end = start;
+		}
+		link = &anon->next;
+	}
+	return true;
+}
+
+/* applies a reservation or release of [start, stop) to the part of it that lies within the space */
+static bool vmm_space_update(vmm_space_t* space, uintptr_t start, uintptr_t stop, bool release) {
+	if(start < space->lo) start = space->lo;
+	if(stop > space->hi) stop = space->hi;
+	if(start >= stop) return true; // nothing to do
+	if(release) {
+		vmm_space_free(space, start, stop);
+		return true;
+	}
+	return vmm_space_carve(space, start, stop);
+}
+
+/* applies a reservation or release of [va, va + sz) to the user and kernel spaces it spans */
+static bool vmm_region_update(void* vmm, uintptr_t va, size_t sz, bool release) {
+	if(!sz) return true;
+	size_t pgsz = vmm_pgsz(0);
+	uintptr_t last = va + (sz - 1); // last byte of the range (va + sz may wrap around)
+	va -= va % pgsz;
+	last |= pgsz - 1;
+
+	bool ok = true;
+	mutex_acquire(&vmm_regions_mutex);
+	if(va < kernel_start) {
+		vmm_space_t* space = vmm_space_get(vmm, 0, true);
+		ok = (space && vmm_space_update(space, va, (last < kernel_start) ? last + 1 : kernel_start, release));
+	}
+	if(ok && last >= kernel_start) {
+		vmm_space_t* space = vmm_space_get(vmm, kernel_start, true);
+		ok = (space && vmm_space_update(space, va, (last < space->hi) ? last + 1 : space->hi, release));
+	}
+	mutex_release(&vmm_regions_mutex);
+	return ok;
+}
+
+bool vmm_region_reserve(void* vmm, uintptr_t va, size_t sz) {
+	return vmm_region_update(vmm, va, sz, false);
+}
+
+void vmm_region_release(void* vmm, uintptr_t va, size_t sz) {
+	vmm_region_update(vmm, va, sz, true);
+}
+
+/* looks for space in [va_start, va_end) (and takes it out if reserve is set), going through the user and kernel spaces in the order of the search */
+static uintptr_t vmm_region_find(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t sz, size_t align, bool reverse, bool reserve) {
+	size_t pgsz = vmm_pgsz(0);
+	if(va_start % pgsz) va_start += pgsz - va_start % pgsz;
+	va_end -= va_end % pgsz;
+	if(sz % pgsz) sz += pgsz - sz % pgsz;
+	if(!sz || va_start >= va_end) return 0;
+
+	uintptr_t result = 0;
+	mutex_acquire(&vmm_regions_mutex);
+	for(size_t i = 0; i < 2 && !result; i++) {
+		bool kernel = ((i == 0) == reverse); // forward searches start from user space, reverse ones from kernel space
+		if(kernel && va_end <= kernel_start) continue;
+		if(!kernel && va_start >= kernel_start) continue;
+		vmm_space_t* space = vmm_space_get(vmm, (kernel) ? kernel_start : 0, true);
+		if(!space) break;
+		result = vmm_extent_search(space->root, (va_start > space->lo) ? va_start : space->lo, (va_end < space->hi) ? va_end : space->hi, sz, align, reverse);
+		if(result && reserve && !vmm_space_carve(space, result, result + sz)) result = 0;
+	}
+	mutex_release(&vmm_regions_mutex);
+	return result;
+}
+
+uintptr_t vmm_first_free(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t sz, size_t align, bool reverse) {
+	return vmm_region_find(vmm, va_start, va_end, sz, align, reverse, false);
+}
+
+uintptr_t vmm_region_alloc(void* vmm, uintptr_t va_start, uintptr_t va_end, size_t sz, size_t align, bool reverse) {
+	return vmm_region_find(vmm, va_start, va_end, sz, align, reverse, true);
+}
+
+bool vmm_region_clone(void* src, void* dst) {
+	bool ok = true;
+	mutex_acquire(&vmm_regions_mutex);
+	vmm_space_t* space_src = vmm_space_get(src, 0, false);
+	vmm_space_t* space_dst = vmm_space_get(dst, 0, true);
+	if(!space_dst) ok = false;
+	else if(space_src) {
+		vmm_extent_destroy(space_dst->root);
+		space_dst->root = vmm_extent_copy(space_src->root, &ok);
+		if(!ok) {
+			vmm_extent_destroy(space_dst->root);
+			space_dst->root = NULL;
+		}
+		vmm_anon_destroy(space_dst->anon);
+		space_dst->anon = (ok) ? vmm_anon_copy(space_src->anon, &ok) : NULL; // lazily mapped pages stay lazy in the clone
+	}
+	mutex_release(&vmm_regions_mutex);
+	if(!ok) vmm_region_destroy(dst);
+	return ok;
+}
+
+void vmm_region_destroy(void* vmm) {
+	mutex_acquire(&vmm_regions_mutex);
+	vmm_space_t** link = &vmm_spaces[vmm_space_hash(vmm)];
+	while(*link && (*link)->vmm != vmm) link = &(*link)->next;
+	vmm_space_t* space = *link;
+	if(space) {
+		*link = space->next;
+		vmm_extent_destroy(space->root);
+		vmm_anon_destroy(space->anon);
+	}
+	mutex_release(&vmm_regions_mutex);
+	kfree(space);
+}
+
+/* registers [start, end) as an anonymous region that can grow down to limit, replacing whatever anonymous regions were there */
+static bool vmm_anon_add(void* vmm, uintptr_t start, uintptr_t end, uintptr_t limit, size_t flags) {
+	if(limit < vmm_pgsz(0) || end > kernel_start) {
+		kerror("anonymous region 0x%x-0x%x is not in user space", limit, end);
+		return false;
+	}
+	vmm_anon_t* anon = kmalloc(sizeof(vmm_anon_t));
+	if(!anon) {
+		kerror("cannot allocate memory for anonymous region");
+		return false;
+	}
+	anon->start = start; anon->end = end; anon->limit = limit;
+	anon->flags = flags & ~VMM_FLAGS_PRESENT;
+	anon->huge = true;
+
+	mutex_acquire(&vmm_regions_mutex);
+	vmm_space_t* space = vmm_space_get(vmm, 0, true);
+	bool ok = (space && vmm_space_anon_trim(space, limit, end));
+	if(ok) {
+		anon->next = space->anon;
+		space->anon = anon;
+	}
+	mutex_release(&vmm_regions_mutex);
+	if(!ok) kfree(anon);
+	return ok;
+}
+
+bool vmm_anon_map(void* vmm, uintptr_t va, size_t sz, size_t flags) {
+	size_t pgsz = vmm_pgsz(0);
+	uintptr_t end = va + sz;
+	va -= va % pgsz;
+	if(end % pgsz) end += pgsz - end % pgsz;
+	if(va >= end) return true; // nothing to do
+	return vmm_anon_add(vmm, va, end, va, flags);
+}
+
+bool vmm_anon_stack(void* vmm, uintptr_t top, size_t sz, size_t max_sz, size_t flags) {
+	size_t pgsz = vmm_pgsz(0);
+	top -= top % pgsz;
+	if(sz % pgsz) sz += pgsz - sz % pgsz;
+	if(max_sz % pgsz) max_sz += pgsz - max_sz % pgsz;
+	if(max_sz < sz) max_sz = sz;
+	if(!max_sz) return true; // nothing to do
+	if(max_sz >= top) {
+		kerror("stack region of %u bytes does not fit below 0x%x", max_sz, top);
+		return false;
+	}
+	return vmm_anon_add(vmm, top - sz, top, top - max_sz, flags);
+}
+
+void vmm_anon_unmap(void* vmm, uintptr_t va, size_t sz) {
+	size_t pgsz = vmm_pgsz(0), framesz = pmm_framesz();
+	uintptr_t end = va + sz;
+	va -= va % pgsz;
+	if(end % pgsz) end += pgsz - end % pgsz;
+
+	/* stop faults from bringing pages back first */
+	if(va < kernel_start) {
+		mutex_acquire(&vmm_regions_mutex);
+		vmm_space_t* space = vmm_space_get(vmm, 0, false);
+		if(space && !vmm_space_anon_trim(space, va, end)) kerror("cannot split anonymous region at 0x%x-0x%x", va, end);
+		mutex_release(&vmm_regions_mutex);
+	}
+
+	/* then drop whatever has been mapped in the range */
+	for(uintptr_t addr = va; addr < end; ) {
+		size_t pgsz_idx = vmm_get_pgsz(vmm, addr);
+		if(pgsz_idx == (size_t)-1) {
+			addr += pgsz; // never touched
+			continue;
+		}
+		size_t page_sz = vmm_pgsz(pgsz_idx);
+		uintptr_t page = addr - addr % page_sz;
+		if(page < va || page + page_sz > end) {
+			/* huge page sticks out of the range - split it and only drop the small pages inside */
+			if(vmm_get_flags(vmm, page) & VMM_FLAGS_TRAPPED) vmm_cow_duplicate(vmm, page, pgsz_idx); // the pages left behind must not stay writable over shared frames
+			pgsz_idx = 0; page_sz = pgsz; page = addr;
+		}
+		uintptr_t paddr = vmm_get_paddr(vmm, page);
+		vmm_pgunmap(vmm, page, pgsz_idx);
+		for(size_t i = 0; i < page_sz / framesz; i++) pmm_page_unref(paddr / framesz + i);
+		addr = page + page_sz;
+	}
+}
+
+/* backs the whole huge page around va with a large block of frames if the region covers it and none of it is mapped yet; must be called with vmm_regions_mutex held */
+static bool vmm_anon_fault_huge(void* vmm, vmm_anon_t* anon, uintptr_t va) {
+	size_t framesz = pmm_framesz(), blksz = pmm_large_frames();
+	if(!anon->huge || vmm_pgsz_num() < 2 || vmm_pgsz(1) != blksz * framesz) return false;
+	size_t pgsz = vmm_pgsz(1);
+	uintptr_t page = va - va % pgsz;
+	if(page < anon->start || anon->end - page < pgsz) return false; // region only covers part of the huge page
+	for(uintptr_t addr = page; addr < page + pgsz; addr += vmm_pgsz(0)) {
+		if(vmm_get_pgsz(vmm, addr) != (size_t)-1) return false; // the rest of the huge page is filled in with small pages
+	}
+
+	size_t block = pmm_alloc_large();
+	if(block == (size_t)-1) {
+		anon->huge = false; // don't go through compaction again on every fault
+		return false;
+	}
+	for(size_t i = 0; i < blksz; i++) {
+		void* ptr = vmm_kmap((block + i) * framesz);
+		if(!ptr) {
+			kerror("cannot map frame %u for zeroing", block + i);
+			for(size_t j = 0; j < blksz; j++) pmm_page_unref(block + j);
+			return false;
+		}
+		memset(ptr, 0, framesz);
+		vmm_kunmap(ptr);
+	}
+	vmm_pgmap(vmm, block * framesz, page, 1, anon->flags | VMM_FLAGS_PRESENT);
+	pmm_page_mark(block, blksz, PMM_PAGE_USER, vmm); // not movable, since migration only remaps single pages
+	return true;
+}
+
+bool vmm_anon_fault(void* vmm, uintptr_t va) {
+	if(va >= kernel_start) return false;
+	size_t pgsz = vmm_pgsz(0);
+	va -= va % pgsz;
+
+	bool ok = false;
+	mutex_acquire(&vmm_regions_mutex);
+	vmm_space_t* space = vmm_space_get(vmm, 0, false);
+	vmm_anon_t* anon = (space) ? space->anon : NULL;
+	for(; anon; anon = anon->next) {
+		if(va >= anon->start && va < anon->end) break;
+		if(va < anon->start && va >= anon->limit && anon->start - va <= VMM_ANON_GROW_PAGES * pgsz) {
+			anon->start = va; // grow the stack region down to the faulting page
+			break;
+		}
+	}
+	if(anon) {
+		if(vmm_get_pgsz(vmm, va) != (size_t)-1) ok = true; // another task sharing the VMM got here first
+		else if(vmm_anon_fault_huge(vmm, anon, va)) ok = true;
+		else {
+			size_t frame = pmm_alloc_free_flags(1, PMM_ZEROED);
+			if(frame != (size_t)-1) {
+				vmm_pgmap(vmm, frame * pgsz, va, 0, anon->flags | VMM_FLAGS_PRESENT);
+				pmm_page_map(frame, PMM_PAGE_USER, vmm, va); // frames only referenced by their mapping can be migrated
+				ok = true;
+			} else kerror("cannot allocate frame for anonymous page 0x%x", va);
+		}
+	}
+	mutex_release(&vmm_regions_mutex);
+	return ok;
+}